@@ -38,7 +38,13 @@ SOURCES += \
     src/dbdata.cpp \
     src/harbour-jtox.cpp \
     src/dirmodel.cpp \
-    src/avatarprovider.cpp
+    src/avatarprovider.cpp \
+    src/searchmodel.cpp \
+    src/transferregistry.cpp \
+    src/filewriter.cpp \
+    src/toxthread.cpp \
+    src/profilestore.cpp \
+    src/ratelimiter.cpp
 
 OTHER_FILES += \
     qml/cover/CoverPage.qml \
@@ -99,7 +105,13 @@ HEADERS += \
     src/friendrequest.h \
     src/dbdata.h \
     src/dirmodel.h \
-    src/avatarprovider.h
+    src/avatarprovider.h \
+    src/searchmodel.h \
+    src/transferregistry.h \
+    src/filewriter.h \
+    src/toxthread.h \
+    src/profilestore.h \
+    src/ratelimiter.h
 
 DISTFILES += \
     qml/pages/About.qml \
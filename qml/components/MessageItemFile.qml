@@ -42,6 +42,15 @@ Column {
                 sizeText = qsTr("Unkown", "file size")
             }
 
+            if (file_stalled) {
+                sizeText += " " + qsTr("stalled")
+            } else if (file_speed > 0) {
+                sizeText += " " + Common.humanFileSize(file_speed, true) + "/s"
+                if (file_eta >= 0) {
+                    sizeText += " " + qsTr("%1 s left").arg(file_eta)
+                }
+            }
+
             return sizeText
         }
 
@@ -52,11 +61,4 @@ Column {
         value: file_position
         label: labelText()
     }
-
-    Timer {
-        running: eventmodel.friendID >= 0 && Common.isFileRunning(event_type) // run only when downloading this file
-        repeat: true
-        interval: 1000 // 1x a second
-        onTriggered: eventmodel.refreshFilePosition(index)
-    }
 } // main column
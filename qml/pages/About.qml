@@ -64,6 +64,18 @@ Page {
                 text: qsTr("Toxcore version") + " " + toxcore.majorVersion + "." + toxcore.minorVersion + "." + toxcore.patchVersion
             }
 
+            Label {
+                anchors {
+                    left: parent.left
+                    right: parent.right
+                    margins: Theme.paddingLarge
+                }
+                wrapMode: Text.WordWrap
+                color: Theme.secondaryColor
+                visible: toxcore.initialized
+                text: qsTr("Network wake-ups per minute") + " " + toxcore.wakeupsPerMinute
+            }
+
             Text {
                 anchors {
                     left: parent.left
@@ -249,6 +249,49 @@ Page {
                onClicked: multilineMessages.value = !multilineMessages.value
             }
 
+            SectionHeader {
+                text: qsTr("Transfers")
+            }
+
+            TextField {
+                id: uploadLimitField
+                anchors {
+                    left: parent.left
+                    right: parent.right
+                }
+                inputMethodHints: Qt.ImhDigitsOnly
+                text: toxcore.uploadLimit > 0 ? toxcore.uploadLimit : ""
+                label: qsTr("Upload limit in KiB/s")
+                placeholderText: qsTr("Upload limit in KiB/s, empty for none")
+                EnterKey.onClicked: toxcore.uploadLimit = parseInt(uploadLimitField.text) || 0
+            }
+
+            TextField {
+                id: downloadLimitField
+                anchors {
+                    left: parent.left
+                    right: parent.right
+                }
+                inputMethodHints: Qt.ImhDigitsOnly
+                text: toxcore.downloadLimit > 0 ? toxcore.downloadLimit : ""
+                label: qsTr("Download limit in KiB/s")
+                placeholderText: qsTr("Download limit in KiB/s, empty for none")
+                EnterKey.onClicked: toxcore.downloadLimit = parseInt(downloadLimitField.text) || 0
+            }
+
+            TextField {
+                id: stallTimeoutField
+                anchors {
+                    left: parent.left
+                    right: parent.right
+                }
+                inputMethodHints: Qt.ImhDigitsOnly
+                text: eventmodel.stallTimeout > 0 ? eventmodel.stallTimeout : ""
+                label: qsTr("Restart stalled transfers after seconds")
+                placeholderText: qsTr("Restart stalled transfers after seconds, empty for never")
+                EnterKey.onClicked: eventmodel.stallTimeout = parseInt(stallTimeoutField.text) || 0
+            }
+
             SectionHeader {
                 text: toxme.domain
             }
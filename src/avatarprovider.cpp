@@ -4,39 +4,6 @@
 
 namespace JTOX {
 
-    //------------------Avatar-----------------//
-
-    bool Avatar::equals(const QByteArray &fileID) const
-    {
-        return fFileID == fileID;
-    }
-
-    bool Avatar::isEmpty() const
-    {
-        return fData.isEmpty();
-    }
-
-    void Avatar::init(const QByteArray &fileID)
-    {
-        fData.clear();
-        fFileID = fileID;
-    }
-
-    bool Avatar::initialized() const
-    {
-        return !fFileID.isEmpty();
-    }
-
-    void Avatar::addData(const QByteArray &data)
-    {
-        fData += data;
-    }
-
-    const QByteArray& Avatar::data() const
-    {
-        return fData;
-    }
-
     //--------------AvatarProvider-------------//
 
     AvatarProvider::AvatarProvider(ToxCore& toxCore, DBData& dbData) : QQuickImageProvider(QQuickImageProvider::Pixmap),
@@ -62,9 +29,14 @@ namespace JTOX {
             return pixmap;
         }
 
-        // try to get from DB if there
+        // try to get from DB if there, we're on the image loader thread so use the worker connection
         QByteArray data;
-        if ( !fDBData.getAvatar(friend_id, data) ) {
+        bool found = false;
+        fDBData.execBlocking([friend_id, &data, &found](DBData& db) {
+            found = db.getAvatar(friend_id, data);
+        });
+
+        if ( !found ) {
             QPixmap empty(1, 1); // TODO: generate image from friend_id
             empty.fill(Qt::transparent);
             return empty;
@@ -84,8 +56,9 @@ namespace JTOX {
 
     void AvatarProvider::clearAvatar()
     {
-        fDBData.clearAvatar(-1);
-        emit profileAvatarChanged(QByteArray(), QByteArray());
+        fDBData.clearAvatarAsync(-1, [this]() {
+            emit profileAvatarChanged(QByteArray(), QByteArray());
+        });
     }
 
     void AvatarProvider::setAvatar(const QString& filePath)
@@ -129,50 +102,47 @@ namespace JTOX {
         }
 
         const QByteArray hash = fToxCore.hash(bytes);
-        fDBData.setAvatar(-1, hash, bytes);
-
-        emit profileAvatarChanged(hash, bytes); // sendouts are handled in friendmodel
+        fDBData.setAvatarAsync(-1, hash, bytes, [this, hash, bytes]() {
+            emit profileAvatarChanged(hash, bytes); // sendouts are handled in friendmodel
+        });
     }
 
     void AvatarProvider::onAvatarFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QByteArray& hash)
     {
-        TOX_ERR_FILE_CONTROL ctrl_error;
         TOX_FILE_CONTROL op = TOX_FILE_CONTROL_RESUME;
-        quint64 transferID = Utils::transferID(friend_id, file_number);
+        TransferRegistry& transfers = fToxCore.transfers();
+        const Transfer* running = transfers.get(friend_id, file_number);
 
-        if ( fAvatars.value(transferID).equals(hash) || fDBData.checkAvatar(friend_id, hash) || file_size > ToxCore::MAX_AVATAR_DATA_SIZE ) {
+        if ( (running != NULL && running->fileID() == hash) || fDBData.checkAvatar(friend_id, hash) || file_size > ToxCore::MAX_AVATAR_DATA_SIZE ) {
             qDebug() << "existing avatar or file too big\n";
             op = TOX_FILE_CONTROL_CANCEL; // no need, we have this one or it's too big
         } else {
-            fAvatars[transferID].init(hash);
+            Transfer* transfer = transfers.add(tkAvatarIn, friend_id, file_number, file_size);
+            transfer->setFileID(hash);
         }
 
-        tox_file_control(fToxCore.tox(), friend_id, file_number, op, &ctrl_error);
-
-        const QString strError = Utils::handleFileControlError(ctrl_error, true);
-        if ( !strError.isEmpty() ) { // don't fail on avatar requests, just log
-            qDebug() << "Unable to resume/cancel avatar download: " << strError << "\n";
-            return;
-        }
+        fToxCore.fileControl(friend_id, file_number, op); // errors only get logged, don't fail on avatar requests
     }
 
     void AvatarProvider::onFileChunkReceived(quint32 friend_id, quint32 file_number, quint64 position, const QByteArray &data)
     {
-        Q_UNUSED(position);
-        quint64 transferID = Utils::transferID(friend_id, file_number);
+        Transfer* transfer = fToxCore.transfers().get(friend_id, file_number);
 
-        if ( !fAvatars.contains(transferID) || !fAvatars.value(transferID).initialized() ) { // non-avatar chunk or cancelled
+        if ( transfer == NULL || transfer->kind() != tkAvatarIn ) { // non-avatar chunk or cancelled
             return;
         }
 
         if ( data.size() == 0 ) { // done
-            const QByteArray pixmapData = fAvatars.value(transferID).data();
+            const QByteArray pixmapData = transfer->data();
             const QByteArray hash = fToxCore.hash(pixmapData);
+            fToxCore.transfers().remove(transfer);
 
-            fDBData.setAvatar(friend_id, hash, pixmapData);
-            emit avatarChanged(friend_id);
+            fDBData.setAvatarAsync(friend_id, hash, pixmapData, [this, friend_id]() {
+                emit avatarChanged(friend_id);
+            });
         } else {
-            fAvatars[transferID].addData(data);
+            transfer->data() += data;
+            transfer->setPosition(position + data.size());
         }
     }
 
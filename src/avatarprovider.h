@@ -9,20 +9,6 @@
 
 namespace JTOX {
 
-    // avatar wrapper
-    class Avatar {
-    public:
-        bool equals(const QByteArray& fileID) const;
-        bool isEmpty() const;
-        void init(const QByteArray& fileID);
-        bool initialized() const;
-        void addData(const QByteArray& data);
-        const QByteArray& data() const;
-    private:
-        QByteArray fFileID;
-        QByteArray fData;
-    };
-
     class AvatarProvider : public QThread, public QQuickImageProvider
     {
         Q_OBJECT
@@ -42,7 +28,6 @@ namespace JTOX {
     private:
         ToxCore& fToxCore;
         DBData& fDBData;
-        QMap <quint64, Avatar> fAvatars; // in memory storage
         QString fAvatarFilePath;
     };
 
@@ -15,21 +15,23 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include "toxcore.h"
-#include "utils.h"
+#include "toxthread.h"
 #include <QObject>
 #include <QString>
 #include <QDebug>
 
 namespace JTOX {
 
+    // callbacks run inside tox_iterate on the network thread, they only queue events for ToxCore
+
     void c_connection_status_cb(Tox *tox, TOX_CONNECTION connection_status, void *user_data)
     {
         //qDebug() << "c_connection_status_cb\n";
         Q_UNUSED(tox);
-        Q_UNUSED(connection_status);
-        ToxCore* jTox = (ToxCore*) user_data;
-        jTox->setConnectionStatus();
+        ToxEvent event;
+        event.type = teSelfConnectionStatus;
+        event.value = connection_status;
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_friend_request_cb(Tox *tox, const uint8_t *public_key, const uint8_t *message,
@@ -37,15 +39,13 @@ namespace JTOX {
     {
         //qDebug() << "c_friend_request_cb\n";
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-        QString msg;
+        ToxEvent event;
+        event.type = teFriendRequest;
         if ( message != NULL && length > 0 ) {
-            msg = QString::fromUtf8((char*)message, length);
+            event.text = QString::fromUtf8((char*)message, length);
         }
-        const QByteArray pk((char*) public_key, TOX_PUBLIC_KEY_SIZE);
-        const QString hexKey = pk.toHex();
-
-        jTox->onFriendRequest(hexKey, msg);
+        event.data = QByteArray((char*) public_key, TOX_PUBLIC_KEY_SIZE);
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_friend_message_cb(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
@@ -53,118 +53,140 @@ namespace JTOX {
     {
         //qDebug() << "c_friend_message_cb\n";
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        jTox->onMessageReceived(friend_number, type, QString::fromUtf8((char*)message, length));
+        ToxEvent event;
+        event.type = teFriendMessage;
+        event.friendID = friend_number;
+        event.value = type;
+        event.text = QString::fromUtf8((char*)message, length);
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_friend_connection_status_cb(Tox *tox, uint32_t friend_number, TOX_CONNECTION connection_status,
                                        void *user_data) {
         //qDebug() << "c_friend_connection_status_cb\n";
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        jTox->onFriendConStatusChanged(friend_number, connection_status);
+        ToxEvent event;
+        event.type = teFriendConnectionStatus;
+        event.friendID = friend_number;
+        event.value = connection_status;
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_friend_name_cb(Tox *tox, uint32_t friend_number, const uint8_t *name, size_t length, void *user_data) {
         //qDebug() << "c_friend_name_cb\n";
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        jTox->onFriendNameChanged(friend_number, QString::fromUtf8((char*) name, length));
+        ToxEvent event;
+        event.type = teFriendName;
+        event.friendID = friend_number;
+        event.text = QString::fromUtf8((char*) name, length);
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_friend_status_cb(Tox *tox, uint32_t friend_number, TOX_USER_STATUS status, void *user_data) {
         //qDebug() << "c_friend_status_cb\n";
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        jTox->onFriendStatusChanged(friend_number, status);
+        ToxEvent event;
+        event.type = teFriendStatus;
+        event.friendID = friend_number;
+        event.value = status;
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_friend_status_message_cb(Tox *tox, uint32_t friend_number, const uint8_t *message, size_t length,
             void *user_data) {
         //qDebug() << "c_friend_status_message_cb\n";
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        jTox->onFriendStatusMsgChanged(friend_number, QString::fromUtf8((char*) message, length));
+        ToxEvent event;
+        event.type = teFriendStatusMessage;
+        event.friendID = friend_number;
+        event.text = QString::fromUtf8((char*) message, length);
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_friend_typing_cb(Tox *tox, uint32_t friend_number, bool is_typing, void *user_data) {
         //qDebug() << "c_friend_typing_cb\n";
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        jTox->onFriendTypingChanged(friend_number, is_typing);
+        ToxEvent event;
+        event.type = teFriendTyping;
+        event.friendID = friend_number;
+        event.value = is_typing;
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_friend_read_receipt_cb(Tox *tox, uint32_t friend_number, uint32_t message_id, void *user_data) {
         //qDebug() << "c_friend_read_receipt_cb\n";
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        jTox->onMessageDelivered(friend_number, message_id);
+        ToxEvent event;
+        event.type = teFriendReadReceipt;
+        event.friendID = friend_number;
+        event.number = message_id;
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_tox_file_recv_control_cb(Tox *tox, uint32_t friend_number, uint32_t file_number,
                                     TOX_FILE_CONTROL control, void *user_data) {
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        switch ( control ) {
-            case TOX_FILE_CONTROL_CANCEL: return jTox->onFileCanceled(friend_number, file_number);
-            case TOX_FILE_CONTROL_PAUSE: return jTox->onFilePaused(friend_number, file_number);
-            case TOX_FILE_CONTROL_RESUME: return jTox->onFileResumed(friend_number, file_number);
-            default: return;
-        }
+        ToxEvent event;
+        event.type = teFileControl;
+        event.friendID = friend_number;
+        event.number = file_number;
+        event.value = control;
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_tox_file_recv_cb(Tox *tox, uint32_t friend_number, uint32_t file_number, uint32_t kind, uint64_t file_size,
                             const uint8_t *filename, size_t filename_length, void *user_data) {
-        Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        if ( kind == TOX_FILE_KIND_AVATAR ) {
-            TOX_ERR_FILE_GET error;
-            QByteArray fileID(TOX_FILE_ID_LENGTH, 0);
-            uint8_t* file_id = (quint8*) fileID.data();
-            tox_file_get_file_id(tox, friend_number, file_number, file_id, &error);
-            if ( error != TOX_ERR_FILE_GET_OK ) {
-                TOX_ERR_FILE_CONTROL ctrl_error;
-                tox_file_control(tox, friend_number, file_number, TOX_FILE_CONTROL_CANCEL, &ctrl_error);
-                if ( ctrl_error != TOX_ERR_FILE_CONTROL_OK ) {
-                    qDebug() << "Error canceling avatar request: " << ctrl_error << "\n";
-                }
-                return;
+        TOX_ERR_FILE_GET error;
+        QByteArray fileID(TOX_FILE_ID_LENGTH, 0);
+        uint8_t* file_id = (quint8*) fileID.data();
+        tox_file_get_file_id(tox, friend_number, file_number, file_id, &error);
+        if ( error != TOX_ERR_FILE_GET_OK ) {
+            TOX_ERR_FILE_CONTROL ctrl_error;
+            tox_file_control(tox, friend_number, file_number, TOX_FILE_CONTROL_CANCEL, &ctrl_error);
+            if ( ctrl_error != TOX_ERR_FILE_CONTROL_OK ) {
+                qDebug() << "Error canceling file request: " << ctrl_error << "\n";
             }
+            return;
+        }
 
-            jTox->onAvatarFileReceived(friend_number, file_number, file_size, fileID);
-        } else { // std. file
+        ToxEvent event;
+        event.type = kind == TOX_FILE_KIND_AVATAR ? teAvatarReceived : teFileReceived;
+        event.friendID = friend_number;
+        event.number = file_number;
+        event.position = file_size;
+        event.data = fileID; // file_id lets interrupted ones resume
+        if ( kind != TOX_FILE_KIND_AVATAR ) { // std. file
             if ( filename_length > TOX_MAX_FILENAME_LENGTH ) { // probably not required but safer
                 filename_length = TOX_MAX_FILENAME_LENGTH;
             }
 
-            const QString fn = QString::fromUtf8((char*)filename, filename_length);
-            jTox->onFileReceived(friend_number, file_number, file_size, fn);
+            event.text = QString::fromUtf8((char*)filename, filename_length);
         }
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_tox_file_recv_chunk_cb(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position,
                                   const uint8_t *data, size_t length, void *user_data) {
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        jTox->onFileChunkReceived(friend_number, file_number, position, data, length);
+        ToxEvent event;
+        event.type = teFileChunk;
+        event.friendID = friend_number;
+        event.number = file_number;
+        event.position = position;
+        event.data = QByteArray((char*) data, length); // only valid during the callback
+        ((ToxThread*) user_data)->push(event);
     }
 
     void c_tox_file_chunk_request_cb(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position,
                                      size_t length, void *user_data) {
         Q_UNUSED(tox);
-        ToxCore* jTox = (ToxCore*) user_data;
-
-        jTox->onFileChunkRequest(friend_number, file_number, position, length);
+        ToxEvent event;
+        event.type = teFileChunkRequest;
+        event.friendID = friend_number;
+        event.number = file_number;
+        event.position = position;
+        event.length = length;
+        ((ToxThread*) user_data)->push(event);
     }
 
 
@@ -3,87 +3,389 @@
 #include <QDir>
 #include <QStandardPaths>
 #include <QSqlError>
+#include <QRegularExpression>
+#include <QStringList>
 #include <QDebug>
+#include <QMutexLocker>
+#include <QSemaphore>
+#include <limits>
+#include <sodium.h>
 
 namespace JTOX {
 
-    DBData::DBData(EncryptSave& encryptSave) :
+    const int SEARCH_BACKLOG_BATCH = 500; // rows indexed per worker job so other jobs can interleave
+    const int ROW_BACKLOG_BATCH = 500; // rows re-encrypted per worker job
+
+    //******************************DBWorker******************************//
+
+    DBWorker::DBWorker(EncryptSave& encryptSave) : QThread(0), fEncryptSave(encryptSave),
+        fMutex(), fJobAdded(), fJobs(), fStopping(false)
+    {
+        qRegisterMetaType<DBCallback>();
+        // queued so callbacks run on the GUI thread in the order jobs finished
+        connect(this, &DBWorker::jobDone, this, &DBWorker::onJobDone, Qt::QueuedConnection);
+    }
+
+    DBWorker::~DBWorker()
+    {
+        fMutex.lock();
+        fStopping = true;
+        fJobAdded.wakeAll();
+        fMutex.unlock();
+
+        wait(); // remaining jobs are finished first
+    }
+
+    void DBWorker::run()
+    {
+        DBData db(fEncryptSave, "jtox_worker"); // connection must be created on this thread
+
+        forever {
+            fMutex.lock();
+            while ( fJobs.isEmpty() && !fStopping ) {
+                fJobAdded.wait(&fMutex);
+            }
+
+            if ( fJobs.isEmpty() ) { // stopping
+                fMutex.unlock();
+                break;
+            }
+
+            const DBJob job = fJobs.dequeue();
+            fMutex.unlock();
+
+            const DBCallback callback = job(db);
+            db.flush(); // commit before results reach the models
+            if ( callback ) {
+                emit jobDone(callback);
+            }
+        }
+    }
+
+    void DBWorker::post(const DBJob& job)
+    {
+        QMutexLocker locker(&fMutex);
+        fJobs.enqueue(job);
+        fJobAdded.wakeOne();
+    }
+
+    void DBWorker::onJobDone(const DBCallback& callback)
+    {
+        callback();
+    }
+
+    //*******************************DBData*******************************//
+
+    DBData::DBData(EncryptSave& encryptSave, const QString& connectionName) :
         fEncryptSave(encryptSave),
-        fDB(QSqlDatabase::addDatabase("QSQLITE"))
+        fDB(connectionName.isEmpty() ? QSqlDatabase::addDatabase("QSQLITE") : QSqlDatabase::addDatabase("QSQLITE", connectionName)),
+        fWorker(NULL), fCommitTimer(), fInTransaction(false), fSearchBacklogRunning(false), fRowBacklogRunning(false)
     {
         const QDir dir(QStandardPaths::writableLocation(QStandardPaths::DataLocation));
         if ( !dir.exists() ) {
             dir.mkpath(dir.absolutePath());
         }
         fDB.setDatabaseName(dir.absoluteFilePath("jtox.sqlite"));
-        fDB.open();
+        fDB.setConnectOptions("QSQLITE_BUSY_TIMEOUT=30000"); // main and worker connections wait on each other's writes
         if ( !fDB.open() ) {
             Utils::fatal( fDB.lastError().text() );
         }
 
+        // WAL keeps readers and the writer apart and NORMAL sync only fsyncs on checkpoints
+        QSqlQuery pragmaQuery(fDB);
+        if ( !pragmaQuery.exec("PRAGMA journal_mode = WAL") ) {
+            Utils::fatal("Unable to set journal mode: " + pragmaQuery.lastError().text());
+        }
+        if ( !pragmaQuery.exec("PRAGMA synchronous = NORMAL") ) {
+            Utils::fatal("Unable to set synchronous mode: " + pragmaQuery.lastError().text());
+        }
+        pragmaQuery.finish();
+
         switch ( userVersion() ) {
             case 0: createTables(); upgradeToV1(); // empty or unversioned (1.2.0-)
             case 1: upgradeToV2();
+            case 2: upgradeToV3();
+            case 3: upgradeToV4();
+            case 4: upgradeToV5();
+            case 5: upgradeToV6();
+            case 6: upgradeToV7();
+            case 7: upgradeToV8();
+            case 8: upgradeToV9();
         }
         prepareQueries();
+
+        // group commit, all writes done in one event loop pass share a transaction
+        fCommitTimer.setInterval(0);
+        fCommitTimer.setSingleShot(true);
+        QObject::connect(&fCommitTimer, &QTimer::timeout, [this]() { flush(); });
+
+        if ( connectionName.isEmpty() ) {
+            fWorker = new DBWorker(encryptSave);
+            fWorker->start();
+        }
+    }
+
+    DBData::~DBData()
+    {
+        flush();
+        delete fWorker; // waits for pending jobs
     }
 
     bool DBData::getEvent(int event_id, Event& result)
     {
-        fEventSelectOneQuery.bindValue(":id", event_id);
-        fEventSelectOneQuery.bindValue(":friend_id", -1);
-        fEventSelectOneQuery.bindValue(":send_id", -1);
-        fEventSelectOneQuery.bindValue(":event_type", -1);
+        fEventSelectByIDQuery.bindValue(":id", event_id);
 
-        if ( !fEventSelectOneQuery.exec() ) {
-            Utils::fatal("Error on event select query exec: " + fEventSelectOneQuery.lastError().text());
+        return fetchEvent(fEventSelectByIDQuery, result);
+    }
+
+    bool DBData::getEvent(quint32 friend_id, quint32 send_id, EventType event_type, Event& result)
+    {
+        fEventSelectBySendIDQuery.bindValue(":friend_id", friend_id);
+        fEventSelectBySendIDQuery.bindValue(":send_id", send_id);
+        fEventSelectBySendIDQuery.bindValue(":event_type", event_type);
+
+        return fetchEvent(fEventSelectBySendIDQuery, result);
+    }
+
+    void DBData::getEvents(EventList& list, quint32 friendID, int eventType)
+    {
+        loadDBKeys();
+        fEventSelectQuery.bindValue(":friend_id", friendID);
+        fEventSelectQuery.bindValue(":event_type", eventType);
+
+        if ( !fEventSelectQuery.exec() ) {
+            Utils::fatal("Error on event select query exec: " + fEventSelectQuery.lastError().text());
         }
 
-        if ( !fEventSelectOneQuery.next() ) {
-            return false;
+        list.clear();
+        while ( fEventSelectQuery.next() ) {
+            list.push_front(parseEvent(fEventSelectQuery, true));
         }
+        fEventSelectQuery.finish();
+        decryptEvents(list);
+    }
 
-        result = parseEvent(fEventSelectOneQuery);
-        return true;
+    void DBData::getEventPage(EventList& list, quint32 friendID, int beforeID, int limit)
+    {
+        loadDBKeys();
+        fEventPageQuery.bindValue(":friend_id", friendID);
+        fEventPageQuery.bindValue(":before_id", beforeID < 0 ? std::numeric_limits<qint64>::max() : beforeID);
+        fEventPageQuery.bindValue(":limit", limit);
+
+        if ( !fEventPageQuery.exec() ) {
+            Utils::fatal("Error on event page query exec: " + fEventPageQuery.lastError().text());
+        }
+
+        list.clear();
+        while ( fEventPageQuery.next() ) {
+            list.append(parseEvent(fEventPageQuery, true));
+        }
+        fEventPageQuery.finish();
     }
 
-    bool DBData::getEvent(quint32 friend_id, quint32 send_id, EventType event_type, Event& result)
+    const QString DBData::decryptMessage(const QByteArray& cipher)
+    {
+        loadDBKeys();
+        return fEncryptSave.decryptRow(cipher);
+    }
+
+    void DBData::getEvents(EventList& list, const QList<int>& ids)
     {
-        fEventSelectOneQuery.bindValue(":id", -1);
-        fEventSelectOneQuery.bindValue(":friend_id", friend_id);
-        fEventSelectOneQuery.bindValue(":send_id", send_id);
-        fEventSelectOneQuery.bindValue(":event_type", event_type);
+        loadDBKeys();
+        list.clear();
+        foreach ( int id, ids ) {
+            fEventSelectByIDQuery.bindValue(":id", id);
+            if ( !fEventSelectByIDQuery.exec() ) {
+                Utils::fatal("Error on event select query exec: " + fEventSelectByIDQuery.lastError().text());
+            }
+
+            if ( fEventSelectByIDQuery.next() ) {
+                list.append(parseEvent(fEventSelectByIDQuery, true));
+            }
+        }
+        fEventSelectByIDQuery.finish();
+        decryptEvents(list);
+    }
+
+    void DBData::decryptEvents(EventList& list)
+    {
+        QList<QByteArray> ciphers;
+        foreach ( const Event& event, list ) {
+            if ( event.messageEncrypted() ) {
+                ciphers << event.cipher();
+            }
+        }
+
+        const QStringList messages = fEncryptSave.decryptRows(ciphers);
+        int i = 0;
+        for ( int row = 0; row < list.size(); row++ ) {
+            if ( list.at(row).messageEncrypted() ) {
+                list[row].setMessage(messages.at(i++));
+            }
+        }
+    }
+
+    void DBData::searchEvents(QList<int>& ids, const QString& text, qint64 friendID, int limit)
+    {
+        ids.clear();
+        const QStringList tokens = Utils::searchTokens(text);
+        if ( tokens.isEmpty() ) {
+            return;
+        }
+
+        loadDBKeys();
+        QStringList values; // blind tokens are plain integers, safe to inline into the IN list
+        foreach ( const QString& token, tokens ) {
+            values << QString::number(fEncryptSave.blindToken(token));
+        }
+
+        // rank by number of matched words, then recency, separate statements so one friend uses (token, friend_id)
+        QSqlQuery query(fDB);
+        const QString friendFilter = friendID < 0 ? QString() : " AND friend_id = :friend_id";
+        query.prepare("SELECT event_id FROM search_tokens "
+                      "WHERE token IN (" + values.join(',') + ")" + friendFilter + " "
+                      "GROUP BY event_id "
+                      "ORDER BY count(*) DESC, event_id DESC "
+                      "LIMIT :limit");
+        if ( friendID >= 0 ) {
+            query.bindValue(":friend_id", friendID);
+        }
+        query.bindValue(":limit", limit);
+
+        if ( !query.exec() ) {
+            Utils::fatal("Error on search query exec: " + query.lastError().text());
+        }
+
+        while ( query.next() ) {
+            ids.append(query.value(0).toInt());
+        }
+    }
+
+    bool DBData::indexSearchBacklog(int batchSize)
+    {
+        if ( !fSearchBackfillSelectQuery.exec() ) {
+            Utils::fatal("Error on search backfill query exec: " + fSearchBackfillSelectQuery.lastError().text());
+        }
+
+        if ( !fSearchBackfillSelectQuery.first() ) {
+            return false; // all done
+        }
+
+        const int nextID = fSearchBackfillSelectQuery.value(0).toInt();
+        fSearchBackfillSelectQuery.finish();
+
+        beginWrite();
+        loadDBKeys();
+
+        fSearchBacklogQuery.bindValue(":next_id", nextID);
+        fSearchBacklogQuery.bindValue(":limit", batchSize);
+        if ( !fSearchBacklogQuery.exec() ) {
+            Utils::fatal("Error on search backlog query exec: " + fSearchBacklogQuery.lastError().text());
+        }
 
-        if ( !fEventSelectOneQuery.exec() ) {
-            Utils::fatal("Error on event select query exec: " + fEventSelectOneQuery.lastError().text());
+        int lowestID = nextID;
+        QList<int> ids;
+        QList<quint32> friendIDs;
+        QList<QByteArray> ciphers;
+        while ( fSearchBacklogQuery.next() ) {
+            lowestID = fSearchBacklogQuery.value(0).toInt();
+            ids << lowestID;
+            friendIDs << fSearchBacklogQuery.value(1).toUInt();
+            ciphers << fSearchBacklogQuery.value(2).toByteArray();
         }
+        fSearchBacklogQuery.finish();
 
-        if ( !fEventSelectOneQuery.next() ) {
+        const QStringList messages = fEncryptSave.decryptRows(ciphers);
+        for ( int i = 0; i < ids.size(); i++ ) {
+            indexMessage(ids.at(i), friendIDs.at(i), messages.at(i));
+        }
+
+        const int rows = ids.size();
+
+        if ( rows < batchSize ) {
+            if ( !fSearchBackfillDeleteQuery.exec() ) {
+                Utils::fatal("Unable to finish search backfill: " + fSearchBackfillDeleteQuery.lastError().text());
+            }
             return false;
         }
 
-        result = parseEvent(fEventSelectOneQuery);
+        fSearchBackfillUpdateQuery.bindValue(":next_id", lowestID - 1);
+        if ( !fSearchBackfillUpdateQuery.exec() ) {
+            Utils::fatal("Unable to update search backfill: " + fSearchBackfillUpdateQuery.lastError().text());
+        }
 
         return true;
     }
 
-    void DBData::getEvents(EventList& list, quint32 friendID, int eventType)
+    bool DBData::migrateRowBacklog(int batchSize)
     {
-        fEventSelectQuery.bindValue(":friend_id", friendID);
-        fEventSelectQuery.bindValue(":event_type", eventType);
+        if ( !fRowMigrationSelectQuery.exec() ) {
+            Utils::fatal("Error on row migration query exec: " + fRowMigrationSelectQuery.lastError().text());
+        }
 
-        if ( !fEventSelectQuery.exec() ) {
-            Utils::fatal("Error on event select query exec: " + fEventSelectQuery.lastError().text());
+        if ( !fRowMigrationSelectQuery.first() ) {
+            return false; // all done
         }
 
-        list.clear();
-        while ( fEventSelectQuery.next() ) {
-            list.push_front(parseEvent(fEventSelectQuery));
+        const int nextID = fRowMigrationSelectQuery.value(0).toInt();
+        fRowMigrationSelectQuery.finish();
+
+        beginWrite();
+        loadDBKeys();
+
+        fRowBacklogQuery.bindValue(":next_id", nextID);
+        fRowBacklogQuery.bindValue(":limit", batchSize);
+        if ( !fRowBacklogQuery.exec() ) {
+            Utils::fatal("Error on row backlog query exec: " + fRowBacklogQuery.lastError().text());
+        }
+
+        int rows = 0;
+        int lowestID = nextID;
+        QVariantList idValues;
+        QList<QByteArray> ciphers;
+        while ( fRowBacklogQuery.next() ) {
+            lowestID = fRowBacklogQuery.value(0).toInt();
+            const QByteArray message = fRowBacklogQuery.value(1).toByteArray();
+            if ( fEncryptSave.isEncrypted(message) ) { // legacy row
+                idValues << lowestID;
+                ciphers << message;
+            }
+            rows++;
+        }
+        fRowBacklogQuery.finish();
+
+        QVariantList messageValues;
+        foreach ( const QString& message, fEncryptSave.decryptRows(ciphers) ) {
+            messageValues << fEncryptSave.encryptRow(message);
         }
+
+        if ( !idValues.isEmpty() ) {
+            fEventUpdateMessageQuery.bindValue(":id", idValues);
+            fEventUpdateMessageQuery.bindValue(":message", messageValues);
+            if ( !fEventUpdateMessageQuery.execBatch() ) {
+                Utils::fatal("Unable to re-encrypt events: " + fEventUpdateMessageQuery.lastError().text());
+            }
+        }
+
+        if ( rows < batchSize ) {
+            if ( !fRowMigrationDeleteQuery.exec() ) {
+                Utils::fatal("Unable to finish row migration: " + fRowMigrationDeleteQuery.lastError().text());
+            }
+            return false;
+        }
+
+        fRowMigrationUpdateQuery.bindValue(":next_id", lowestID - 1);
+        if ( !fRowMigrationUpdateQuery.exec() ) {
+            Utils::fatal("Unable to update row migration: " + fRowMigrationUpdateQuery.lastError().text());
+        }
+
+        return true;
     }
 
-    void DBData::getTransfers(EventList &list)
+    void DBData::getTransfers(EventList &list, quint32 friendID)
     {
+        loadDBKeys();
+        fTransfersSelectQuery.bindValue(":friend_id", friendID);
         if ( !fTransfersSelectQuery.exec() ) {
             Utils::fatal("Error on transfers select query exec: " + fTransfersSelectQuery.lastError().text());
         }
@@ -93,26 +395,30 @@ namespace JTOX {
         while ( fTransfersSelectQuery.next() ) {
             list.append(parseEvent(fTransfersSelectQuery));
         }
+        fTransfersSelectQuery.finish();
     }
 
     int DBData::getUnviewedEventCount(qint64 friendID)
     {
-        // can't use same placeholder in query so we must use 2 placeholders with 1 value
-        fEventUnviewedCountQuery.bindValue(":friend_id", friendID);
-        fEventUnviewedCountQuery.bindValue(":friend_id2", friendID);
-        fEventUnviewedCountQuery.bindValue(":event_type", etMessageInUnread);
+        // counts are kept up to date by the friend_stats triggers
+        QSqlQuery& query = friendID < 0 ? fFriendStatsTotalQuery : fFriendStatsUnviewedQuery;
+        if ( friendID >= 0 ) {
+            query.bindValue(":friend_id", friendID);
+        }
 
-        if ( !fEventUnviewedCountQuery.exec() ) {
-            qDebug() << fEventUnviewedCountQuery.executedQuery() << "\n";
-            Utils::fatal("Error on unviewed count query exec: " + fEventUnviewedCountQuery.lastError().text());
+        if ( !query.exec() ) {
+            qDebug() << query.executedQuery() << "\n";
+            Utils::fatal("Error on unviewed count query exec: " + query.lastError().text());
         }
 
-        if ( !fEventUnviewedCountQuery.first() ) {
-            Utils::fatal("Unable to fetch count row for unviewed count query");
+        if ( !query.first() ) {
+            query.finish();
+            return 0; // no events for this friend yet
         }
 
         bool ok = false;
-        int count = fEventUnviewedCountQuery.value(0).toInt(&ok);
+        int count = query.value(0).toInt(&ok);
+        query.finish();
         if ( !ok ) {
             Utils::fatal("Unable to get event count int");
         }
@@ -120,12 +426,28 @@ namespace JTOX {
         return count;
     }
 
+    void DBData::getUnviewedEventCounts(QMap<quint32, int>& counts)
+    {
+        if ( !fFriendStatsUnviewedListQuery.exec() ) {
+            Utils::fatal("Error on unviewed counts query exec: " + fFriendStatsUnviewedListQuery.lastError().text());
+        }
+
+        counts.clear();
+        while ( fFriendStatsUnviewedListQuery.next() ) {
+            counts[fFriendStatsUnviewedListQuery.value(0).toUInt()] = fFriendStatsUnviewedListQuery.value(1).toInt();
+        }
+        fFriendStatsUnviewedListQuery.finish();
+    }
+
     int DBData::insertEvent(Event& event)
     {
+        beginWrite();
+
         fEventInsertQuery.bindValue(":send_id", event.sendID() >= 0 ? event.sendID() : QVariant(QVariant::Int));
         fEventInsertQuery.bindValue(":friend_id", event.friendID());
         fEventInsertQuery.bindValue(":event_type", event.type());
-        fEventInsertQuery.bindValue(":message", fEncryptSave.encrypt(event.isFile() ? event.fileName() : event.message()));
+        loadDBKeys();
+        fEventInsertQuery.bindValue(":message", fEncryptSave.encryptRow(event.isFile() ? event.fileName() : event.message()));
         fEventInsertQuery.bindValue(":file_path", event.filePath());
         fEventInsertQuery.bindValue(":file_id", event.fileID());
         fEventInsertQuery.bindValue(":file_size", event.fileSize());
@@ -152,6 +474,11 @@ namespace JTOX {
         }
         event.setID(id);
         event.setCreatedAt(fLastEventSelectQuery.value(1).toDateTime());
+        fLastEventSelectQuery.finish();
+
+        if ( !event.isFile() ) {
+            indexMessage(id, event.friendID(), event.message());
+        }
         return id;
     }
 
@@ -160,18 +487,97 @@ namespace JTOX {
         return updateEvent(id, eventType, 0, 0);
     }
 
-    void DBData::deliverEvent(quint32 sendID, quint32 friendID)
+    void DBData::updateEventHash(int id, const QByteArray& hash)
+    {
+        beginWrite();
+
+        fEventUpdateHashQuery.bindValue(":id", id);
+        fEventUpdateHashQuery.bindValue(":file_hash", hash);
+
+        if ( !fEventUpdateHashQuery.exec() ) {
+            Utils::fatal("Unable to update event hash: " + fEventUpdateHashQuery.lastError().text());
+        }
+    }
+
+    void DBData::updateEventsSent(const QList<int>& ids, const QList<qint64>& sendIDs)
+    {
+        if ( ids.isEmpty() ) {
+            return;
+        }
+
+        beginWrite();
+
+        QVariantList idValues;
+        QVariantList sendIDValues;
+        QVariantList typeValues;
+        for ( int i = 0; i < ids.size(); i++ ) {
+            idValues << ids.at(i);
+            sendIDValues << sendIDs.at(i);
+            typeValues << etMessageOutPending;
+        }
+
+        fEventUpdateSentQuery.bindValue(":id", idValues);
+        fEventUpdateSentQuery.bindValue(":send_id", sendIDValues);
+        fEventUpdateSentQuery.bindValue(":event_type", typeValues);
+
+        if ( !fEventUpdateSentQuery.execBatch() ) {
+            Utils::fatal("Unable to update sent events: " + fEventUpdateSentQuery.lastError().text());
+        }
+    }
+
+    int DBData::viewEvents(quint32 friendID, int maxID)
+    {
+        beginWrite();
+
+        fEventViewedQuery.bindValue(":friend_id", friendID);
+        fEventViewedQuery.bindValue(":max_id", maxID);
+
+        if ( !fEventViewedQuery.exec() ) {
+            Utils::fatal("Unable to update events to viewed state: " + fEventViewedQuery.lastError().text());
+        }
+
+        return fEventViewedQuery.numRowsAffected();
+    }
+
+    int DBData::deliverEvents(quint32 friendID, const QList<quint32>& sendIDs)
     {
-        fEventDeliveredQuery.bindValue(":friend_id", friendID);
-        fEventDeliveredQuery.bindValue(":send_id", sendID);
+        if ( sendIDs.isEmpty() ) {
+            return 0;
+        }
+
+        beginWrite();
 
-        if ( !fEventDeliveredQuery.exec() ) {
-            Utils::fatal("Unable to update event to delivered state: " + fEventDeliveredQuery.lastError().text());
+        // IN lists can't be bound, the values are plain integers so inlining them is safe
+        QStringList values;
+        foreach ( quint32 sendID, sendIDs ) {
+            values << QString::number(sendID);
+        }
+
+        QSqlQuery query(fDB);
+        query.prepare("UPDATE events SET event_type = 1 "
+                      "WHERE friend_id = :friend_id AND event_type = 3 AND send_id IN (" + values.join(',') + ")");
+        query.bindValue(":friend_id", friendID);
+
+        if ( !query.exec() ) {
+            Utils::fatal("Unable to update events to delivered state: " + query.lastError().text());
+        }
+
+        return query.numRowsAffected();
+    }
+
+    void DBData::cancelStaleTransfers()
+    {
+        beginWrite();
+
+        if ( !fStaleTransfersCancelQuery.exec() ) {
+            Utils::fatal("Unable to cancel transfers: " + fStaleTransfersCancelQuery.lastError().text());
         }
     }
 
     void DBData::deleteEvent(int id)
     {
+        beginWrite();
+
         fEventDeleteQuery.bindValue(":id", id);
 
         if ( !fEventDeleteQuery.exec() ) {
@@ -181,6 +587,8 @@ namespace JTOX {
 
     void DBData::insertRequest(FriendRequest& request)
     {
+        beginWrite();
+
         fRequestInsertQuery.bindValue(":address", request.getAddress());
         fRequestInsertQuery.bindValue(":message", request.getMessage());
         fRequestInsertQuery.bindValue(":name", request.getName());
@@ -199,6 +607,7 @@ namespace JTOX {
 
         bool ok = false;
         const QVariant val = fLastRequestSelectQuery.value(0);
+        fLastRequestSelectQuery.finish();
         int id = val.toInt(&ok);
         if ( !ok ) {
             Utils::fatal("Error on last request query int cast: " + val.toString());
@@ -209,6 +618,8 @@ namespace JTOX {
 
     void DBData::updateRequest(const FriendRequest& request)
     {
+        beginWrite();
+
         fRequestUpdateQuery.bindValue(":id", request.getID());
         fRequestUpdateQuery.bindValue(":name", request.getName());
 
@@ -219,6 +630,8 @@ namespace JTOX {
 
     void DBData::deleteRequest(const FriendRequest& request)
     {
+        beginWrite();
+
         fRequestDeleteQuery.bindValue(":id", request.getID());
         fRequestDeleteQuery.bindValue(":id2", request.getID()); // double bind trick
 
@@ -237,12 +650,58 @@ namespace JTOX {
 
         if ( fGetAvatarQuery.next() && !fGetAvatarQuery.value(0).isNull() ) {
             result = fGetAvatarQuery.value(0).toByteArray();
+            fGetAvatarQuery.finish();
             return result.size() > 0;
         }
 
+        fGetAvatarQuery.finish();
         return false;
     }
 
+    bool DBData::getReceivedFile(const QByteArray& fileID, quint64 fileSize, QString& filePath)
+    {
+        fReceivedFileSelectQuery.bindValue(":file_id", fileID);
+        fReceivedFileSelectQuery.bindValue(":file_size", fileSize);
+
+        if ( !fReceivedFileSelectQuery.exec() ) {
+            Utils::fatal("Unable to get received file: " + fReceivedFileSelectQuery.lastError().text());
+        }
+
+        if ( fReceivedFileSelectQuery.next() ) {
+            filePath = fReceivedFileSelectQuery.value(0).toString();
+            fReceivedFileSelectQuery.finish();
+            return true;
+        }
+
+        fReceivedFileSelectQuery.finish();
+        return false;
+    }
+
+    void DBData::addReceivedFile(const QByteArray& fileID, quint64 fileSize, const QString& filePath)
+    {
+        beginWrite();
+
+        fReceivedFileInsertQuery.bindValue(":file_id", fileID);
+        fReceivedFileInsertQuery.bindValue(":file_size", fileSize);
+        fReceivedFileInsertQuery.bindValue(":file_path", filePath);
+
+        if ( !fReceivedFileInsertQuery.exec() ) {
+            Utils::fatal("Unable to add received file: " + fReceivedFileInsertQuery.lastError().text());
+        }
+    }
+
+    void DBData::removeReceivedFile(const QByteArray& fileID, quint64 fileSize)
+    {
+        beginWrite();
+
+        fReceivedFileDeleteQuery.bindValue(":file_id", fileID);
+        fReceivedFileDeleteQuery.bindValue(":file_size", fileSize);
+
+        if ( !fReceivedFileDeleteQuery.exec() ) {
+            Utils::fatal("Unable to remove received file: " + fReceivedFileDeleteQuery.lastError().text());
+        }
+    }
+
     bool DBData::checkAvatar(qint64 friend_id, const QByteArray& hash)
     {
         fCheckAvatarQuery.bindValue(":friend_id", friend_id);
@@ -255,6 +714,7 @@ namespace JTOX {
         if ( fCheckAvatarQuery.next() ) {
             bool ok = false;
             int count = fCheckAvatarQuery.value(0).toInt(&ok);
+            fCheckAvatarQuery.finish();
 
             if ( !ok ) {
                 Utils::fatal("Unable to parse avatar count integer");
@@ -269,6 +729,8 @@ namespace JTOX {
 
     void DBData::clearAvatar(qint64 friend_id)
     {
+        beginWrite();
+
         fClearAvatarQuery.bindValue(":friend_id", friend_id); // -1 for "me"
 
         if ( !fClearAvatarQuery.exec() ) {
@@ -282,6 +744,8 @@ namespace JTOX {
             return clearAvatar(friend_id);
         }
 
+        beginWrite();
+
         fSetAvatarQuery.bindValue(":friend_id", friend_id); // -1 for "me"
         fSetAvatarQuery.bindValue(":hash", hash);
         fSetAvatarQuery.bindValue(":data", data);
@@ -294,7 +758,7 @@ namespace JTOX {
     void DBData::getRequests(RequestList& list)
     {
         if ( !fRequestSelectQuery.exec() ) {
-            Utils::fatal("Error on request select query exec: " + fEventSelectQuery.lastError().text());
+            Utils::fatal("Error on request select query exec: " + fRequestSelectQuery.lastError().text());
         }
 
         while ( fRequestSelectQuery.next() ) {
@@ -302,12 +766,17 @@ namespace JTOX {
             const QString message = fRequestSelectQuery.value("message").toString();
             const QString name = fRequestSelectQuery.value("name").toString();
 
-            list.append(FriendRequest(address, message, name));
+            FriendRequest request(address, message, name);
+            request.setID(fRequestSelectQuery.value("id").toInt()); // deleteRequest wipes all requests without an id
+            list.append(request);
         }
+        fRequestSelectQuery.finish();
     }
 
     void DBData::setFriendOfflineName(const QString& address, quint32 friendID, const QString& name)
     {
+        beginWrite();
+
         fFriendOfflineNameUpdateQuery.bindValue(":address", address);
         fFriendOfflineNameUpdateQuery.bindValue(":friend_id", friendID);
         fFriendOfflineNameUpdateQuery.bindValue(":name", name);
@@ -326,19 +795,40 @@ namespace JTOX {
         }
 
         if ( !fFriendOfflineNameSelectQuery.first() ) {
+            fFriendOfflineNameSelectQuery.finish();
             return QString();
         }
 
         const QString offlineName = fFriendOfflineNameSelectQuery.value("name").toString();
+        fFriendOfflineNameSelectQuery.finish();
         return offlineName;
     }
 
     void DBData::wipe(qint64 friendID)
     {
+        beginWrite();
+
         fWipeEventsQuery.bindValue(":friend_id", friendID);
         fWipeEventsQuery.bindValue(":friend_id2", friendID);
         fWipeFriendsQuery.bindValue(":friend_id", friendID);
         fWipeFriendsQuery.bindValue(":friend_id2", friendID);
+        fWipeFriendStatsQuery.bindValue(":friend_id", friendID);
+        fWipeFriendStatsQuery.bindValue(":friend_id2", friendID);
+
+        // stats go first so the per row delete trigger has nothing to update
+        if ( !fWipeFriendStatsQuery.exec() ) {
+            Utils::fatal("Unable to wipe friend stats: " + fWipeFriendStatsQuery.lastError().text());
+        }
+
+        // single friend postings go with their events via trigger, full wipe drops the index and the DB keys
+        if ( friendID < 0 ) {
+            QSqlQuery query(fDB);
+            if ( !query.exec("DELETE FROM search_tokens") || !query.exec("DELETE FROM search_backfill") ||
+                 !query.exec("DELETE FROM row_migration") || !query.exec("DELETE FROM db_keys") ||
+                 !query.exec("DELETE FROM received_files") ) {
+                Utils::fatal("Unable to wipe search index and DB keys: " + query.lastError().text());
+            }
+        }
 
         if ( !fWipeEventsQuery.exec() ) {
             Utils::fatal("Unable to wipe events: " + fWipeEventsQuery.lastError().text());
@@ -352,12 +842,33 @@ namespace JTOX {
         if ( friendID < 0 && !fWipeRequestsQuery.exec() ) {
             Utils::fatal("Unable to wipe requests: " + fWipeRequestsQuery.lastError().text());
         }
+
+        // drop the cached keys only once the delete is committed, before that the other connection
+        // would reload the old key from its snapshot and encrypt new rows with it
+        if ( friendID < 0 ) {
+            flush();
+            fEncryptSave.setDBKeys(QByteArray(), QByteArray());
+        }
     }
 
     void DBData::wipeLogs()
     {
+        beginWrite();
+
         fWipeEventsQuery.bindValue(":friend_id", -1);
         fWipeEventsQuery.bindValue(":friend_id2", -1);
+        fWipeFriendStatsQuery.bindValue(":friend_id", -1);
+        fWipeFriendStatsQuery.bindValue(":friend_id2", -1);
+
+        if ( !fWipeFriendStatsQuery.exec() ) {
+            Utils::fatal("Unable to wipe friend stats: " + fWipeFriendStatsQuery.lastError().text());
+        }
+
+        QSqlQuery query(fDB);
+        if ( !query.exec("DELETE FROM search_tokens") || !query.exec("DELETE FROM search_backfill") ||
+             !query.exec("DELETE FROM row_migration") ) {
+            Utils::fatal("Unable to wipe search index: " + query.lastError().text());
+        }
 
         if ( !fWipeEventsQuery.exec() ) {
             Utils::fatal("Unable to wipe events: " + fWipeEventsQuery.lastError().text());
@@ -366,6 +877,8 @@ namespace JTOX {
 
     void DBData::updateEvent(int id, EventType eventType, quint64 filePosition, int filePausers)
     {
+        beginWrite();
+
         fEventUpdateQuery.bindValue(":id", id);
         fEventUpdateQuery.bindValue(":event_type", eventType);
         fEventUpdateQuery.bindValue(":file_position", filePosition);
@@ -378,6 +891,8 @@ namespace JTOX {
 
     void DBData::updateEventSent(int id, EventType eventType, qint64 sendID)
     {
+        beginWrite();
+
         fEventUpdateSentQuery.bindValue(":id", id);
         fEventUpdateSentQuery.bindValue(":event_type", eventType);
         fEventUpdateSentQuery.bindValue(":send_id", sendID);
@@ -387,6 +902,183 @@ namespace JTOX {
         }
     }
 
+    void DBData::post(const DBJob& job)
+    {
+        if ( fWorker == NULL ) {
+            Utils::fatal("Posting DB job on worker connection");
+        }
+
+        fWorker->post(job);
+    }
+
+    void DBData::execBlocking(const std::function<void(DBData& db)>& job)
+    {
+        QSemaphore done;
+        post([&job, &done](DBData& db) -> DBCallback {
+            job(db);
+            done.release();
+            return DBCallback();
+        });
+        done.acquire();
+    }
+
+    void DBData::getEventPageAsync(quint32 friendID, int beforeID, int limit, const EventListCallback& callback)
+    {
+        flush(); // worker connection must see our pending writes
+        post([friendID, beforeID, limit, callback](DBData& db) -> DBCallback {
+            EventList list;
+            db.getEventPage(list, friendID, beforeID, limit);
+            return [callback, list]() { callback(list); };
+        });
+    }
+
+    void DBData::getEventsAsync(const QList<int>& ids, const EventListCallback& callback)
+    {
+        flush();
+        post([ids, callback](DBData& db) -> DBCallback {
+            EventList list;
+            db.getEvents(list, ids);
+            return [callback, list]() { callback(list); };
+        });
+    }
+
+    void DBData::searchEventsAsync(const QString& text, qint64 friendID, int limit, const EventIDsCallback& callback)
+    {
+        flush();
+        post([text, friendID, limit, callback](DBData& db) -> DBCallback {
+            QList<int> ids;
+            db.searchEvents(ids, text, friendID, limit);
+            return [callback, ids]() { callback(ids); };
+        });
+    }
+
+    void DBData::indexSearchBacklogAsync()
+    {
+        if ( fSearchBacklogRunning ) {
+            return;
+        }
+
+        fSearchBacklogRunning = true;
+        post([this](DBData& db) -> DBCallback {
+            bool more = db.indexSearchBacklog(SEARCH_BACKLOG_BATCH);
+            return [this, more]() {
+                fSearchBacklogRunning = false;
+                if ( more ) {
+                    indexSearchBacklogAsync();
+                }
+            };
+        });
+    }
+
+    void DBData::migrateRowBacklogAsync()
+    {
+        if ( fRowBacklogRunning ) {
+            return;
+        }
+
+        fRowBacklogRunning = true;
+        post([this](DBData& db) -> DBCallback {
+            bool more = db.migrateRowBacklog(ROW_BACKLOG_BATCH);
+            return [this, more]() {
+                fRowBacklogRunning = false;
+                if ( more ) {
+                    migrateRowBacklogAsync();
+                }
+            };
+        });
+    }
+
+    void DBData::getUnviewedEventCountsAsync(const UnviewedCountsCallback& callback)
+    {
+        flush();
+        post([callback](DBData& db) -> DBCallback {
+            QMap<quint32, int> counts;
+            db.getUnviewedEventCounts(counts);
+            return [callback, counts]() { callback(counts); };
+        });
+    }
+
+    void DBData::getRequestsAsync(const RequestListCallback& callback)
+    {
+        flush();
+        post([callback](DBData& db) -> DBCallback {
+            RequestList list;
+            db.getRequests(list);
+            return [callback, list]() { callback(list); };
+        });
+    }
+
+    void DBData::setAvatarAsync(qint64 friend_id, const QByteArray& hash, const QByteArray& data, const DBCallback& callback)
+    {
+        post([friend_id, hash, data, callback](DBData& db) -> DBCallback {
+            db.setAvatar(friend_id, hash, data);
+            return callback;
+        });
+    }
+
+    void DBData::clearAvatarAsync(qint64 friend_id, const DBCallback& callback)
+    {
+        post([friend_id, callback](DBData& db) -> DBCallback {
+            db.clearAvatar(friend_id);
+            return callback;
+        });
+    }
+
+    void DBData::wipeAsync(qint64 friendID, const DBCallback& callback)
+    {
+        flush(); // wipe must include everything written so far
+        post([friendID, callback](DBData& db) -> DBCallback {
+            db.wipe(friendID);
+            return callback;
+        });
+    }
+
+    void DBData::wipeBlocking(qint64 friendID)
+    {
+        flush();
+        execBlocking([friendID](DBData& db) {
+            db.wipe(friendID);
+        });
+    }
+
+    void DBData::wipeLogsAsync(const DBCallback& callback)
+    {
+        flush();
+        post([callback](DBData& db) -> DBCallback {
+            db.wipeLogs();
+            return callback;
+        });
+    }
+
+    void DBData::flush()
+    {
+        if ( !fInTransaction ) {
+            return;
+        }
+
+        fCommitTimer.stop();
+        fInTransaction = false;
+        if ( !fDB.commit() ) {
+            Utils::fatal("Unable to commit DB transaction: " + fDB.lastError().text());
+        }
+    }
+
+    void DBData::beginWrite()
+    {
+        if ( fInTransaction ) {
+            return;
+        }
+
+        // take the write lock up front, a deferred BEGIN upgrading after a read fails with SQLITE_BUSY
+        // once the other connection committed in between, and the busy timeout doesn't cover that
+        QSqlQuery beginQuery(fDB);
+        if ( !beginQuery.exec("BEGIN IMMEDIATE") ) {
+            Utils::fatal("Unable to start DB transaction: " + beginQuery.lastError().text());
+        }
+        fInTransaction = true;
+        fCommitTimer.start(); // commit once control returns to the event loop
+    }
+
     void DBData::createTables() {        
         QSqlQuery createTableQuery(fDB);
         // events
@@ -442,21 +1134,246 @@ namespace JTOX {
         setUserVersion(2); // commits
     }
 
+    void DBData::upgradeToV3()
+    {
+        QSqlQuery query(fDB);
+        // history paging and last event lookup
+        if ( !query.exec("CREATE INDEX IF NOT EXISTS events_friend_id_id ON events(friend_id, id)") ) {
+            Utils::fatal("Unable to upgrade DB to v3: " + query.lastError().text());
+        }
+        // transfer and delivery lookups by send_id (file_number)
+        if ( !query.exec("CREATE INDEX IF NOT EXISTS events_friend_id_send_id_event_type ON events(friend_id, send_id, event_type)") ) {
+            Utils::fatal("Unable to upgrade DB to v3: " + query.lastError().text());
+        }
+        // unviewed counts and transfer list
+        if ( !query.exec("CREATE INDEX IF NOT EXISTS events_event_type ON events(event_type)") ) {
+            Utils::fatal("Unable to upgrade DB to v3: " + query.lastError().text());
+        }
+
+        setUserVersion(3); // commits
+    }
+
+    void DBData::upgradeToV4()
+    {
+        QSqlQuery query(fDB);
+        // materialized per friend unread count and last event, kept current by triggers below
+        if ( !query.exec("CREATE TABLE IF NOT EXISTS friend_stats("
+                         "friend_id INTEGER PRIMARY KEY,"
+                         "unviewed INTEGER NOT NULL DEFAULT 0,"
+                         "last_event_id INTEGER,"
+                         "last_event_at TIMESTAMP)") ) {
+            Utils::fatal("Unable to upgrade DB to v4: " + query.lastError().text());
+        }
+
+        if ( !query.exec("INSERT OR REPLACE INTO friend_stats(friend_id, unviewed, last_event_id, last_event_at) "
+                         "SELECT friend_id, total(event_type = 2), max(id), max(created_at) FROM events GROUP BY friend_id") ) {
+            Utils::fatal("Unable to upgrade DB to v4: " + query.lastError().text());
+        }
+
+        if ( !query.exec("CREATE TRIGGER IF NOT EXISTS events_stats_insert AFTER INSERT ON events BEGIN "
+                         "INSERT OR IGNORE INTO friend_stats(friend_id) VALUES(NEW.friend_id); "
+                         "UPDATE friend_stats SET unviewed = unviewed + (NEW.event_type = 2), "
+                         "last_event_id = NEW.id, last_event_at = NEW.created_at "
+                         "WHERE friend_id = NEW.friend_id; "
+                         "END") ) {
+            Utils::fatal("Unable to upgrade DB to v4: " + query.lastError().text());
+        }
+
+        if ( !query.exec("CREATE TRIGGER IF NOT EXISTS events_stats_update AFTER UPDATE OF event_type ON events "
+                         "WHEN (OLD.event_type = 2) != (NEW.event_type = 2) BEGIN "
+                         "UPDATE friend_stats SET unviewed = unviewed + (NEW.event_type = 2) - (OLD.event_type = 2) "
+                         "WHERE friend_id = NEW.friend_id; "
+                         "END") ) {
+            Utils::fatal("Unable to upgrade DB to v4: " + query.lastError().text());
+        }
+
+        if ( !query.exec("CREATE TRIGGER IF NOT EXISTS events_stats_delete AFTER DELETE ON events BEGIN "
+                         "UPDATE friend_stats SET unviewed = unviewed - (OLD.event_type = 2), "
+                         "last_event_id = CASE WHEN last_event_id = OLD.id "
+                         "THEN (SELECT max(id) FROM events WHERE friend_id = OLD.friend_id) ELSE last_event_id END, "
+                         "last_event_at = CASE WHEN last_event_id = OLD.id "
+                         "THEN (SELECT created_at FROM events WHERE friend_id = OLD.friend_id ORDER BY id DESC LIMIT 1) ELSE last_event_at END "
+                         "WHERE friend_id = OLD.friend_id; "
+                         "END") ) {
+            Utils::fatal("Unable to upgrade DB to v4: " + query.lastError().text());
+        }
+
+        setUserVersion(4); // commits
+    }
+
+    void DBData::upgradeToV5()
+    {
+        QSqlQuery query(fDB);
+        // wrapped random keys, the pass key itself can't be used for deterministic hashing
+        if ( !query.exec("CREATE TABLE IF NOT EXISTS db_keys(name TEXT PRIMARY KEY, data BLOB NOT NULL)") ) {
+            Utils::fatal("Unable to upgrade DB to v5: " + query.lastError().text());
+        }
+        // blind token postings, token is a keyed hash of a case folded word
+        if ( !query.exec("CREATE TABLE IF NOT EXISTS search_tokens("
+                         "token INTEGER NOT NULL,"
+                         "event_id INTEGER NOT NULL,"
+                         "friend_id INTEGER NOT NULL,"
+                         "PRIMARY KEY(token, event_id)) WITHOUT ROWID") ) {
+            Utils::fatal("Unable to upgrade DB to v5: " + query.lastError().text());
+        }
+        if ( !query.exec("CREATE INDEX IF NOT EXISTS search_tokens_event_id ON search_tokens(event_id)") ) {
+            Utils::fatal("Unable to upgrade DB to v5: " + query.lastError().text());
+        }
+        if ( !query.exec("CREATE TRIGGER IF NOT EXISTS events_search_delete AFTER DELETE ON events BEGIN "
+                         "DELETE FROM search_tokens WHERE event_id = OLD.id; "
+                         "END") ) {
+            Utils::fatal("Unable to upgrade DB to v5: " + query.lastError().text());
+        }
+        // existing history needs the pass key so it's indexed later from the worker, newest first
+        if ( !query.exec("CREATE TABLE IF NOT EXISTS search_backfill(next_id INTEGER NOT NULL)") ) {
+            Utils::fatal("Unable to upgrade DB to v5: " + query.lastError().text());
+        }
+        if ( !query.exec("INSERT INTO search_backfill SELECT max(id) FROM events HAVING max(id) IS NOT NULL") ) {
+            Utils::fatal("Unable to upgrade DB to v5: " + query.lastError().text());
+        }
+
+        setUserVersion(5); // commits
+    }
+
+    void DBData::upgradeToV6()
+    {
+        QSqlQuery query(fDB);
+        // rows still in the pass key format get re-encrypted by the worker, newest first
+        if ( !query.exec("CREATE TABLE IF NOT EXISTS row_migration(next_id INTEGER NOT NULL)") ) {
+            Utils::fatal("Unable to upgrade DB to v6: " + query.lastError().text());
+        }
+        if ( !query.exec("INSERT INTO row_migration SELECT max(id) FROM events HAVING max(id) IS NOT NULL") ) {
+            Utils::fatal("Unable to upgrade DB to v6: " + query.lastError().text());
+        }
+
+        setUserVersion(6); // commits
+    }
+
+    void DBData::upgradeToV7()
+    {
+        QSqlQuery query(fDB);
+        // completed downloads by file_id and size, lets a re-sent file reuse the copy we have
+        if ( !query.exec("CREATE TABLE IF NOT EXISTS received_files(file_id BLOB NOT NULL, file_size INTEGER NOT NULL, file_path TEXT NOT NULL, "
+                         "PRIMARY KEY(file_id, file_size)) WITHOUT ROWID") ) {
+            Utils::fatal("Unable to upgrade DB to v7: " + query.lastError().text());
+        }
+
+        setUserVersion(7); // commits
+    }
+
+    void DBData::upgradeToV8()
+    {
+        QSqlQuery query(fDB);
+        if ( !query.exec("ALTER TABLE events ADD COLUMN file_hash BLOB") ) {
+            Utils::fatal("Unable to upgrade DB to v8: " + query.lastError().text());
+        }
+
+        setUserVersion(8); // commits
+    }
+
+    void DBData::upgradeToV9()
+    {
+        QSqlQuery query(fDB);
+        // per friend search, the primary key makes it covering
+        if ( !query.exec("CREATE INDEX IF NOT EXISTS search_tokens_token_friend ON search_tokens(token, friend_id)") ) {
+            Utils::fatal("Unable to upgrade DB to v9: " + query.lastError().text());
+        }
+
+        setUserVersion(9); // commits
+    }
+
+    void DBData::loadDBKeys()
+    {
+        if ( fEncryptSave.hasDBKeys() ) {
+            return;
+        }
+
+        const QByteArray indexKey = loadDBKey("search", crypto_generichash_KEYBYTES);
+        const QByteArray rowKey = loadDBKey("rows", crypto_secretbox_KEYBYTES);
+        fEncryptSave.setDBKeys(indexKey, rowKey);
+    }
+
+    const QByteArray DBData::loadDBKey(const QString& name, int size)
+    {
+        fDBKeySelectQuery.bindValue(":name", name);
+        if ( !fDBKeySelectQuery.exec() ) {
+            Utils::fatal("Unable to select DB key: " + fDBKeySelectQuery.lastError().text());
+        }
+
+        if ( !fDBKeySelectQuery.first() ) { // first use, make a new one
+            fDBKeySelectQuery.finish();
+            beginWrite();
+            QByteArray key(size, Qt::Uninitialized);
+            randombytes_buf(key.data(), key.size());
+
+            fDBKeyInsertQuery.bindValue(":name", name);
+            fDBKeyInsertQuery.bindValue(":data", fEncryptSave.encryptRaw(key));
+            if ( !fDBKeyInsertQuery.exec() ) {
+                Utils::fatal("Unable to insert DB key: " + fDBKeyInsertQuery.lastError().text());
+            }
+
+            // re-read, the other connection might have won the race
+            if ( !fDBKeySelectQuery.exec() || !fDBKeySelectQuery.first() ) {
+                Utils::fatal("Unable to select DB key: " + fDBKeySelectQuery.lastError().text());
+            }
+        }
+
+        const QByteArray key = fEncryptSave.decryptRaw(fDBKeySelectQuery.value(0).toByteArray());
+        fDBKeySelectQuery.finish();
+        if ( key.size() != size ) {
+            Utils::fatal("Invalid DB key size: " + name);
+        }
+
+        return key;
+    }
+
+    void DBData::indexMessage(int id, quint32 friendID, const QString& message)
+    {
+        const QStringList tokens = Utils::searchTokens(message);
+        if ( tokens.isEmpty() ) {
+            return;
+        }
+
+        loadDBKeys();
+        QVariantList tokenValues;
+        QVariantList idValues;
+        QVariantList friendValues;
+        foreach ( const QString& token, tokens ) {
+            tokenValues << fEncryptSave.blindToken(token);
+            idValues << id;
+            friendValues << friendID;
+        }
+
+        fSearchInsertQuery.bindValue(":token", tokenValues);
+        fSearchInsertQuery.bindValue(":event_id", idValues);
+        fSearchInsertQuery.bindValue(":friend_id", friendValues);
+
+        if ( !fSearchInsertQuery.execBatch() ) {
+            Utils::fatal("Unable to insert search tokens: " + fSearchInsertQuery.lastError().text());
+        }
+    }
+
     void DBData::prepareQueries()
     {
-        fEventSelectOneQuery = prepareQuery("SELECT id, event_type, created_at, message, send_id, friend_id, "
-                                            "       file_path, file_id, file_size, file_position, file_pausers "
-                                            "FROM events "
-                                            "WHERE (id = :id OR :id < 0) "
-                                            "AND (friend_id = :friend_id OR :friend_id < 0) "
-                                            "AND (send_id = :send_id OR :send_id < 0) "
-                                            "AND (event_type = :event_type OR :event_type < 0) ");
+        fEventSelectByIDQuery = prepareQuery("SELECT id, event_type, created_at, message, send_id, friend_id, "
+                                             "       file_path, file_id, file_size, file_position, file_pausers, file_hash "
+                                             "FROM events "
+                                             "WHERE id = :id");
+
+        fEventSelectBySendIDQuery = prepareQuery("SELECT id, event_type, created_at, message, send_id, friend_id, "
+                                                 "       file_path, file_id, file_size, file_position, file_pausers, file_hash "
+                                                 "FROM events "
+                                                 "WHERE friend_id = :friend_id "
+                                                 "AND send_id = :send_id "
+                                                 "AND event_type = :event_type "
+                                                 "ORDER BY id DESC "
+                                                 "LIMIT 1");
 
         fEventSelectQuery = prepareQuery("SELECT id, event_type, created_at, message, send_id, friend_id, "
-                                         "       file_path, file_id, file_size, file_position, file_pausers "
+                                         "       file_path, file_id, file_size, file_position, file_pausers, file_hash "
                                          "FROM ("
                                             "SELECT id, event_type, created_at, message, send_id, friend_id, "
-                                            "       file_path, file_id, file_size, file_position, file_pausers "
+                                            "       file_path, file_id, file_size, file_position, file_pausers, file_hash "
                                             "FROM events "
                                             "WHERE friend_id = :friend_id "
                                             "AND (event_type = :event_type OR :event_type < 0) "
@@ -464,6 +1381,15 @@ namespace JTOX {
                                             "LIMIT 100"
                                          ") tmp ORDER BY tmp.id ASC");
 
+        // keyset pagination, cost is independent of history length
+        fEventPageQuery = prepareQuery("SELECT id, event_type, created_at, message, send_id, friend_id, "
+                                       "       file_path, file_id, file_size, file_position, file_pausers, file_hash "
+                                       "FROM events "
+                                       "WHERE friend_id = :friend_id "
+                                       "AND id < :before_id "
+                                       "ORDER BY id DESC "
+                                       "LIMIT :limit");
+
         fLastEventSelectQuery = prepareQuery("SELECT id, created_at "
                                              "FROM events "
                                              "WHERE friend_id = :friend_id "
@@ -471,17 +1397,21 @@ namespace JTOX {
                                              "LIMIT 1");
 
         fTransfersSelectQuery = prepareQuery("SELECT id, event_type, created_at, message, send_id, friend_id,"
-                                             "       file_path, file_id, file_size, file_position, file_pausers "
+                                             "       file_path, file_id, file_size, file_position, file_pausers, file_hash "
                                              "FROM events "
-                                             "WHERE event_type IN (10, 11, 12, 13, 16, 17) "
-                                             "ORDER BY id DESC "
-                                             "LIMIT 100");
+                                             "WHERE friend_id = :friend_id AND event_type IN (10, 11, 12, 13, 16, 17) "
+                                             "ORDER BY id");
 
-        fEventUnviewedCountQuery = prepareQuery("SELECT count(*) FROM events WHERE event_type = :event_type AND (friend_id = :friend_id OR :friend_id2 < 0)");
+        fFriendStatsUnviewedQuery = prepareQuery("SELECT unviewed FROM friend_stats WHERE friend_id = :friend_id");
+        fFriendStatsTotalQuery = prepareQuery("SELECT ifnull(sum(unviewed), 0) FROM friend_stats");
+        fFriendStatsUnviewedListQuery = prepareQuery("SELECT friend_id, unviewed FROM friend_stats WHERE unviewed > 0");
         fEventInsertQuery = prepareQuery("INSERT INTO events(send_id, friend_id, event_type, message, file_path, file_id, file_size, file_position, file_pausers) VALUES(:send_id, :friend_id, :event_type, :message, :file_path, :file_id, :file_size, :file_position, :file_pausers)");
         fEventUpdateQuery = prepareQuery("UPDATE events SET event_type = :event_type, file_position = :file_position, file_pausers = :file_pausers WHERE id = :id");
+        fEventUpdateHashQuery = prepareQuery("UPDATE events SET file_hash = :file_hash WHERE id = :id");
         fEventUpdateSentQuery = prepareQuery("UPDATE events SET event_type = :event_type, send_id = :send_id WHERE id = :id");
-        fEventDeliveredQuery = prepareQuery("UPDATE events SET event_type = 1 WHERE send_id = :send_id AND friend_id = :friend_id");
+        fEventViewedQuery = prepareQuery("UPDATE events SET event_type = 4 WHERE friend_id = :friend_id AND id <= :max_id AND event_type = 2");
+        fStaleTransfersCancelQuery = prepareQuery("UPDATE events SET event_type = 14 "
+                                                  "WHERE event_type IN (10, 12, 16) AND ifnull(length(file_id), 0) = 0");
         fEventDeleteQuery = prepareQuery("DELETE FROM events WHERE id = :id");
 
         fRequestSelectQuery = prepareQuery("SELECT id, address, message, name FROM requests");
@@ -496,26 +1426,112 @@ namespace JTOX {
         fWipeEventsQuery = prepareQuery("DELETE FROM events WHERE (friend_id = :friend_id OR :friend_id2 < 0)");
         fWipeFriendsQuery = prepareQuery("DELETE FROM friends WHERE (friend_id = :friend_id OR :friend_id2 < 0)");
         fWipeRequestsQuery = prepareQuery("DELETE FROM requests");
+        fSearchInsertQuery = prepareQuery("INSERT OR IGNORE INTO search_tokens(token, event_id, friend_id) VALUES(:token, :event_id, :friend_id)");
+        fSearchBackfillSelectQuery = prepareQuery("SELECT next_id FROM search_backfill");
+        fSearchBackfillUpdateQuery = prepareQuery("UPDATE search_backfill SET next_id = :next_id");
+        fSearchBackfillDeleteQuery = prepareQuery("DELETE FROM search_backfill");
+        fSearchBacklogQuery = prepareQuery("SELECT id, friend_id, message FROM events "
+                                           "WHERE id <= :next_id AND event_type IN (1, 2, 3, 4, 5) "
+                                           "ORDER BY id DESC "
+                                           "LIMIT :limit");
+        fRowMigrationSelectQuery = prepareQuery("SELECT next_id FROM row_migration");
+        fRowMigrationUpdateQuery = prepareQuery("UPDATE row_migration SET next_id = :next_id");
+        fRowMigrationDeleteQuery = prepareQuery("DELETE FROM row_migration");
+        fRowBacklogQuery = prepareQuery("SELECT id, message FROM events WHERE id <= :next_id ORDER BY id DESC LIMIT :limit");
+        fEventUpdateMessageQuery = prepareQuery("UPDATE events SET message = :message WHERE id = :id");
+        fDBKeySelectQuery = prepareQuery("SELECT data FROM db_keys WHERE name = :name");
+        fDBKeyInsertQuery = prepareQuery("INSERT OR IGNORE INTO db_keys(name, data) VALUES(:name, :data)");
+        fWipeFriendStatsQuery = prepareQuery("DELETE FROM friend_stats WHERE (friend_id = :friend_id OR :friend_id2 < 0)");
 
         fGetAvatarQuery = prepareQuery("SELECT data FROM avatars WHERE friend_id = :friend_id");
+        fReceivedFileSelectQuery = prepareQuery("SELECT file_path FROM received_files WHERE file_id = :file_id AND file_size = :file_size");
+        fReceivedFileInsertQuery = prepareQuery("INSERT OR REPLACE INTO received_files(file_id, file_size, file_path) VALUES(:file_id, :file_size, :file_path)");
+        fReceivedFileDeleteQuery = prepareQuery("DELETE FROM received_files WHERE file_id = :file_id AND file_size = :file_size");
         fCheckAvatarQuery = prepareQuery("SELECT count(*) FROM avatars WHERE friend_id = :friend_id AND hash = :hash");
         fSetAvatarQuery = prepareQuery("INSERT OR REPLACE INTO avatars(friend_id, hash, data) VALUES(:friend_id, :hash, :data)");
         fClearAvatarQuery = prepareQuery("DELETE FROM avatars WHERE friend_id = :friend_id");
     }
 
-    const Event DBData::parseEvent(const QSqlQuery &query) const
+    const QStringList DBData::tableScans()
+    {
+        // hot path queries must never fall back to a full events table scan
+        QStringList scans;
+        checkQueryPlan(fEventSelectByIDQuery, scans);
+        checkQueryPlan(fEventSelectBySendIDQuery, scans);
+        checkQueryPlan(fEventSelectQuery, scans);
+        checkQueryPlan(fEventPageQuery, scans);
+        checkQueryPlan(fLastEventSelectQuery, scans);
+        checkQueryPlan(fTransfersSelectQuery, scans);
+        checkQueryPlan(fEventUpdateQuery, scans);
+        checkQueryPlan(fEventUpdateSentQuery, scans);
+        checkQueryPlan(fEventUpdateHashQuery, scans);
+        checkQueryPlan(fEventViewedQuery, scans);
+        checkQueryPlan(fStaleTransfersCancelQuery, scans);
+        checkQueryPlan(fSearchBacklogQuery, scans);
+        checkQueryPlan(fRowBacklogQuery, scans);
+        checkQueryPlan(fEventUpdateMessageQuery, scans);
+        checkQueryPlan(fEventDeleteQuery, scans);
+        return scans;
+    }
+
+    void DBData::checkQueryPlan(const QSqlQuery& source, QStringList& scans)
+    {
+        QSqlQuery query(fDB);
+        if ( !query.prepare("EXPLAIN QUERY PLAN " + source.lastQuery()) ) {
+            Utils::fatal("Unable to prepare query plan: " + query.lastError().text());
+        }
+
+        foreach ( const QString& placeholder, source.boundValues().keys() ) {
+            query.bindValue(placeholder, 1);
+        }
+
+        if ( !query.exec() ) {
+            Utils::fatal("Unable to get query plan: " + query.lastError().text());
+        }
+
+        // "SCAN [TABLE] events" on its own, a scan USING [COVERING] INDEX walks an index instead
+        const QRegularExpression scanExp("^SCAN (TABLE )?events\\b(?!.*USING .*INDEX)");
+        while ( query.next() ) {
+            const QString detail = query.value("detail").toString();
+            if ( scanExp.match(detail).hasMatch() ) {
+                scans << detail + " in: " + source.lastQuery();
+            }
+        }
+    }
+
+    bool DBData::fetchEvent(QSqlQuery& query, Event& result)
+    {
+        loadDBKeys(); // before the select, loading may need to write
+        if ( !query.exec() ) {
+            Utils::fatal("Error on event select query exec: " + query.lastError().text());
+        }
+
+        // member queries are finished once read, a statement left on a row pins its snapshot
+        if ( !query.next() ) {
+            query.finish();
+            return false;
+        }
+
+        result = parseEvent(query);
+        query.finish();
+        return true;
+    }
+
+    const Event DBData::parseEvent(const QSqlQuery &query, bool lazy) const
     {
         bool ok = false;
         int id = query.value("id").toInt(&ok);
         if ( !ok ) {
             Utils::fatal("Error casting event id: " + query.value("id").toString());
         }
-        const QString message = fEncryptSave.decrypt(query.value("message").toByteArray());
         int rawEType = query.value("event_type").toInt(&ok);
         if ( !ok ) {
             Utils::fatal("Error casting event type: " + query.value("event_type").toString());
         }
         EventType eventType = (EventType) rawEType;
+        const QByteArray cipher = query.value("message").toByteArray();
+        lazy = lazy && eventType < etFileTransferIn; // file names are needed by transfer code, keep those eager
+        const QString message = lazy ? QString() : fEncryptSave.decryptRow(cipher);
         const QDateTime createdAt = query.value("created_at").toDateTime();
         qint64 sendID = -1;
         if ( !query.value("send_id").isNull() ) {
@@ -544,7 +1560,7 @@ namespace JTOX {
 
         quint64 file_size = 0;
         if ( !query.value("file_size").isNull() ) {
-            file_size = query.value("file_size").toInt(&ok);
+            file_size = query.value("file_size").toULongLong(&ok);
             if ( !ok ) {
                 Utils::fatal("Error casting event file_size: " + query.value("file_size").toString());
             }
@@ -552,7 +1568,7 @@ namespace JTOX {
 
         quint64 file_position = 0;
         if ( !query.value("file_position").isNull() ) {
-            file_position = query.value("file_position").toInt(&ok);
+            file_position = query.value("file_position").toULongLong(&ok);
             if ( !ok ) {
                 Utils::fatal("Error casting event file_position: " + query.value("file_position").toString());
             }
@@ -566,7 +1582,15 @@ namespace JTOX {
             }
         }
 
-        return Event(id, friendID, createdAt, eventType, message, sendID, file_path, file_id, file_size, file_position, file_pausers);
+        Event result(id, friendID, createdAt, eventType, message, sendID, file_path, file_id, file_size, file_position, file_pausers);
+        if ( !query.value("file_hash").isNull() ) {
+            result.setFileHash(query.value("file_hash").toByteArray());
+        }
+        if ( lazy ) {
+            result.setCipher(cipher);
+        }
+
+        return result;
     }
 
     const QSqlQuery DBData::prepareQuery(const QString& sql)
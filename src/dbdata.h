@@ -8,23 +8,74 @@
 #include <QSqlDatabase>
 #include <QDateTime>
 #include <QSqlQuery>
+#include <QStringList>
+#include <QTimer>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QMap>
+#include <functional>
 
 namespace JTOX {
 
+    class DBData;
+
+    typedef std::function<void()> DBCallback; // runs on the GUI thread
+    typedef std::function<DBCallback(DBData& db)> DBJob; // runs on the DB worker thread
+    typedef std::function<void(const EventList& list)> EventListCallback;
+    typedef std::function<void(const QList<int>& ids)> EventIDsCallback;
+    typedef std::function<void(const RequestList& list)> RequestListCallback;
+    typedef std::function<void(const QMap<quint32, int>& counts)> UnviewedCountsCallback;
+
+    // owns its own DB connection, runs jobs in posting order and hands
+    // their callbacks back to the GUI thread in the same order
+    class DBWorker : public QThread
+    {
+        Q_OBJECT
+    public:
+        DBWorker(EncryptSave& encryptSave);
+        virtual ~DBWorker();
+        void run();
+        void post(const DBJob& job);
+    signals:
+        void jobDone(const DBCallback& callback) const;
+    private slots:
+        void onJobDone(const DBCallback& callback);
+    private:
+        EncryptSave& fEncryptSave;
+        QMutex fMutex;
+        QWaitCondition fJobAdded;
+        QQueue<DBJob> fJobs;
+        bool fStopping;
+    };
+
     class DBData
     {
     public:
-        DBData(EncryptSave& encryptSave);
+        DBData(EncryptSave& encryptSave, const QString& connectionName = QString()); // named connections are worker side
+        virtual ~DBData();
         bool getEvent(int event_id, Event& result);
         bool getEvent(quint32 friend_id, quint32 send_id, EventType event_type, Event& result);
         void getEvents(EventList& list, quint32 friendID, int eventType = -1);
-        void getTransfers(EventList& list);
-        int getUnviewedEventCount(qint64 friendID);
+        void getEventPage(EventList& list, quint32 friendID, int beforeID, int limit); // newest first, -1 beforeID for latest, messages left encrypted
+        const QString decryptMessage(const QByteArray& cipher); // for events from getEventPage
+        void getEvents(EventList& list, const QList<int>& ids); // in given order, missing ones skipped
+        void searchEvents(QList<int>& ids, const QString& text, qint64 friendID, int limit); // ranked, -1 friendID for all
+        bool indexSearchBacklog(int batchSize); // indexes pre v5 history, true while rows remain
+        bool migrateRowBacklog(int batchSize); // re-encrypts pre v6 rows in the row format, true while rows remain
+        void getTransfers(EventList& list, quint32 friendID); // unfinished ones, oldest first
+        int getUnviewedEventCount(qint64 friendID); // -1 for total
+        void getUnviewedEventCounts(QMap<quint32, int>& counts);
         int insertEvent(Event& event);
         void updateEventType(int id, EventType eventType);
         void updateEvent(int id, EventType eventType, quint64 filePosition, int filePausers);
         void updateEventSent(int id, EventType eventType, qint64 sendID);
-        void deliverEvent(quint32 sendID, quint32 friendID);
+        void updateEventHash(int id, const QByteArray& hash);
+        void updateEventsSent(const QList<int>& ids, const QList<qint64>& sendIDs); // all to etMessageOutPending
+        int viewEvents(quint32 friendID, int maxID); // unread incoming up to maxID become viewed
+        int deliverEvents(quint32 friendID, const QList<quint32>& sendIDs); // pending with given sendIDs become delivered
+        void cancelStaleTransfers(); // unfinished incoming ones without file_id can't resume, cancel them
         void deleteEvent(int id);
         void insertRequest(FriendRequest& request);
         void updateRequest(const FriendRequest& request);
@@ -33,23 +84,55 @@ namespace JTOX {
         bool checkAvatar(qint64 friend_id, const QByteArray& hash);
         void clearAvatar(qint64 friend_id);
         void setAvatar(qint64 friend_id, const QByteArray& hash, const QByteArray& data);
+        bool getReceivedFile(const QByteArray& fileID, quint64 fileSize, QString& filePath); // completed download with this file_id and size
+        void addReceivedFile(const QByteArray& fileID, quint64 fileSize, const QString& filePath);
+        void removeReceivedFile(const QByteArray& fileID, quint64 fileSize);
         void getRequests(RequestList& list);
         void setFriendOfflineName(const QString& address, quint32 friendID, const QString& name);
         const QString getFriendOfflineName(const QString& address);
         void wipe(qint64 friendID);
         void wipeLogs();
+        void flush(); // commit pending writes now, for moments that must be durable
+        const QStringList tableScans(); // plans of hot path queries that scan the whole events table, see tests/queryplans
+
+        // async API, reads must be posted from the GUI thread, writes from any
+        void post(const DBJob& job);
+        void execBlocking(const std::function<void(DBData& db)>& job); // GUI thread only for rare one-shot paths
+        void getEventPageAsync(quint32 friendID, int beforeID, int limit, const EventListCallback& callback);
+        void getEventsAsync(const QList<int>& ids, const EventListCallback& callback);
+        void searchEventsAsync(const QString& text, qint64 friendID, int limit, const EventIDsCallback& callback);
+        void indexSearchBacklogAsync(); // batches re-post themselves until done
+        void migrateRowBacklogAsync(); // same for the row format migration
+        void getUnviewedEventCountsAsync(const UnviewedCountsCallback& callback);
+        void getRequestsAsync(const RequestListCallback& callback);
+        void setAvatarAsync(qint64 friend_id, const QByteArray& hash, const QByteArray& data, const DBCallback& callback = DBCallback());
+        void clearAvatarAsync(qint64 friend_id, const DBCallback& callback = DBCallback());
+        void wipeAsync(qint64 friendID, const DBCallback& callback = DBCallback());
+        void wipeBlocking(qint64 friendID); // account switches, nothing of the next session may be wiped
+        void wipeLogsAsync(const DBCallback& callback = DBCallback());
     private:
         EncryptSave& fEncryptSave;
         QSqlDatabase fDB;
-        QSqlQuery fEventSelectOneQuery;
+        DBWorker* fWorker; // only on the main connection
+        QTimer fCommitTimer;
+        bool fInTransaction;
+        bool fSearchBacklogRunning;
+        bool fRowBacklogRunning;
+        QSqlQuery fEventSelectByIDQuery;
+        QSqlQuery fEventSelectBySendIDQuery;
         QSqlQuery fEventSelectQuery;
+        QSqlQuery fEventPageQuery;
         QSqlQuery fLastEventSelectQuery;
         QSqlQuery fTransfersSelectQuery;
-        QSqlQuery fEventUnviewedCountQuery;
+        QSqlQuery fFriendStatsUnviewedQuery;
+        QSqlQuery fFriendStatsTotalQuery;
+        QSqlQuery fFriendStatsUnviewedListQuery;
         QSqlQuery fEventInsertQuery;
         QSqlQuery fEventUpdateQuery;
         QSqlQuery fEventUpdateSentQuery;
-        QSqlQuery fEventDeliveredQuery;
+        QSqlQuery fEventUpdateHashQuery;
+        QSqlQuery fEventViewedQuery;
+        QSqlQuery fStaleTransfersCancelQuery;
         QSqlQuery fEventDeleteQuery;
         QSqlQuery fRequestSelectQuery;
         QSqlQuery fRequestInsertQuery;
@@ -61,15 +144,45 @@ namespace JTOX {
         QSqlQuery fWipeEventsQuery;
         QSqlQuery fWipeRequestsQuery;
         QSqlQuery fWipeFriendsQuery;
+        QSqlQuery fWipeFriendStatsQuery;
         QSqlQuery fGetAvatarQuery;
         QSqlQuery fCheckAvatarQuery;
         QSqlQuery fSetAvatarQuery;
         QSqlQuery fClearAvatarQuery;
+        QSqlQuery fSearchInsertQuery;
+        QSqlQuery fSearchBackfillSelectQuery;
+        QSqlQuery fSearchBackfillUpdateQuery;
+        QSqlQuery fSearchBackfillDeleteQuery;
+        QSqlQuery fSearchBacklogQuery;
+        QSqlQuery fRowMigrationSelectQuery;
+        QSqlQuery fRowMigrationUpdateQuery;
+        QSqlQuery fRowMigrationDeleteQuery;
+        QSqlQuery fRowBacklogQuery;
+        QSqlQuery fEventUpdateMessageQuery;
+        QSqlQuery fDBKeySelectQuery;
+        QSqlQuery fDBKeyInsertQuery;
+        QSqlQuery fReceivedFileSelectQuery;
+        QSqlQuery fReceivedFileInsertQuery;
+        QSqlQuery fReceivedFileDeleteQuery;
+        void beginWrite();
         void createTables();
         void upgradeToV1(); // v0 to v1 upgrade
         void upgradeToV2(); // v1 to v2 upgrade
+        void upgradeToV3(); // v2 to v3 upgrade
+        void upgradeToV4(); // v3 to v4 upgrade
+        void upgradeToV5(); // v4 to v5 upgrade
+        void upgradeToV6(); // v5 to v6 upgrade
+        void upgradeToV7(); // v6 to v7 upgrade
+        void upgradeToV8(); // v7 to v8 upgrade
+        void upgradeToV9(); // v8 to v9 upgrade
+        void loadDBKeys();
+        const QByteArray loadDBKey(const QString& name, int size);
+        void indexMessage(int id, quint32 friendID, const QString& message);
         void prepareQueries();
-        const Event parseEvent(const QSqlQuery& query) const;
+        void checkQueryPlan(const QSqlQuery& source, QStringList& scans);
+        bool fetchEvent(QSqlQuery& query, Event& result);
+        void decryptEvents(EventList& list); // batch decrypts messages left encrypted by a lazy parse
+        const Event parseEvent(const QSqlQuery& query, bool lazy = false) const; // lazy keeps message ciphertext
         const QSqlQuery prepareQuery(const QString& sql);
         int userVersion() const;
         void setUserVersion(int version);
@@ -77,4 +190,6 @@ namespace JTOX {
 
 }
 
+Q_DECLARE_METATYPE(JTOX::DBCallback)
+
 #endif // DBDATA_H
@@ -2,10 +2,20 @@
 #include "utils.h"
 #include <QDebug>
 #include <QCryptographicHash>
+#include <QMutexLocker>
+#include <QThreadPool>
+#include <QVector>
+#include <sodium.h>
+#include <string.h>
 
 namespace JTOX {
 
-    EncryptSave::EncryptSave() : fKey(NULL)
+    const unsigned char ROW_FORMAT_V1 = 0x01; // secretbox with the DB row key, can't clash with the "toxEsave" magic
+    const int PARALLEL_DECRYPT_MIN_ROWS = 64; // smaller batches are decrypted in the calling thread
+
+    //****************************EncryptSave*****************************//
+
+    EncryptSave::EncryptSave() : fKey(NULL), fKeysMutex(), fIndexKey(), fRowKey()
     {
     }
 
@@ -16,10 +26,6 @@ namespace JTOX {
     }
 
     void EncryptSave::setPassword(const QString& password, const QByteArray& data) {
-        if ( fKey != NULL ) {
-            tox_pass_key_free(fKey);
-            fKey = NULL;
-        }
         QByteArray salt(TOX_PASS_SALT_LENGTH, Qt::Uninitialized);
 
         // try to get salt if we have source encrypted data
@@ -32,15 +38,24 @@ namespace JTOX {
             }
         }
 
+        // derived before locking, it's slow on purpose
         TOX_ERR_KEY_DERIVATION error;
-        size_t passSize = password.toUtf8().size();
-        uint8_t* passRaw = (uint8_t*) password.toUtf8().data();
-        fKey = tox_pass_key_derive_with_salt(passRaw, passSize, (uint8_t*) salt.data(), &error);
+        const QByteArray passRaw = password.toUtf8();
+        Tox_Pass_Key* key = tox_pass_key_derive_with_salt((uint8_t*) passRaw.constData(), passRaw.size(), (uint8_t*) salt.data(), &error);
 
         if ( error != TOX_ERR_KEY_DERIVATION_OK ) {
             qDebug() << "Unable to derive key\n";
             Utils::fatal("Unable to derive key");
         }
+
+        // a DB worker job of the previous session may still be using the old key
+        QMutexLocker locker(&fKeysMutex);
+        if ( fKey != NULL ) {
+            tox_pass_key_free(fKey);
+        }
+        fKey = key;
+        fIndexKey = QByteArray(); // wrapped by the old key, DB reloads them on demand
+        fRowKey = QByteArray();
     }
 
     bool EncryptSave::isEncrypted(const QByteArray& data) const
@@ -57,6 +72,7 @@ namespace JTOX {
         size_t rawSize = data.size();
         QByteArray rawResult(rawSize + TOX_PASS_ENCRYPTION_EXTRA_LENGTH, Qt::Uninitialized);
 
+        QMutexLocker locker(&fKeysMutex);
         tox_pass_key_encrypt(fKey, (uint8_t*) data.data(), rawSize, (uint8_t*) rawResult.data(), &error);
 
         if ( error != TOX_ERR_ENCRYPTION_OK ) {
@@ -85,7 +101,9 @@ namespace JTOX {
         }
 
         QByteArray result(data.size() - TOX_PASS_ENCRYPTION_EXTRA_LENGTH, Qt::Uninitialized);
+        QMutexLocker locker(&fKeysMutex);
         tox_pass_key_decrypt(fKey, (uint8_t*) data.data(), data.size(), (uint8_t*) result.data(), &error);
+        locker.unlock();
         if ( error != TOX_ERR_DECRYPTION_OK ) {
             if ( ignoreErrors ) {
                 return QByteArray();
@@ -102,7 +120,157 @@ namespace JTOX {
 
     bool EncryptSave::getPasswordIsSet() const
     {
+        QMutexLocker locker(&fKeysMutex);
         return fKey != NULL;
     }
 
+    bool EncryptSave::hasDBKeys() const
+    {
+        QMutexLocker locker(&fKeysMutex);
+        return !fIndexKey.isEmpty() && !fRowKey.isEmpty();
+    }
+
+    void EncryptSave::setDBKeys(const QByteArray& indexKey, const QByteArray& rowKey)
+    {
+        QMutexLocker locker(&fKeysMutex);
+        fIndexKey = indexKey;
+        fRowKey = rowKey;
+    }
+
+    qint64 EncryptSave::blindToken(const QString& token) const
+    {
+        QMutexLocker locker(&fKeysMutex);
+        if ( fIndexKey.size() != crypto_generichash_KEYBYTES ) {
+            Utils::fatal("Index key not set");
+        }
+
+        const QByteArray raw = token.toUtf8();
+        unsigned char hash[crypto_generichash_BYTES_MIN];
+        crypto_generichash(hash, sizeof(hash), (const unsigned char*) raw.constData(), raw.size(),
+                           (const unsigned char*) fIndexKey.constData(), fIndexKey.size());
+
+        qint64 result = 0; // 64 bits are plenty, collisions get filtered after decryption
+        memcpy(&result, hash, sizeof(result));
+        return result;
+    }
+
+    const QByteArray EncryptSave::encryptRow(const QString& data) const
+    {
+        const QByteArray raw = data.toUtf8();
+        // version byte, nonce, then MAC and ciphertext. 41 bytes of overhead instead of 80
+        QByteArray result(1 + crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + raw.size(), Qt::Uninitialized);
+        unsigned char* out = (unsigned char*) result.data();
+        out[0] = ROW_FORMAT_V1;
+        randombytes_buf(out + 1, crypto_secretbox_NONCEBYTES);
+
+        QMutexLocker locker(&fKeysMutex);
+        if ( fRowKey.size() != crypto_secretbox_KEYBYTES ) {
+            Utils::fatal("Row key not set");
+        }
+
+        crypto_secretbox_easy(out + 1 + crypto_secretbox_NONCEBYTES, (const unsigned char*) raw.constData(), raw.size(),
+                              out + 1, (const unsigned char*) fRowKey.constData());
+
+        return result;
+    }
+
+    const QString EncryptSave::decryptRow(const QByteArray& data)
+    {
+        if ( isEncrypted(data) ) { // rows from before the row format, until migrated
+            return decrypt(data);
+        }
+
+        QByteArray buffer;
+        return openRow(rowKey(), data, buffer);
+    }
+
+    const QStringList EncryptSave::decryptRows(const QList<QByteArray>& rows)
+    {
+        QStringList result;
+        if ( rows.size() < PARALLEL_DECRYPT_MIN_ROWS ) { // not worth the thread handoff
+            foreach ( const QByteArray& row, rows ) {
+                result << decryptRow(row);
+            }
+            return result;
+        }
+
+        // key is copied once, workers only read it so no locking per row
+        const QByteArray key = rowKey();
+        QVector<QString> output(rows.size());
+        QThreadPool* pool = QThreadPool::globalInstance();
+        const int chunkSize = qMax(PARALLEL_DECRYPT_MIN_ROWS / 2, (rows.size() + pool->maxThreadCount() - 1) / pool->maxThreadCount());
+        int chunks = 0;
+        QSemaphore done;
+
+        for ( int first = 0; first < rows.size(); first += chunkSize ) {
+            const int last = qMin(first + chunkSize, rows.size());
+            pool->start(new RowDecryptor(*this, key, rows, output.data(), first, last, done));
+            chunks++;
+        }
+
+        done.acquire(chunks);
+        foreach ( const QString& message, output ) {
+            result << message;
+        }
+
+        return result;
+    }
+
+    const QByteArray EncryptSave::rowKey() const
+    {
+        QMutexLocker locker(&fKeysMutex);
+        if ( fRowKey.size() != crypto_secretbox_KEYBYTES ) {
+            Utils::fatal("Row key not set");
+        }
+
+        return fRowKey;
+    }
+
+    const QString EncryptSave::openRow(const QByteArray& key, const QByteArray& data, QByteArray& buffer) const
+    {
+        const int overhead = 1 + crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES;
+        if ( data.size() < overhead || (unsigned char) data.at(0) != ROW_FORMAT_V1 ) {
+            Utils::warn("Unknown row encryption format");
+            return QString(); // one bad row must not take the whole history page down
+        }
+
+        const int size = data.size() - overhead;
+        if ( buffer.size() < size ) {
+            buffer.resize(size); // callers reuse the buffer between rows, it only grows
+        }
+
+        const unsigned char* in = (const unsigned char*) data.constData();
+        if ( crypto_secretbox_open_easy((unsigned char*) buffer.data(), in + 1 + crypto_secretbox_NONCEBYTES,
+                                        data.size() - 1 - crypto_secretbox_NONCEBYTES, in + 1,
+                                        (const unsigned char*) key.constData()) != 0 ) {
+            Utils::warn("Row decryption error");
+            return QString();
+        }
+
+        return QString::fromUtf8(buffer.constData(), size);
+    }
+
+    //****************************RowDecryptor****************************//
+
+    RowDecryptor::RowDecryptor(EncryptSave& encryptSave, const QByteArray& key, const QList<QByteArray>& rows,
+                               QString* output, int first, int last, QSemaphore& done) : QRunnable(),
+        fEncryptSave(encryptSave), fKey(key), fRows(rows), fOutput(output), fFirst(first), fLast(last), fDone(done)
+    {
+    }
+
+    void RowDecryptor::run()
+    {
+        QByteArray buffer; // one output buffer for the whole chunk
+        for ( int i = fFirst; i < fLast; i++ ) {
+            const QByteArray& row = fRows.at(i);
+            if ( fEncryptSave.isEncrypted(row) ) {
+                fOutput[i] = fEncryptSave.decrypt(row); // legacy rows until migrated, pass key is read only
+            } else {
+                fOutput[i] = fEncryptSave.openRow(fKey, row, buffer);
+            }
+        }
+
+        fDone.release();
+    }
+
 }
@@ -5,6 +5,11 @@
 #include <QString>
 #include <QMap>
 #include <QByteArray>
+#include <QMutex>
+#include <QList>
+#include <QStringList>
+#include <QRunnable>
+#include <QSemaphore>
 #include <tox/toxencryptsave.h>
 
 namespace JTOX {
@@ -22,8 +27,37 @@ namespace JTOX {
         bool getPasswordIsSet() const;
         void setPassword(const QString& password, const QByteArray& data = QByteArray());
         bool isEncrypted(const QByteArray& data) const;
+        bool hasDBKeys() const;
+        void setDBKeys(const QByteArray& indexKey, const QByteArray& rowKey); // random keys kept in the DB wrapped by the pass key
+        qint64 blindToken(const QString& token) const; // keyed hash, safe to store in plain
+        const QByteArray encryptRow(const QString& data) const; // compact DB row format
+        const QString decryptRow(const QByteArray& data); // row format or legacy pass key data
+        const QStringList decryptRows(const QList<QByteArray>& rows); // same, spread over the global thread pool
+        const QString openRow(const QByteArray& key, const QByteArray& data, QByteArray& buffer) const;
     private:
         Tox_Pass_Key* fKey;
+        mutable QMutex fKeysMutex; // pass key and DB keys, DB worker, decrypt pool and GUI thread all use them
+        QByteArray fIndexKey;
+        QByteArray fRowKey;
+
+        const QByteArray rowKey() const;
+    };
+
+    // decrypts rows [first, last) of a batch into output, releases done when finished
+    class RowDecryptor : public QRunnable
+    {
+    public:
+        RowDecryptor(EncryptSave& encryptSave, const QByteArray& key, const QList<QByteArray>& rows,
+                     QString* output, int first, int last, QSemaphore& done);
+        void run();
+    private:
+        EncryptSave& fEncryptSave;
+        const QByteArray fKey;
+        const QList<QByteArray>& fRows;
+        QString* fOutput; // rows.size() entries, each worker writes only its own range
+        int fFirst;
+        int fLast;
+        QSemaphore& fDone;
     };
 
 }
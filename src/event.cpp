@@ -39,6 +39,11 @@ namespace JTOX {
             case erFileSize: return fileSize();
             case erFilePosition: return fFilePosition;
             case erFilePausers: return fFilePausers;
+            case erFileHash: return QString(fFileHash.toHex()); // for display and comparison by eye
+            case erFileSpeed: return 0;
+            case erFileEta: return -1;
+            case erFileStalled: return false;
+            case erFriendID: return fFriendID;
         }
 
         return QVariant("invalid_role");
@@ -63,6 +68,28 @@ namespace JTOX {
         return fMessage;
     }
 
+    void Event::setMessage(const QString& message)
+    {
+        fMessage = message;
+        fCipher.clear();
+    }
+
+    bool Event::messageEncrypted() const
+    {
+        return !fCipher.isEmpty();
+    }
+
+    const QByteArray Event::cipher() const
+    {
+        return fCipher;
+    }
+
+    void Event::setCipher(const QByteArray& cipher)
+    {
+        fCipher = cipher;
+        fMessage.clear();
+    }
+
     qint64 Event::sendID() const
     {
         return fSendID;
@@ -161,6 +188,16 @@ namespace JTOX {
         fFilePausers = pausers;
     }
 
+    const QByteArray Event::fileHash() const
+    {
+        return fFileHash;
+    }
+
+    void Event::setFileHash(const QByteArray& hash)
+    {
+        fFileHash = hash;
+    }
+
     const QString Event::hyperLink(const QString& message) const
     {
         int n = message.indexOf("http://");
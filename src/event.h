@@ -45,7 +45,12 @@ namespace JTOX {
         erFileID,
         erFileSize,
         erFilePosition,
-        erFilePausers
+        erFilePausers,
+        erFileHash,
+        erFileSpeed, // active transfers only, see EventModel::data
+        erFileEta,
+        erFileStalled,
+        erFriendID
     };
 
     class Event
@@ -62,6 +67,10 @@ namespace JTOX {
         void setID(int id);
         void setCreatedAt(const QDateTime& created_at);
         const QString message() const;
+        void setMessage(const QString& message);
+        bool messageEncrypted() const; // history rows keep the ciphertext until shown
+        const QByteArray cipher() const;
+        void setCipher(const QByteArray& cipher);
         qint64 sendID() const;
         quint32 friendID() const;
         EventType type() const;
@@ -75,13 +84,16 @@ namespace JTOX {
         quint64 fileSize() const;
         quint64 filePosition() const;
         int filePausers() const;
+        const QByteArray fileHash() const; // sha256 of completed transfers, empty if unknown
         void setFilePosition(quint64 position);
         void setFilePausers(int pausers);
+        void setFileHash(const QByteArray& hash);
     private:
         int fID;
         quint32 fFriendID;
         EventType fEventType;
         QString fMessage;
+        QByteArray fCipher;
         qint64 fSendID;
         QDateTime fCreated;
         QString fFilePath;
@@ -89,6 +101,7 @@ namespace JTOX {
         quint64 fFileSize;
         quint64 fFilePosition;
         int fFilePausers;
+        QByteArray fFileHash;
 
         const QString hyperLink(const QString& message) const;
     };
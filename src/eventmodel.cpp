@@ -7,37 +7,72 @@
 #include <QFile>
 #include <QFileInfo>
 #include <QDir>
+#include <QCoreApplication>
+#include <QSettings>
 #include <QDebug>
+#include <limits>
+#include <algorithm>
+#include <unistd.h>
+#include <sodium/randombytes.h>
 
 namespace JTOX {
 
-    qint64 sLastPositionUpdate = 0;
+    const int EVENT_PAGE_SIZE = 50; // history rows loaded per setFriend/fetchMore
+    const int MESSAGE_CACHE_SIZE = 100; // decrypted history messages kept, a few screens worth
+    const int TRANSFER_CHECKPOINT_INTERVAL = 500; // ms between DB position writes per transfer
+    const int TRANSFER_PROGRESS_INTERVAL = 100; // ms between progress updates to the view, a few frames
+    const int TRANSFER_SAMPLE_INTERVAL = 1000; // ms between throughput samples and stall checks
+    const int TRANSFER_STALL_TIMEOUT = 30; // default seconds without progress before a running transfer gets kicked
 
     EventModel::EventModel(ToxCore& toxCore, FriendModel& friendModel, DBData& dbData) : QAbstractListModel(0),
                     fToxCore(toxCore), fFriendModel(friendModel), fDBData(dbData),
-                    fList(), fTimerViewed(), fTimerTyping(), fFriendID(-1), fTyping(false), fTransferFiles()
+                    fList(), fMessageCache(MESSAGE_CACHE_SIZE), fTimerViewed(), fTimerTyping(), fTimerDelivered(), fTimerProgress(), fTimerTransfers(), fStallTimeout(TRANSFER_STALL_TIMEOUT), fProgressed(), fPendingDeliveries(), fPendingSentIDs(), fPendingSendIDs(), fFriendID(-1), fCanFetchMore(false), fFetching(false), fHistoryGeneration(0), fTyping(false), fFileWriter(), fOffers()
     {
         connect(&toxCore, &ToxCore::messageDelivered, this, &EventModel::onMessageDelivered);
         connect(&toxCore, &ToxCore::messageReceived, this, &EventModel::onMessageReceived);
+        connect(&toxCore, &ToxCore::messageSent, this, &EventModel::onMessageSent);
         connect(&toxCore, &ToxCore::fileReceived, this, &EventModel::onFileReceived);
+        connect(&toxCore, &ToxCore::friendConStatusChanged, this, &EventModel::onFriendConStatusChanged);
+        connect(&toxCore, &ToxCore::fileSent, this, &EventModel::onFileSent);
+        connect(&toxCore, &ToxCore::fileFailed, this, &EventModel::onFileFailed);
         connect(&toxCore, &ToxCore::fileCanceled, this, &EventModel::onFileCanceled);
         connect(&toxCore, &ToxCore::filePaused, this, &EventModel::onFilePaused);
         connect(&toxCore, &ToxCore::fileResumed, this, &EventModel::onFileResumed);
         connect(&toxCore, &ToxCore::fileChunkReceived, this, &EventModel::onFileChunkReceived);
         connect(&toxCore, &ToxCore::fileChunkRequest, this, &EventModel::onFileChunkRequest);
+        connect(&toxCore, &ToxCore::applicationActiveChanged, this, &EventModel::onApplicationActiveChanged);
         connect(&friendModel, &FriendModel::friendUpdated, this, &EventModel::onFriendUpdated);
         connect(&friendModel, &FriendModel::friendWentOnline, this, &EventModel::onFriendWentOnline);
         connect(&fTimerViewed, &QTimer::timeout, this, &EventModel::onMessagesViewed);
         connect(&fTimerTyping, &QTimer::timeout, this, &EventModel::onTypingDone);
+        connect(&fTimerDelivered, &QTimer::timeout, this, &EventModel::onMessagesDelivered);
+        connect(&fTimerProgress, &QTimer::timeout, this, &EventModel::onTransfersProgressed);
+        connect(&fTimerTransfers, &QTimer::timeout, this, &EventModel::onTransfersSampled);
+        connect(&toxCore.transfers(), &TransferRegistry::admitted, this, &EventModel::onTransferAdmitted);
+        connect(&fFileWriter, &FileWriter::drained, this, &EventModel::onFileDrained);
+        connect(&fFileWriter, &FileWriter::closed, this, &EventModel::onFileClosed);
 
         fTimerViewed.setInterval(2000); // 2 sec after viewing we consider msgs read TODO: combine with actually viewed msgs from QML
         fTimerViewed.setSingleShot(true);
         fTimerTyping.setInterval(2000);
         fTimerTyping.setSingleShot(true);
+        fTimerDelivered.setInterval(0); // receipts from one tox iteration get applied together
+        fTimerDelivered.setSingleShot(true);
+        fTimerProgress.setInterval(TRANSFER_PROGRESS_INTERVAL);
+        fTimerProgress.setSingleShot(true); // only started by progress
+        fTimerTransfers.setInterval(TRANSFER_SAMPLE_INTERVAL); // started by running transfers, stops itself
+
+        QSettings settings;
+        fStallTimeout = settings.value("transfers/stall_timeout", TRANSFER_STALL_TIMEOUT).toInt();
+        fFileWriter.start();
+        fDBData.cancelStaleTransfers();
     }
 
     EventModel::~EventModel() {
-        cancelTransfers();
+        onMessagesDelivered(); // apply receipts still waiting for the timer
+        fFileWriter.stop();
+        QCoreApplication::sendPostedEvents(this, QEvent::MetaCall); // finish files the writer just closed
+        suspendTransfers(-1);
         fDB.close();
     }
 
@@ -53,6 +88,10 @@ namespace JTOX {
         result[erFileSize] = "file_size";
         result[erFilePosition] = "file_position";
         result[erFilePausers] = "file_pausers";
+        result[erFileHash] = "file_hash";
+        result[erFileSpeed] = "file_speed";
+        result[erFileEta] = "file_eta";
+        result[erFileStalled] = "file_stalled";
 
         return result;
     }
@@ -68,31 +107,46 @@ namespace JTOX {
             Utils::fatal("Requesting out of bounds data");
         }
 
-        return fList.at(row).value(role);
+        const Event& event = fList.at(row);
+        if ( role == erFileSpeed || role == erFileEta || role == erFileStalled ) {
+            const Transfer* transfer = event.isFile() ? fToxCore.transfers().getByEvent(event.id()) : NULL;
+            if ( transfer != NULL ) { // live numbers, not kept in the event
+                switch ( role ) {
+                    case erFileSpeed: return transfer->throughput();
+                    case erFileEta: return transfer->eta();
+                    default: return transfer->stalled();
+                }
+            }
+        }
+
+        if ( role == erMessage && event.messageEncrypted() ) { // decrypt on first show only
+            Event shown(event);
+            shown.setMessage(messageFor(event));
+            return shown.value(role);
+        }
+
+        return event.value(role);
     }
 
-    int EventModel::getFriendID() const
+    bool EventModel::canFetchMore(const QModelIndex &parent) const
     {
-        return fFriendID;
+        Q_UNUSED(parent);
+        return fFriendID >= 0 && fCanFetchMore && !fFetching;
     }
 
-    qint64 EventModel::sendMessageRaw(const QString& message, qint64 friendID, int id, QString& strError)
+    void EventModel::fetchMore(const QModelIndex &parent)
     {
-        qint64 sendID = -1;
-        const QByteArray rawMsg = message.toUtf8();
-        if ( rawMsg.size() == 0 ) { // empty msg is disallowed in toxcore
-            return sendID;
-        }
-        TOX_ERR_FRIEND_SEND_MESSAGE error;
-        sendID = tox_friend_send_message(fToxCore.tox(), friendID, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*) rawMsg.data(),
-                                         rawMsg.size(), &error);
-        strError = Utils::handleSendMessageError(error, true);
-        if ( !strError.isEmpty() ) {
-            return -1;
+        if ( !canFetchMore(parent) ) {
+            return;
         }
 
-        fDBData.updateEventSent(id, etMessageOutPending, sendID);
-        return sendID;
+        // fList is newest first, so older history continues from the last row
+        loadEventPage(fList.isEmpty() ? -1 : fList.last().id());
+    }
+
+    int EventModel::getFriendID() const
+    {
+        return fFriendID;
     }
 
     qint64 EventModel::setFriendIndex(int friendIndex)
@@ -108,6 +162,8 @@ namespace JTOX {
 
         setTyping(false);
         fFriendID = friendID;
+        fHistoryGeneration++;
+        fFetching = false;
 
         if ( fFriendID < 0 ) {
             fTimerViewed.stop(); // make sure we don't try to mark someone else's messages by accident
@@ -115,11 +171,13 @@ namespace JTOX {
         }
 
         beginResetModel();
-        fDBData.getEvents(fList, fFriendID);
+        fList.clear();
+        fMessageCache.clear();
+        fCanFetchMore = false;
         endResetModel();
 
         emit friendUpdated();
-        fTimerViewed.start();
+        loadEventPage(-1); // viewed timer starts once the page is in
     }
 
     void EventModel::sendMessage(const QString& message) {
@@ -135,34 +193,27 @@ namespace JTOX {
         StringListUTF8 parts = Utils::splitStringUTF8(message.toUtf8(), tox_max_message_length());
 
         foreach ( const QByteArray part, parts ) {
-            EventType eventType = etMessageOutOffline; // default to offline msg
-            qint64 sendID = -1;
             QDateTime createdAt;
-            Event event(-1, fFriendID, createdAt, eventType, part, sendID);
+            Event event(-1, fFriendID, createdAt, etMessageOutOffline, part, -1); // offline until onMessageSent says otherwise
             fDBData.insertEvent(event);
 
-            if ( getFriendStatus() > 0 ) { // if friend is online, send it and use out pending mt
-                QString strError;
-                sendID = sendMessageRaw(part, fFriendID, event.id(), strError);
-                if ( sendID < 0 ) { // shouldn't happen since we check input now, but we need to handle somehow
-                    fDBData.deleteEvent(event.id());
-                    emit eventError(strError);
-                    return;
-                }
-                eventType = etMessageOutPending; // if we got here the message is out
-                event.setEventType(eventType);
-                event.setSendID(sendID);
-            }
-
             beginInsertRows(QModelIndex(), 0, 0);
             fList.push_front(event);
             endInsertRows();
+
+            if ( getFriendStatus() > 0 ) {
+                fToxCore.sendMessage(fFriendID, event.id(), part);
+            }
         }
     }
 
     void EventModel::deleteMessage(int eventID)
     {
         int index = indexForEvent(eventID);
+        if ( index < 0 ) {
+            return;
+        }
+
         if ( fList.at(index).type() != etMessageOutOffline ) {
             Utils::fatal("Unable to delete online message");
         }
@@ -198,16 +249,75 @@ namespace JTOX {
             return;
         }
 
-        QByteArray fileID; // TODO: allow resume between restarts by setting this to existing file_id from db
-        quint32 fileNumber = fToxCore.sendFile(fFriendID, filePath, fileID);
+        offerFile(fFriendID, filePath, file.size());
+    }
 
-        QDateTime createdAt;
-        Event event(-1, fFriendID, createdAt, etFileTransferOut, QFileInfo(file).fileName(), fileNumber, filePath, fileID, file.size(), 0, 0x2);
+    void EventModel::sendFileToFriends(const QString& filePath, const QVariantList& friendIDs)
+    {
+        const QFile file(filePath);
+        if ( !file.exists() ) {
+            emit transferError("File not found");
+            return;
+        }
+
+        // the transfers share one open file and mapping in the registry, see TransferSource
+        foreach ( const QVariant& friendID, friendIDs ) {
+            if ( !fFriendModel.getFriendByID(friendID.toUInt()).isOnline() ) {
+                emit transferError(tr("Friend is offline"));
+                continue;
+            }
+
+            offerFile(friendID.toUInt(), filePath, file.size());
+        }
+    }
+
+    void EventModel::offerFile(quint32 friendID, const QString& filePath, quint64 fileSize)
+    {
+        QByteArray fileID(TOX_FILE_ID_LENGTH, 0); // new random one, kept in the event so resumeTransfers can re-offer it
+        randombytes_buf((quint8*) fileID.data(), TOX_FILE_ID_LENGTH);
+
+        QDateTime createdAt; // file number follows in onFileSent
+        Event event(-1, friendID, createdAt, etFileTransferOut, QFileInfo(filePath).fileName(), 0, filePath, fileID, fileSize, 0, 0x2);
         fDBData.insertEvent(event);
+        fOffers.insert(event.id(), event);
+        fToxCore.sendFile(friendID, event.id(), filePath, fileID);
 
-        beginInsertRows(QModelIndex(), 0, 0);
-        fList.push_front(event);
-        endInsertRows();
+        if ( fFriendID == friendID ) {
+            beginInsertRows(QModelIndex(), 0, 0);
+            fList.push_front(event);
+            endInsertRows();
+        }
+    }
+
+    void EventModel::onFileSent(quint32 friendID, quint32 fileNumber, int eventID, int error)
+    {
+        if ( !fOffers.contains(eventID) ) { // canceled while offering
+            if ( error == TOX_ERR_FILE_SEND_OK ) {
+                fToxCore.fileControl(friendID, fileNumber, TOX_FILE_CONTROL_CANCEL);
+            }
+            return;
+        }
+
+        const Event event = fOffers.take(eventID);
+        const QString strError = Utils::handleToxFileSendError((TOX_ERR_FILE_SEND) error, true);
+        if ( !strError.isEmpty() ) {
+            if ( error != TOX_ERR_FILE_SEND_FRIEND_NOT_CONNECTED ) { // offline ones get offered again by resumeTransfers
+                updateEventType(event, etFileTransferOutCanceled);
+            }
+            emit transferError(strError);
+            return;
+        }
+
+        fDBData.updateEventSent(event.id(), etFileTransferOut, fileNumber);
+        Transfer* transfer = fToxCore.transfers().add(tkFile, friendID, fileNumber, event.fileSize());
+        transfer->setEvent(event.id(), etFileTransferOut, event.filePath());
+        transfer->setFileID(event.fileID());
+        transfer->setPosition(event.filePosition());
+
+        QVector<int> roles(2);
+        roles[0] = erEventType;
+        roles[1] = erFilePausers;
+        updateTransfer(transfer, etFileTransferOut, 0x2, roles); // until the receiver accepts
     }
 
     bool EventModel::deleteFile(int eventID)
@@ -231,14 +341,14 @@ namespace JTOX {
     void EventModel::pauseFile(int eventID)
     {
         // TODO: notify of busy less
-        Event transfer;
-        if ( !fDBData.getEvent(eventID, transfer) ) {
-            emit transferError("Unable to find file transfer in DB");
+        Transfer* transfer = fToxCore.transfers().getByEvent(eventID);
+        if ( transfer == NULL ) {
+            emit transferError("Transfer not found");
             return;
         }
 
         EventType pausedType = etFileTransferInPaused;
-        switch ( transfer.type() ) {
+        switch ( transfer->eventType() ) {
             case etFileTransferInRunning:
             case etFileTransferInPaused: pausedType = etFileTransferInPaused; break;
             case etFileTransferOutRunning:
@@ -246,97 +356,165 @@ namespace JTOX {
             default: Utils::fatal("Unable to pause file, invalid event type"); return;
         }
 
-        if ( (transfer.filePausers() & 0x1) != 0 ) {
+        if ( (transfer->pausers() & 0x1) != 0 ) {
             Utils::fatal("Unable to pause file, already paused locally");
         }
 
-        TOX_ERR_FILE_CONTROL error;
-        tox_file_control(fToxCore.tox(), transfer.friendID(), transfer.sendID(), TOX_FILE_CONTROL_PAUSE, &error);
-        const QString strError = Utils::handleFileControlError(error);
-        if ( !strError.isEmpty() ) {
-            emit transferError("Unable to pause file transfer");
-            return;
+        if ( transfer->holds() == 0 ) { // held ones are paused in tox already, the user bit keeps them there
+            fToxCore.fileControl(transfer->friendID(), transfer->fileNumber(), TOX_FILE_CONTROL_PAUSE);
         }
 
         QVector<int> roles(2);
         roles[0] = erEventType;
         roles[1] = erFilePausers;
-        updateEvent(transfer, pausedType, transfer.filePosition(), transfer.filePausers() | 0x1, roles); // 1st bit us 2nd bit them
+        updateTransfer(transfer, pausedType, transfer->pausers() | 0x1, roles); // 1st bit us 2nd bit them
     }
 
     void EventModel::resumeFile(int eventID)
     {
         // TODO: notify of busy need
-        Event transfer;
-        if ( !fDBData.getEvent(eventID, transfer) ) {
+        Transfer* transfer = fToxCore.transfers().getByEvent(eventID);
+        if ( transfer == NULL ) {
             emit transferError("Transfer not found");
             return;
         }
 
-        if ( (transfer.filePausers() & 0x1) == 0x0 ) { // if not paused on our side
+        if ( (transfer->pausers() & 0x1) == 0x0 ) { // if not paused on our side
             Utils::fatal("Unable to resume file, not paused locally");
         }
 
         EventType resumeType = etFileTransferInRunning;
-        switch ( transfer.type() ) {
+        switch ( transfer->eventType() ) {
             case etFileTransferIn: resumeType = etFileTransferInRunning; break;
             case etFileTransferInPaused: resumeType = etFileTransferInRunning; break;
             case etFileTransferOutPaused: resumeType = etFileTransferOutRunning; break;
             default: Utils::fatal("Unable to resume file, invalid event type"); return;
         }
 
-        if ( (transfer.filePausers() & 0x2) != 0x0 ) { // if still paused on their side keep paused on event type
+        if ( (transfer->pausers() & 0x2) != 0x0 ) { // if still paused on their side keep paused on event type
             resumeType = resumeType == etFileTransferInRunning ? etFileTransferInPaused : etFileTransferOutPaused;
         }
 
-        TOX_ERR_FILE_CONTROL error;
-        tox_file_control(fToxCore.tox(), transfer.friendID(), transfer.sendID(), TOX_FILE_CONTROL_RESUME, &error);
-        const QString strError = Utils::handleFileControlError(error);
-        if ( !strError.isEmpty() ) {
-            emit transferError("Unable to resume file transfer");
-            return;
-        }
-
         QVector<int> roles(2);
         roles[0] = erEventType;
         roles[1] = erFilePausers;
-        updateEvent(transfer, resumeType, transfer.filePosition(), transfer.filePausers() ^ 0x1, roles); // 1st bit us 2nd bit them
+        if ( transfer->eventType() == etFileTransferIn ) { // accepted, file gets created by the writer
+            fFileWriter.open(transfer->eventID(), transfer->filePath(), transfer->size(), transfer->position());
+
+            if ( !fToxCore.transfers().admit(transfer) ) {
+                // queued behind running transfers, not accepted in tox yet which holds it already
+                transfer->setHolds(transfer->holds() | thQueued);
+                updateTransfer(transfer, etFileTransferInPaused, transfer->pausers() ^ 0x1, roles);
+                return;
+            }
+        }
+
+        if ( transfer->holds() == 0 ) { // held ones resume in tox once released
+            fToxCore.fileControl(transfer->friendID(), transfer->fileNumber(), TOX_FILE_CONTROL_RESUME);
+        }
+
+        updateTransfer(transfer, resumeType, transfer->pausers() ^ 0x1, roles); // 1st bit us 2nd bit them
     }
 
     void EventModel::cancelFile(int eventID)
     {
-        Event transfer;
-        if ( !fDBData.getEvent(eventID, transfer) ) {
+        Transfer* transfer = fToxCore.transfers().getByEvent(eventID);
+        if ( transfer != NULL ) {
+            return cancelTransfer(transfer);
+        }
+
+        // not active in this session, only the DB row can be stuck in an unfinished state
+        fOffers.remove(eventID); // onFileSent cancels it in tox
+        Event event;
+        if ( !fDBData.getEvent(eventID, event) ) {
             emit transferError("Transfer not found");
             return;
         }
 
-        cancelTransfer(transfer);
+        switch ( event.type() ) {
+            case etFileTransferIn:
+            case etFileTransferInPaused:
+            case etFileTransferInRunning: updateEventType(event, etFileTransferInCanceled); break;
+            case etFileTransferOut:
+            case etFileTransferOutPaused:
+            case etFileTransferOutRunning: updateEventType(event, etFileTransferOutCanceled); break;
+            default: break;
+        }
     }
 
-    void EventModel::refreshFilePosition(int index)
+    void EventModel::onMessageSent(quint32 friendID, int eventID, quint32 sendID, int error)
     {
-        if ( index >= 0 && index < fList.size() ) {
-            emit dataChanged(createIndex(index, 0), createIndex(index, 0), QVector<int>(1, erFilePosition));
+        Q_UNUSED(friendID);
+        const QString strError = Utils::handleSendMessageError((TOX_ERR_FRIEND_SEND_MESSAGE) error, true);
+        if ( error == TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_CONNECTED || error == TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ ) {
+            return; // stays offline, goes out again with onFriendWentOnline
+        }
+
+        const int index = indexForEvent(eventID);
+        if ( !strError.isEmpty() ) { // handled error case or empty message bug (fixed since)
+            fDBData.deleteEvent(eventID);
+            if ( index >= 0 ) {
+                beginRemoveRows(QModelIndex(), index, index);
+                fList.removeAt(index);
+                endRemoveRows();
+            }
+            emit eventError(strError);
+            return;
         }
+
+        fPendingSentIDs.append(eventID);
+        fPendingSendIDs.append(sendID);
+        fTimerDelivered.start(); // written before the receipts, which may come in the same pass
+
+        if ( index >= 0 ) {
+            fList[index].setSendID(sendID);
+            fList[index].setEventType(etMessageOutPending);
+            emit dataChanged(createIndex(index, 0), createIndex(index, 0), QVector<int>(1, erEventType));
+        }
+    }
+
+    void EventModel::flushMessagesSent()
+    {
+        fDBData.updateEventsSent(fPendingSentIDs, fPendingSendIDs);
+        fPendingSentIDs.clear();
+        fPendingSendIDs.clear();
     }
 
     void EventModel::onMessageDelivered(quint32 friendID, quint32 sendID) {
-        fDBData.deliverEvent(sendID, friendID);
+        fPendingDeliveries[friendID].append(sendID);
+        fTimerDelivered.start();
+    }
+
+    void EventModel::onMessagesDelivered()
+    {
+        flushMessagesSent(); // receipts match on the send_id
+
+        QMapIterator<quint32, QList<quint32>> iter(fPendingDeliveries);
+        while ( iter.hasNext() ) {
+            iter.next();
+            fDBData.deliverEvents(iter.key(), iter.value());
+        }
 
-        // if we're "open" on the given friend, make sure to update the UI
-        if ( fFriendID != friendID ) {
+        // if we're "open" on a friend with receipts, make sure to update the UI
+        const QList<quint32> sendIDs = fFriendID >= 0 ? fPendingDeliveries.value(fFriendID) : QList<quint32>();
+        fPendingDeliveries.clear();
+        if ( sendIDs.isEmpty() ) {
             return;
         }
 
-        for ( int row = fList.size() - 1; row >= 0; row-- ) {
+        int first = -1, last = -1;
+        for ( int row = 0; row < fList.size(); row++ ) {
             const Event& event = fList.at(row);
-            if ( event.sendID() >= 0 && event.sendID() == sendID && event.type() == etMessageOutPending ) {
+            if ( event.type() == etMessageOutPending && event.sendID() >= 0 && sendIDs.contains((quint32) event.sendID()) ) {
                 fList[row].delivered();
-                emit dataChanged(createIndex(row, 0), createIndex(row, 0), QVector<int>(1, erEventType));
-                return;
+                if ( first < 0 ) first = row;
+                last = row;
             }
         }
+
+        if ( first >= 0 ) {
+            emit dataChanged(createIndex(first, 0), createIndex(last, 0), QVector<int>(1, erEventType));
+        }
     }
 
     void EventModel::onMessageReceived(quint32 friend_id, TOX_MESSAGE_TYPE type, const QString &message)
@@ -375,6 +553,8 @@ namespace JTOX {
 
     void EventModel::onFriendWentOnline(quint32 friendID)
     {
+        flushMessagesSent(); // so the ones already out aren't read back as offline
+
         EventList offlineMessages;
         EventList pendingMessages; // there's a chance we sent it out, it never arrived and got stuck in state pending
         fDBData.getEvents(offlineMessages, friendID, etMessageOutOffline);
@@ -382,39 +562,43 @@ namespace JTOX {
 
         offlineMessages.append(pendingMessages);
 
-        int index = -1;
+        // results come back in onMessageSent, DB updates are applied once for the whole set
         foreach ( const Event& event, offlineMessages ) {
-            QString strError;
-            qint64 sendID = sendMessageRaw(event.message(), friendID, event.id(), strError);
-
-            if ( sendID < 0 ) { // handled error case or empty message bug (fixed since)
-                fDBData.deleteEvent(event.id()); // remove the message
-                if ( fFriendID == friendID && (index = indexForEvent(event.id())) >= 0 ) {
-                    beginRemoveRows(QModelIndex(), index, index);
-                    fList.removeAt(index);
-                    endRemoveRows();
-                    emit eventError(tr("Removed invalid pending message"));
-                    qDebug() << "removed invalid pending msg\n";
-                }
-                continue;
-            }
+            fToxCore.sendMessage(friendID, event.id(), event.message().toUtf8());
+        }
 
-            if ( fFriendID == friendID && (index = indexForEvent(event.id())) >= 0 ) {
-                fList[index].setSendID(sendID);
-                fList[index].setEventType(etMessageOutPending);
-            }
+        resumeTransfers(friendID);
+    }
+
+    void EventModel::onFriendConStatusChanged(quint32 friend_id, int status)
+    {
+        if ( status == TOX_CONNECTION_NONE ) {
+            suspendTransfers(friend_id); // tox drops transfers with the connection
         }
     }
 
-    void EventModel::onFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QString &file_name)
+    void EventModel::onFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QString &file_name, const QByteArray& fileID)
     {
+        if ( resumeIncoming(friend_id, file_number, file_size, fileID) ) {
+            return; // re-offer of a transfer interrupted earlier
+        }
+
+        if ( reuseIncoming(friend_id, file_number, file_size, file_name, fileID) ) {
+            return; // we have this one already
+        }
+
         QDateTime createdAt;
         bool activeFriend = fFriendID == friend_id && fToxCore.getApplicationActive();
         const QDir dir(QStandardPaths::writableLocation(QStandardPaths::DownloadLocation));
         const QString file_path = dir.absoluteFilePath(file_name);
-        Event event(-1, friend_id, createdAt, etFileTransferIn, file_name, file_number, file_path, QByteArray(), file_size, 0, 0x1);
+        Event event(-1, friend_id, createdAt, etFileTransferIn, file_name, file_number, file_path, fileID, file_size, 0, 0x1);
         fDBData.insertEvent(event);
 
+        Transfer* transfer = fToxCore.transfers().add(tkFile, friend_id, file_number, file_size);
+        transfer->setEvent(event.id(), etFileTransferIn, file_path);
+        transfer->setFileID(fileID);
+        transfer->setPausers(0x1);
+
         if ( fFriendID == friend_id ) { // add event to visible list if we're open on this friend
             beginInsertRows(QModelIndex(), 0, 0);
             fList.push_front(event);
@@ -430,158 +614,204 @@ namespace JTOX {
 
     void EventModel::onFileChunkReceived(quint32 friend_id, quint32 file_number, quint64 position, const QByteArray &data)
     {
-        Event transfer;
-        if ( !fDBData.getEvent(friend_id, file_number, etFileTransferInRunning, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferInPaused, transfer) ) {
-            // emit transferError("Transfer not found");
-            // probably an avatar transfer, do nothing here
-            return;
+        Transfer* transfer = fToxCore.transfers().get(friend_id, file_number);
+        if ( transfer == NULL || transfer->kind() != tkFile ) {
+            return; // avatars are handled by the avatar provider
         }
 
-        QFile* file = fileForTransfer(transfer, QIODevice::Append);
-        if ( data.size() == 0 ) { // done
-            return completeTransfer(transfer, position);
-        }
-
-        if ( (quint64) file->size() != position ) {
+        if ( transfer->position() != position ) {
             emit transferError("Transfer file position mismatch");
             cancelTransfer(transfer);
             return;
         }
 
-        file->write(data);
+        if ( data.size() == 0 ) { // done, tox is through with the file number, onFileClosed finishes the event
+            fFileWriter.close(transfer->eventID());
+            fToxCore.transfers().remove(transfer);
+            return;
+        }
+
+        if ( !fFileWriter.write(transfer->eventID(), data) ) {
+            fToxCore.holdTransfer(transfer, thBackpressure); // disk is behind, hold the sender until the writer drains
+        }
+
+        transfer->setPosition(position + data.size());
+        checkpointTransfer(transfer);
+    }
 
-        qint64 now = QDateTime::currentMSecsSinceEpoch();
-        if ( now - sLastPositionUpdate < 500 ) {
-            return; // do not update db or in-mem too often, too expensive
+    void EventModel::onFileDrained(int eventID)
+    {
+        Transfer* transfer = fToxCore.transfers().getByEvent(eventID);
+        if ( transfer != NULL ) {
+            fToxCore.releaseTransfer(transfer, thBackpressure);
         }
-        sLastPositionUpdate = now;
+    }
 
-        fDBData.updateEvent(transfer.id(), transfer.type(), position, transfer.filePausers());
-        if ( fFriendID != transfer.friendID() ) {
-            return; // not on active friend
+    void EventModel::onFileClosed(int eventID, quint64 size, const QByteArray& hash, const QString& error)
+    {
+        Event event;
+        if ( !fDBData.getEvent(eventID, event) ) {
+            Utils::warn("Unable to find transfer"); // wiped meanwhile
+            return;
         }
 
-        int index = indexForEvent(transfer.id());
-        if ( index >= 0 ) {
-            fList[index].setFilePosition(position);
-            // Do not emit, we query updates from "UI side" to prevent overload
+        if ( !error.isEmpty() ) {
+            Transfer* transfer = fToxCore.transfers().getByEvent(eventID);
+            if ( transfer != NULL ) {
+                cancelTransfer(transfer);
+            } else {
+                updateEventType(event, etFileTransferInCanceled);
+            }
+            emit transferError(error);
+            return;
+        }
+
+        QVector<int> roles(2);
+        roles[0] = erEventType;
+        roles[1] = erFilePosition;
+        updateEvent(event, etFileTransferInDone, size, event.filePausers(), roles);
+        updateEventHash(eventID, event.friendID(), hash);
+        if ( !event.fileID().isEmpty() ) {
+            fDBData.addReceivedFile(event.fileID(), size, event.filePath());
         }
+        emit transferComplete(event.fileName(), fFriendModel.getListIndexForFriendID(event.friendID()), fFriendModel.getFriendByID(event.friendID()).name());
     }
 
     void EventModel::onFileChunkRequest(quint32 friend_id, quint32 file_number, quint64 position, size_t length)
     {
-        Event transfer;
-        if ( !fDBData.getEvent(friend_id, file_number, etFileTransferOut, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferOutRunning, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferOutPaused, transfer) ) {
+        Transfer* transfer = fToxCore.transfers().get(friend_id, file_number);
+        if ( transfer == NULL || transfer->kind() != tkFile ) {
             emit transferError("Transfer not found");
             return;
         }
 
-        QFile* file = fileForTransfer(transfer, QIODevice::ReadOnly);
+        QFile* file = transfer->file();
+        if ( file == NULL ) {
+            emit transferError(tr("Unable to open file for transfer"));
+            return cancelTransfer(transfer);
+        }
 
         if ( length == 0 ) { // done
             return completeTransfer(transfer, position);
         }
 
-        if ( position >= (quint64) file->size() || !file->seek(position) ) {
-            cancelTransfer(transfer);
-            emit transferError("Transfer position invalid");
-            return;
+        if ( transfer->eventType() == etFileTransferOut ) { // we just got "accepted" for sending
+            onFileResumed(friend_id, file_number); // change to running or queued and notify UI
         }
 
-        const QByteArray chunk = file->read(length);
-        if ( (size_t) chunk.size() != length ) {
+        // a queued transfer is paused in tox already, requests still arriving were made before that
+        // and tox expects them answered in order, dropping one fails the next send with a wrong position
+        if ( position + length > transfer->size() ) {
             cancelTransfer(transfer);
-            emit transferError("Transfer chunk length invalid");
-            return;
-        }
-
-        TOX_ERR_FILE_SEND_CHUNK error;
-        tox_file_send_chunk(fToxCore.tox(), friend_id, file_number, position, (quint8*) chunk.constData(), length, &error);
-
-        const QString strError = Utils::handleFileSendChunkError(error);
-        if ( !strError.isEmpty() ) {
-            cancelTransfer(transfer);
-            emit transferError("Transfer chunk length invalid");
+            emit transferError("Transfer position invalid");
             return;
         }
 
-        qint64 now = QDateTime::currentMSecsSinceEpoch();
-        if ( now - sLastPositionUpdate < 500 ) {
-            return; // do not update db or in-mem too often, too expensive
-        }
-        sLastPositionUpdate = now;
-
-        fDBData.updateEvent(transfer.id(), transfer.type(), position + length, transfer.filePausers());
-        // do not emit, UI will poll for updates
+        // served straight from the mapped window without a syscall, the command gets its own copy
+        const quint8* chunk = transfer->mapChunk(position, length);
+        QByteArray buffer;
+        if ( chunk != NULL ) {
+            buffer = QByteArray((const char*) chunk, length);
+        } else { // not mappable, read instead
+            if ( !file->seek(position) ) {
+                cancelTransfer(transfer);
+                emit transferError("Transfer position invalid");
+                return;
+            }
 
-        if ( fFriendID == friend_id && position == 0 ) { // we just got "accepted" for sending
-            onFileResumed(friend_id, file_number); // change to running and notify UI
-        } else if ( fFriendID == friend_id ) {
-            int index = indexForEvent(transfer.id());
-            if ( index < 0 ) {
-                emit transferError("Unable to find index for transfer"); // don't cancel tho
+            buffer = file->read(length);
+            if ( (size_t) buffer.size() != length ) {
+                cancelTransfer(transfer);
+                emit transferError("Transfer chunk length invalid");
                 return;
             }
-            fList[index].setFilePosition(position + length);
         }
+
+        fToxCore.sendFileChunk(friend_id, file_number, position, buffer); // a failed send comes back as onFileFailed
+        transfer->hashChunk(position, (const quint8*) buffer.constData(), length);
+        transfer->setPosition(position + length);
+        checkpointTransfer(transfer);
     }
 
     void EventModel::onFileCanceled(quint32 friend_id, quint32 file_number)
     {
-        Event transfer;
-        if ( !fDBData.getEvent(friend_id, file_number, etFileTransferInRunning, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferInPaused, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferIn, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferOutRunning, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferOutPaused, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferOut, transfer) ) {
+        Transfer* transfer = fToxCore.transfers().get(friend_id, file_number);
+        if ( transfer == NULL || transfer->kind() != tkFile ) {
             Utils::warn("Unable to find transfer"); // minor, don't crash on possibly race conditioned request
             return;
         }
 
-        EventType cancelType = transfer.isIncoming() ? etFileTransferInCanceled : etFileTransferOutCanceled;
-        updateEventType(transfer, cancelType);
-        emit transferError(transfer.isIncoming() ? tr("Transfer canceled by sender") : tr("Transfer canceled by receiver"));
+        bool incoming = transfer->isIncoming();
+        updateTransfer(transfer, incoming ? etFileTransferInCanceled : etFileTransferOutCanceled, transfer->pausers());
+        fFileWriter.discard(transfer->eventID());
+        fToxCore.transfers().remove(transfer);
+        emit transferError(incoming ? tr("Transfer canceled by sender") : tr("Transfer canceled by receiver"));
+    }
+
+    void EventModel::onFileFailed(quint32 friend_id, quint32 file_number, const QString& error)
+    {
+        Transfer* transfer = fToxCore.transfers().get(friend_id, file_number);
+        if ( transfer == NULL || transfer->kind() != tkFile ) {
+            return; // canceled meanwhile
+        }
+
+        updateTransfer(transfer, transfer->isIncoming() ? etFileTransferInCanceled : etFileTransferOutCanceled, transfer->pausers());
+        fFileWriter.discard(transfer->eventID());
+        fToxCore.transfers().remove(transfer);
+        emit transferError(error);
     }
 
     void EventModel::onFilePaused(quint32 friend_id, quint32 file_number)
     {
-        Event transfer;
-        if ( !fDBData.getEvent(friend_id, file_number, etFileTransferInRunning, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferInPaused, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferOutRunning, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferOutPaused, transfer) ) {
+        Transfer* transfer = fToxCore.transfers().get(friend_id, file_number);
+        if ( transfer == NULL || transfer->kind() != tkFile ) {
             Utils::warn("Unable to find transfer"); // minor, don't crash on possibly race conditioned request
             return;
         }
 
-        EventType pauseType = transfer.isIncoming() ? etFileTransferInPaused : etFileTransferOutPaused;
+        EventType pauseType = transfer->isIncoming() ? etFileTransferInPaused : etFileTransferOutPaused;
         QVector<int> roles(2);
         roles[0] = erEventType;
         roles[1] = erFilePausers;
-        updateEvent(transfer, pauseType, transfer.filePosition(), transfer.filePausers() | 0x2, roles); // 1st bit for us 2nd bit for them
+        updateTransfer(transfer, pauseType, transfer->pausers() | 0x2, roles); // 1st bit for us 2nd bit for them
     }
 
     void EventModel::onFileResumed(quint32 friend_id, quint32 file_number)
     {
-        Event transfer;
-        if ( !fDBData.getEvent(friend_id, file_number, etFileTransferInRunning, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferInPaused, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferOutRunning, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferOutPaused, transfer) &&
-             !fDBData.getEvent(friend_id, file_number, etFileTransferOut, transfer) ) {
+        Transfer* transfer = fToxCore.transfers().get(friend_id, file_number);
+        if ( transfer == NULL || transfer->kind() != tkFile ) {
             Utils::warn("Unable to find transfer"); // minor, don't crash on possibly race conditioned request
             return;
         }
 
-        EventType resumeType = transfer.isIncoming() ? etFileTransferInRunning : etFileTransferOutRunning;
         QVector<int> roles(2);
         roles[0] = erEventType;
         roles[1] = erFilePausers;
-        updateEvent(transfer, resumeType, transfer.filePosition(), transfer.filePausers() ^ 0x2, roles); // 1st bit for us 2nd bit for them
+        if ( transfer->eventType() == etFileTransferOut && !fToxCore.transfers().admit(transfer) ) {
+            // accepted by the receiver but queued behind running transfers, held in tox until onTransferAdmitted
+            fToxCore.holdTransfer(transfer, thQueued);
+            updateTransfer(transfer, etFileTransferOutPaused, transfer->pausers() ^ 0x2, roles);
+            return;
+        }
+
+        EventType resumeType = transfer->isIncoming() ? etFileTransferInRunning : etFileTransferOutRunning;
+        updateTransfer(transfer, resumeType, transfer->pausers() ^ 0x2, roles); // 1st bit for us 2nd bit for them
+    }
+
+    void EventModel::onTransferAdmitted(Transfer* transfer)
+    {
+        fToxCore.releaseTransfer(transfer, thQueued); // accepts incoming ones in tox, resumes outgoing ones
+        if ( (transfer->pausers() & 0x1) != 0 ) {
+            return; // paused by the user meanwhile, their resume takes it from here
+        }
+
+        bool paused = (transfer->pausers() & 0x2) != 0;
+        EventType eventType = transfer->isIncoming() ? (paused ? etFileTransferInPaused : etFileTransferInRunning) :
+                                                       (paused ? etFileTransferOutPaused : etFileTransferOutRunning);
+        QVector<int> roles(2);
+        roles[0] = erEventType;
+        roles[1] = erFilePausers;
+        updateTransfer(transfer, eventType, transfer->pausers(), roles);
     }
 
     int EventModel::indexForEvent(int eventID) const
@@ -592,8 +822,62 @@ namespace JTOX {
             }
         }
 
-        Utils::fatal("Cannot find index for event");
-        return -1;
+        return -1; // not loaded (yet), callers only update visible rows
+    }
+
+    void EventModel::onApplicationActiveChanged(bool active)
+    {
+        if ( !active ) {
+            fMessageCache.clear(); // don't keep plaintext around in background
+        }
+    }
+
+    const QString EventModel::messageFor(const Event& event) const
+    {
+        const QString* cached = fMessageCache.object(event.id());
+        if ( cached != NULL ) {
+            return *cached;
+        }
+
+        const QString message = fDBData.decryptMessage(event.cipher());
+        fMessageCache.insert(event.id(), new QString(message));
+        return message;
+    }
+
+    void EventModel::loadEventPage(int beforeID)
+    {
+        const int generation = fHistoryGeneration;
+        fFetching = true;
+        fDBData.getEventPageAsync(fFriendID, beforeID, EVENT_PAGE_SIZE, [this, generation](const EventList& page) {
+            onEventPageLoaded(generation, page);
+        });
+    }
+
+    void EventModel::onEventPageLoaded(int generation, const EventList& page)
+    {
+        if ( generation != fHistoryGeneration ) {
+            return; // friend changed while loading
+        }
+
+        fFetching = false;
+        fCanFetchMore = page.size() == EVENT_PAGE_SIZE;
+
+        // skip rows that were added live while the page was loading
+        EventList rows;
+        const int oldestID = fList.isEmpty() ? std::numeric_limits<int>::max() : fList.last().id();
+        foreach ( const Event& event, page ) {
+            if ( event.id() < oldestID ) {
+                rows.append(event);
+            }
+        }
+
+        if ( !rows.isEmpty() ) {
+            beginInsertRows(QModelIndex(), fList.size(), fList.size() + rows.size() - 1);
+            fList.append(rows);
+            endInsertRows();
+        }
+
+        fTimerViewed.start();
     }
 
     int EventModel::getFriendStatus() const {
@@ -644,62 +928,288 @@ namespace JTOX {
             return;
         }
 
-        TOX_ERR_SET_TYPING error;
-        tox_self_set_typing(fToxCore.tox(), friendID, typing, &error);
-        if ( error != TOX_ERR_SET_TYPING_OK ) {
-            Utils::fatal("Friend not found");
-        }
-
+        fToxCore.setTyping(friendID, typing);
         fTyping = typing;
         emit typingChanged(fTyping);
     }
 
-    void EventModel::cancelTransfer(const Event &transfer)
+    int EventModel::getStallTimeout() const
+    {
+        return fStallTimeout;
+    }
+
+    void EventModel::setStallTimeout(int timeout)
     {
-        quint64 transferID = Utils::transferID(transfer.friendID(), transfer.sendID());
-        if ( fTransferFiles.contains(transferID) ) {
-            fTransferFiles[transferID]->close();
-            delete fTransferFiles[transferID];
-            fTransferFiles.remove(transferID);
+        timeout = qMax(0, timeout);
+        if ( timeout == fStallTimeout ) {
+            return;
         }
 
-        EventType canceledType = transfer.isIncoming() ? etFileTransferInCanceled : etFileTransferOutCanceled;
+        fStallTimeout = timeout;
+        QSettings settings;
+        settings.setValue("transfers/stall_timeout", fStallTimeout);
+        emit stallTimeoutChanged(fStallTimeout);
+    }
 
-        TOX_ERR_FILE_CONTROL error;
-        tox_file_control(fToxCore.tox(), transfer.friendID(), transfer.sendID(), TOX_FILE_CONTROL_CANCEL, &error);
+    void EventModel::cancelTransfer(Transfer* transfer)
+    {
+        EventType canceledType = transfer->isIncoming() ? etFileTransferInCanceled : etFileTransferOutCanceled;
 
-        Utils::handleFileControlError(error, true); // don't fail on cancel, just log. friend could be off etc.
-        updateEventType(transfer, canceledType);
+        fToxCore.fileControl(transfer->friendID(), transfer->fileNumber(), TOX_FILE_CONTROL_CANCEL); // only logs, friend could be off etc.
+        updateTransfer(transfer, canceledType, transfer->pausers());
+        fFileWriter.discard(transfer->eventID());
+        fToxCore.transfers().remove(transfer);
+    }
+
+    void EventModel::suspendTransfers(qint64 friendID)
+    {
+        // rows stay unfinished with their file_id so both sides can pick up where they left off,
+        // queued ones go first so nothing gets admitted on the way out
+        TransferList transfers;
+        foreach ( Transfer* transfer, fToxCore.transfers().list(tkFile) ) {
+            if ( friendID < 0 || transfer->friendID() == friendID ) {
+                if ( transfer->queued() ) {
+                    transfers.prepend(transfer);
+                } else {
+                    transfers.append(transfer);
+                }
+            }
+        }
+
+        foreach ( Transfer* transfer, transfers ) {
+            suspendTransfer(transfer);
+        }
+    }
+
+    void EventModel::suspendTransfer(Transfer* transfer)
+    {
+        if ( transfer->isIncoming() ) { // only what reached the disk counts as done
+            transfer->setPosition(fFileWriter.written(transfer->eventID(), transfer->position()));
+            fFileWriter.discard(transfer->eventID());
+        }
+
+        EventType eventType = transfer->eventType();
+        if ( eventType == etFileTransferInRunning ) {
+            eventType = etFileTransferInPaused;
+        } else if ( eventType == etFileTransferOutRunning ) {
+            eventType = etFileTransferOutPaused;
+        }
+
+        QVector<int> roles(2);
+        roles[0] = erEventType;
+        roles[1] = erFilePosition;
+        updateTransfer(transfer, eventType, transfer->pausers(), roles);
+        fToxCore.transfers().remove(transfer);
     }
 
-    void EventModel::cancelTransfers()
+    void EventModel::resumeTransfers(quint32 friendID)
     {
-        // cancel all transfers, in progress, paused or pending
+        // uploads get offered again with their file_id, the receiver seeks past what it has,
+        // downloads wait for the sender to do the same in resumeIncoming
         EventList transfers;
-        fDBData.getTransfers(transfers);
+        fDBData.getTransfers(transfers, friendID);
 
-        foreach ( const Event& transfer, transfers ) {
-            cancelTransfer(transfer);
+        foreach ( const Event& event, transfers ) {
+            if ( event.isIncoming() || fToxCore.transfers().getByEvent(event.id()) != NULL || fOffers.contains(event.id()) ) {
+                continue;
+            }
+
+            const QFileInfo info(event.filePath());
+            if ( event.fileID().isEmpty() || !info.exists() || (quint64) info.size() != event.fileSize() ) {
+                updateEventType(event, etFileTransferOutCanceled); // gone or changed meanwhile
+                continue;
+            }
+
+            fOffers.insert(event.id(), event); // onFileSent picks it up, receiver accepts again from there
+            fToxCore.sendFile(friendID, event.id(), event.filePath(), event.fileID());
         }
     }
 
-    void EventModel::completeTransfer(const Event &transfer, quint64 position)
+    bool EventModel::resumeIncoming(quint32 friendID, quint32 fileNumber, quint64 fileSize, const QByteArray& fileID)
     {
-        quint64 transferID = Utils::transferID(transfer.friendID(), transfer.sendID());
-        if ( !fTransferFiles.contains(transferID) ) {
-            emit transferError(tr("Unable to find file for transfer"));
-            return cancelTransfer(transfer);
+        EventList transfers;
+        fDBData.getTransfers(transfers, friendID);
+
+        foreach ( Event event, transfers ) {
+            if ( !event.isIncoming() || fileID.isEmpty() || event.fileID() != fileID || event.fileSize() != fileSize ) {
+                continue;
+            }
+
+            Transfer* stale = fToxCore.transfers().getByEvent(event.id());
+            if ( stale != NULL ) { // went offline without us noticing
+                suspendTransfer(stale);
+                fDBData.getEvent(event.id(), event);
+            }
+
+            // continue after what was synced to disk, anything past that gets truncated by the writer
+            bool accepted = event.type() != etFileTransferIn;
+            const QFileInfo info(event.filePath());
+            quint64 position = accepted && info.exists() ? qMin(event.filePosition(), (quint64) info.size()) : 0;
+            bool resume = false;
+
+            fDBData.updateEventSent(event.id(), event.type(), fileNumber);
+            Transfer* transfer = fToxCore.transfers().add(tkFile, friendID, fileNumber, fileSize);
+            transfer->setEvent(event.id(), event.type(), event.filePath());
+            transfer->setFileID(fileID);
+            transfer->setPosition(position);
+
+            int pausers = event.filePausers() & 0x1; // their pause died with the connection
+            EventType eventType = event.type();
+            if ( accepted ) {
+                fFileWriter.open(event.id(), event.filePath(), fileSize, position);
+                eventType = etFileTransferInPaused;
+
+                if ( pausers == 0 && !fToxCore.transfers().admit(transfer) ) {
+                    transfer->setHolds(thQueued); // not accepted in tox yet which holds it already
+                } else if ( pausers == 0 ) { // was running, pick it up without asking the user again
+                    eventType = etFileTransferInRunning;
+                    resume = true;
+                }
+            }
+
+            if ( position > 0 || resume ) { // a failed seek or resume cancels it via onFileFailed
+                fToxCore.seekFile(friendID, fileNumber, position, resume);
+            }
+
+            QVector<int> roles(3);
+            roles[0] = erEventType;
+            roles[1] = erFilePosition;
+            roles[2] = erFilePausers;
+            updateTransfer(transfer, eventType, pausers, roles);
+            return true;
+        }
+
+        return false;
+    }
+
+    bool EventModel::reuseIncoming(quint32 friendID, quint32 fileNumber, quint64 fileSize, const QString& fileName, const QByteArray& fileID)
+    {
+        QString existingPath;
+        if ( fileID.isEmpty() || !fDBData.getReceivedFile(fileID, fileSize, existingPath) ) {
+            return false;
+        }
+
+        const QFileInfo existing(existingPath);
+        if ( !existing.isFile() || (quint64) existing.size() != fileSize ) {
+            fDBData.removeReceivedFile(fileID, fileSize); // moved or changed since
+            return false;
+        }
+
+        fToxCore.fileControl(friendID, fileNumber, TOX_FILE_CONTROL_CANCEL);
+
+        // link it under the offered name, or point at the copy we have if that name is taken
+        const QDir dir(QStandardPaths::writableLocation(QStandardPaths::DownloadLocation));
+        QString filePath = dir.absoluteFilePath(fileName);
+        if ( QFileInfo(filePath).canonicalFilePath() != existing.canonicalFilePath() ) {
+            if ( QFile::exists(filePath) || ::link(QFile::encodeName(existingPath).constData(), QFile::encodeName(filePath).constData()) != 0 ) {
+                filePath = existingPath;
+            }
+        }
+
+        QDateTime createdAt;
+        Event event(-1, friendID, createdAt, etFileTransferInDone, fileName, fileNumber, filePath, fileID, fileSize, fileSize, 0);
+        fDBData.insertEvent(event);
+
+        if ( fFriendID == friendID ) {
+            beginInsertRows(QModelIndex(), 0, 0);
+            fList.push_front(event);
+            endInsertRows();
         }
-        fTransferFiles[transferID]->close();
-        delete fTransferFiles[transferID];
-        fTransferFiles.remove(transferID);
 
-        EventType eType = transfer.type() == etFileTransferInRunning ? etFileTransferInDone : etFileTransferOutDone;
+        if ( fFriendID != friendID || !fToxCore.getApplicationActive() ) {
+            fFriendModel.unviewedMessageReceived(friendID);
+        }
+        emit transferComplete(fileName, fFriendModel.getListIndexForFriendID(friendID), fFriendModel.getFriendByID(friendID).name());
+        return true;
+    }
+
+    void EventModel::completeTransfer(Transfer* transfer, quint64 position)
+    {
+        const QString fileName = QFileInfo(transfer->filePath()).fileName();
+        quint32 friendID = transfer->friendID();
+        EventType eType = transfer->isIncoming() ? etFileTransferInDone : etFileTransferOutDone;
+
+        transfer->setPosition(position);
         QVector<int> roles(2);
         roles[0] = erEventType;
         roles[1] = erFilePosition;
-        updateEvent(transfer, eType, position, transfer.filePausers(), roles);
-        emit transferComplete(transfer.fileName(), fFriendModel.getListIndexForFriendID(transfer.friendID()), fFriendModel.getFriendByID(transfer.friendID()).name());
+        updateTransfer(transfer, eType, transfer->pausers(), roles);
+        if ( !transfer->isIncoming() ) {
+            updateEventHash(transfer->eventID(), friendID, transfer->digest()); // incoming ones get theirs from the writer
+        }
+        fToxCore.transfers().remove(transfer);
+        emit transferComplete(fileName, fFriendModel.getListIndexForFriendID(friendID), fFriendModel.getFriendByID(friendID).name());
+    }
+
+    void EventModel::checkpointTransfer(Transfer* transfer)
+    {
+        if ( fFriendID == transfer->friendID() ) {
+            fProgressed.insert(transfer->eventID());
+            if ( !fTimerProgress.isActive() ) {
+                fTimerProgress.start();
+            }
+        }
+
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+        if ( now - transfer->checkpointAt() < TRANSFER_CHECKPOINT_INTERVAL ) {
+            return; // position lives in the registry, DB and list only get periodic copies
+        }
+        transfer->setCheckpointAt(now);
+
+        fDBData.updateEvent(transfer->eventID(), transfer->eventType(), resumePosition(transfer), transfer->pausers());
+    }
+
+    quint64 EventModel::resumePosition(Transfer* transfer)
+    {
+        // incoming files are preallocated, only synced bytes are safe to continue after
+        return transfer->isIncoming() ? fFileWriter.synced(transfer->eventID(), transfer->position()) : transfer->position();
+    }
+
+    void EventModel::onTransfersProgressed()
+    {
+        QList<int> rows;
+        foreach ( int eventID, fProgressed ) {
+            Transfer* transfer = fToxCore.transfers().getByEvent(eventID);
+            int index = -1;
+            if ( transfer != NULL && fFriendID == transfer->friendID() && (index = indexForEvent(eventID)) >= 0 ) {
+                fList[index].setFilePosition(transfer->position());
+                rows << index;
+            }
+        }
+        fProgressed.clear();
+
+        // one dataChanged per run of adjacent rows
+        std::sort(rows.begin(), rows.end());
+        const QVector<int> roles(1, erFilePosition);
+        for ( int i = 0; i < rows.size(); ) {
+            int last = i;
+            while ( last + 1 < rows.size() && rows.at(last + 1) == rows.at(last) + 1 ) {
+                last++;
+            }
+            emit dataChanged(createIndex(rows.at(i), 0), createIndex(rows.at(last), 0), roles);
+            i = last + 1;
+        }
+    }
+
+    void EventModel::updateTransfer(Transfer* transfer, EventType eventType, int filePausers, const QVector<int>& roles)
+    {
+        if ( (eventType == etFileTransferInRunning || eventType == etFileTransferOutRunning) && !fTimerTransfers.isActive() ) {
+            fTimerTransfers.start();
+        }
+
+        transfer->setEventType(eventType);
+        transfer->setPausers(filePausers);
+        transfer->setCheckpointAt(QDateTime::currentMSecsSinceEpoch());
+
+        fDBData.updateEvent(transfer->eventID(), eventType, resumePosition(transfer), filePausers);
+
+        int index = -1;
+        if ( fFriendID == transfer->friendID() && (index = indexForEvent(transfer->eventID())) >= 0 ) {
+            fList[index].setEventType(eventType);
+            fList[index].setFilePosition(transfer->position());
+            fList[index].setFilePausers(filePausers);
+            emit dataChanged(createIndex(index, 0), createIndex(index, 0), roles);
+        }
     }
 
     void EventModel::updateEventType(const Event &event, EventType eventType, const QVector<int>& roles)
@@ -720,39 +1230,88 @@ namespace JTOX {
         }
     }
 
-    QFile *EventModel::fileForTransfer(const Event &transfer, QIODevice::OpenModeFlag openMode)
+    void EventModel::updateEventHash(int eventID, quint32 friendID, const QByteArray& hash)
     {
-        quint64 transferID = Utils::transferID(transfer.friendID(), transfer.sendID());
-        QFile* file = fTransferFiles.value(transferID, NULL);
-        if ( file == NULL ) { // new
-            file = new QFile(transfer.filePath());
+        if ( hash.isEmpty() ) {
+            return; // e.g. resumed upload, the part sent before wasn't hashed
+        }
+
+        fDBData.updateEventHash(eventID, hash);
+
+        int index = -1;
+        if ( fFriendID == friendID && (index = indexForEvent(eventID)) >= 0 ) {
+            fList[index].setFileHash(hash);
+            emit dataChanged(createIndex(index, 0), createIndex(index, 0), QVector<int>(1, erFileHash));
+        }
+    }
 
-            if ( !file->open(openMode) ) {
-                emit transferError("Error opening file: " + file->errorString());
-                return NULL;
+    void EventModel::onTransfersSampled()
+    {
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        bool running = false;
+        QList<int> rows;
+        foreach ( Transfer* transfer, fToxCore.transfers().list(tkFile) ) {
+            const bool active = transfer->eventType() == etFileTransferInRunning || transfer->eventType() == etFileTransferOutRunning;
+            running = running || active;
+
+            if ( (transfer->holds() & thStall) != 0 ) { // kicked last round, let it go again
+                fToxCore.releaseTransfer(transfer, thStall);
+                transfer->resetSamples(now);
+            } else if ( !active || transfer->holds() != 0 ) { // paused, queued or throttled on purpose
+                transfer->resetSamples(now);
+                transfer->setStalled(false);
+            } else {
+                transfer->sample(now);
+                if ( fStallTimeout > 0 && now - transfer->progressAt() >= fStallTimeout * 1000 ) {
+                    // a pause and resume round trip nudges both ends, toxcore's queues recover sooner than waiting it out
+                    transfer->setStalled(true);
+                    fToxCore.holdTransfer(transfer, thStall);
+                    transfer->resetSamples(now); // next kick a full timeout later if this one doesn't help
+                }
+            }
+
+            int index = -1;
+            if ( fFriendID == transfer->friendID() && (index = indexForEvent(transfer->eventID())) >= 0 ) {
+                rows << index;
             }
-            fTransferFiles[transferID] = file;
         }
 
-        return file;
+        if ( !running ) {
+            fTimerTransfers.stop();
+        }
+
+        QVector<int> roles(3);
+        roles[0] = erFileSpeed;
+        roles[1] = erFileEta;
+        roles[2] = erFileStalled;
+        foreach ( int index, rows ) {
+            emit dataChanged(createIndex(index, 0), createIndex(index, 0), roles);
+        }
     }
 
     void EventModel::onMessagesViewed()
     {
         if ( fFriendID < 0 ) return; // shouldn't happen as we clear the timer on setFriend(-1), but just in case
+        if ( fList.isEmpty() ) return;
+
+        // everything up to the newest loaded row was seen, older pages included
+        const int maxID = fList.first().id();
+        if ( fDBData.viewEvents(fFriendID, maxID) == 0 ) {
+            return;
+        }
 
-        int row = 0;
         int first = -1, last = -1;
-        foreach ( const Event event, fList ) {
-            if ( event.type() == etMessageInUnread ) {
-                if ( first < 0 ) first = row;
-                if ( row > last ) last = row;
-                fDBData.updateEventType(fList.at(row).id(), etMessageIn);
+        for ( int row = 0; row < fList.size(); row++ ) {
+            if ( fList.at(row).type() == etMessageInUnread ) {
                 fList[row].viewed();
+                if ( first < 0 ) first = row;
+                last = row;
             }
-            row++;
         }
-        emit dataChanged(createIndex(first, 0), createIndex(last, 0), QVector<int>(1, erEventType));
+
+        if ( first >= 0 ) {
+            emit dataChanged(createIndex(first, 0), createIndex(last, 0), QVector<int>(1, erEventType));
+        }
         fFriendModel.messagesViewed(fFriendID);
     }
 
@@ -7,12 +7,15 @@
 #include <QVariant>
 #include <QTimer>
 #include <QMap>
+#include <QCache>
+#include <QSet>
 #include <tox/tox.h>
 #include "toxcore.h"
 #include "friendmodel.h"
 #include "event.h"
 #include "encryptsave.h"
 #include "dbdata.h"
+#include "filewriter.h"
 
 namespace JTOX {
 
@@ -24,14 +27,16 @@ namespace JTOX {
         Q_PROPERTY(int friendStatus READ getFriendStatus NOTIFY friendUpdated)
         Q_PROPERTY(bool friendTyping READ getFriendTyping NOTIFY friendUpdated)
         Q_PROPERTY(bool typing READ getTyping WRITE setTyping NOTIFY typingChanged)
+        Q_PROPERTY(int stallTimeout READ getStallTimeout WRITE setStallTimeout NOTIFY stallTimeoutChanged) // seconds, 0 disables the stall kick
     public:
         EventModel(ToxCore& toxCore, FriendModel& friendModel, DBData& dbData);
         virtual ~EventModel();
         QHash<int, QByteArray> roleNames() const;
         int rowCount(const QModelIndex &parent = QModelIndex()) const;
         QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+        bool canFetchMore(const QModelIndex &parent) const;
+        void fetchMore(const QModelIndex &parent);
         int getFriendID() const;
-        qint64 sendMessageRaw(const QString& message, qint64 friendID, int id, QString& strError);
 
         Q_INVOKABLE qint64 setFriendIndex(int friendIndex);
         Q_INVOKABLE void setFriend(qint64 friendID);
@@ -39,61 +44,100 @@ namespace JTOX {
         Q_INVOKABLE void deleteMessage(int eventID);
         Q_INVOKABLE bool fileExists(int eventID);
         Q_INVOKABLE void sendFile(const QString& filePath);
+        Q_INVOKABLE void sendFileToFriends(const QString& filePath, const QVariantList& friendIDs); // one transfer each, one read of the file
         Q_INVOKABLE bool deleteFile(int eventID);
         Q_INVOKABLE void pauseFile(int eventID);
         Q_INVOKABLE void resumeFile(int eventID);
         Q_INVOKABLE void cancelFile(int eventID);
-        Q_INVOKABLE void refreshFilePosition(int index);
     signals:
         void friendUpdated() const;
         void typingChanged(bool typing) const;
+        void stallTimeoutChanged(int timeout) const;
         void transferError(const QString& error) const;
         void eventError(const QString& error) const;
         void transferComplete(const QString& fileName, int friendIndex, const QString& friendName);
         void messageReceived(int friendIndex, const QString& friendName) const;
         void transferReceived(int friendIndex, const QString& friendName) const;
     private slots:
+        void onMessageSent(quint32 friendID, int eventID, quint32 sendID, int error);
         void onMessageDelivered(quint32 friendID, quint32 sendID);
         void onMessageReceived(quint32 friend_id, TOX_MESSAGE_TYPE type, const QString& message);
         void onFriendUpdated(quint32 friend_id);
         void onFriendWentOnline(quint32 friendID);
-        void onFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QString& file_name);
+        void onFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QString& file_name, const QByteArray& fileID);
+        void onFriendConStatusChanged(quint32 friend_id, int status);
         void onFileChunkReceived(quint32 friend_id, quint32 file_number, quint64 position, const QByteArray& data);
         void onFileChunkRequest(quint32 friend_id, quint32 file_number, quint64 position, size_t length);
+        void onFileSent(quint32 friendID, quint32 fileNumber, int eventID, int error);
+        void onFileFailed(quint32 friend_id, quint32 file_number, const QString& error);
         void onFileCanceled(quint32 friend_id, quint32 file_number);
         void onFilePaused(quint32 friend_id, quint32 file_number);
         void onFileResumed(quint32 friend_id, quint32 file_number);
+        void onTransferAdmitted(Transfer* transfer);
+        void onFileDrained(int eventID);
+        void onFileClosed(int eventID, quint64 size, const QByteArray& hash, const QString& error);
+        void onApplicationActiveChanged(bool active);
     private:
         ToxCore& fToxCore;
         FriendModel& fFriendModel;
-        DBData fDBData;
+        DBData& fDBData;
         EventList fList;
+        mutable QCache<int, QString> fMessageCache; // event_id -> plaintext of shown history rows
         QTimer fTimerViewed;
         QTimer fTimerTyping;
+        QTimer fTimerDelivered;
+        QTimer fTimerProgress;
+        QTimer fTimerTransfers; // throughput sampling and stall checks while transfers run
+        int fStallTimeout;
+        QSet<int> fProgressed; // event_ids of shown transfers that moved since the last progress update
+        QMap<quint32, QList<quint32>> fPendingDeliveries; // friend_id -> send_ids delivered this event loop pass
+        QList<int> fPendingSentIDs; // event_ids of messages sent this event loop pass
+        QList<qint64> fPendingSendIDs; // their send_ids, same order
         QSqlDatabase fDB;
         QSqlQuery fSelectQuery;
         QSqlQuery fInsertQuery;
         QSqlQuery fDeliveredUpdateQuery;
         qint64 fFriendID;
+        bool fCanFetchMore;
+        bool fFetching;
+        int fHistoryGeneration; // bumped on friend change so stale pages are dropped
         bool fTyping;
-        QMap <quint64, QFile*> fTransferFiles;
+        FileWriter fFileWriter; // incoming transfer files
+        QMap<int, Event> fOffers; // event_id -> outgoing file waiting for its file number from onFileSent
 
         int indexForEvent(int eventID) const;
+        const QString messageFor(const Event& event) const;
+        void loadEventPage(int beforeID);
+        void onEventPageLoaded(int generation, const EventList& page);
         int getFriendStatus() const;
         bool getFriendTyping() const;
         const QString getFriendName() const;
         bool getTyping() const;
         void setTyping(bool typing);
         void setTyping(qint64 friendID, bool typing);
-        void cancelTransfer(const Event& transfer);
-        void cancelTransfers();
-        void completeTransfer(const Event& transfer, quint64 position);
+        int getStallTimeout() const;
+        void setStallTimeout(int timeout);
+        void flushMessagesSent();
+        void offerFile(quint32 friendID, const QString& filePath, quint64 fileSize);
+        void cancelTransfer(Transfer* transfer);
+        void suspendTransfers(qint64 friendID); // -1 for all
+        void suspendTransfer(Transfer* transfer);
+        void resumeTransfers(quint32 friendID);
+        bool resumeIncoming(quint32 friendID, quint32 fileNumber, quint64 fileSize, const QByteArray& fileID);
+        bool reuseIncoming(quint32 friendID, quint32 fileNumber, quint64 fileSize, const QString& fileName, const QByteArray& fileID);
+        void completeTransfer(Transfer* transfer, quint64 position);
+        void checkpointTransfer(Transfer* transfer); // periodic position write
+        quint64 resumePosition(Transfer* transfer); // what a later resume can rely on
+        void updateTransfer(Transfer* transfer, EventType eventType, int filePausers, const QVector<int>& roles = QVector<int>(1, erEventType));
         void updateEventType(const Event& event, EventType eventType, const QVector<int>& roles = QVector<int>(1, erEventType));
         void updateEvent(const Event& event, EventType eventType, quint64 filePosition, int filePausers, const QVector<int>& roles);
-        QFile* fileForTransfer(const Event& transfer, QIODevice::OpenModeFlag openMode);
+        void updateEventHash(int eventID, quint32 friendID, const QByteArray& hash);
     private slots:
         void onMessagesViewed();
+        void onMessagesDelivered();
         void onTypingDone();
+        void onTransfersProgressed();
+        void onTransfersSampled();
     };
 
 }
@@ -0,0 +1,317 @@
+#include "filewriter.h"
+#include "utils.h"
+#include <QMutexLocker>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+namespace JTOX {
+
+    const int WRITE_BLOCK_SIZE = 256 * 1024; // writes go out in multiples of this
+    const int WRITE_HIGH_WATER = 4 * 1024 * 1024; // unwritten bytes per file before the sender gets paused
+    const int WRITE_LOW_WATER = 1024 * 1024; // unwritten bytes per file before it gets resumed
+    const int WRITE_IDLE_FLUSH = 250; // ms of quiet before partial blocks are written
+    const quint64 WRITE_SYNC_SIZE = 8 * 1024 * 1024; // written bytes between syncs, bounds what a resume redoes
+
+    FileWriter::FileWriter() : QThread(0), fMutex(), fWorkAdded(), fFiles(), fNextHandle(0), fStopping(false)
+    {
+    }
+
+    FileWriter::~FileWriter()
+    {
+        stop();
+    }
+
+    void FileWriter::run()
+    {
+        forever {
+            fMutex.lock();
+            bool all = fStopping;
+            while ( !fStopping && !hasWork(false) ) {
+                if ( !hasWork(true) ) {
+                    fWorkAdded.wait(&fMutex);
+                } else if ( !fWorkAdded.wait(&fMutex, WRITE_IDLE_FLUSH) ) {
+                    all = true; // slow sender, don't keep its tail in memory
+                    break;
+                }
+            }
+
+            if ( fStopping ) {
+                all = true;
+                if ( !hasWork(true) ) {
+                    fMutex.unlock();
+                    break;
+                }
+            }
+
+            const QList<int> handles = fFiles.keys();
+            fMutex.unlock();
+
+            foreach ( int handle, handles ) {
+                process(handle, all);
+            }
+        }
+
+        // files of transfers still active at shutdown, kept partial like before
+        QMutexLocker locker(&fMutex);
+        for ( QMap<int, WriterFile>::iterator it = fFiles.begin(); it != fFiles.end(); it++ ) {
+            finish(it.value());
+        }
+        fFiles.clear();
+    }
+
+    void FileWriter::stop()
+    {
+        fMutex.lock();
+        fStopping = true;
+        fWorkAdded.wakeAll();
+        fMutex.unlock();
+
+        wait(); // remaining data is written first
+    }
+
+    void FileWriter::open(int eventID, const QString& path, quint64 size, quint64 position)
+    {
+        QMutexLocker locker(&fMutex);
+        if ( find(eventID) != fFiles.end() ) {
+            Utils::warn("File already open for writing");
+            return;
+        }
+
+        WriterFile& writerFile = fFiles[fNextHandle++];
+        writerFile.eventID = eventID;
+        writerFile.path = path;
+        writerFile.size = size;
+        writerFile.offset = position;
+        writerFile.synced = position;
+        writerFile.file = NULL;
+        writerFile.hash = NULL;
+        writerFile.throttled = false;
+        writerFile.closing = false;
+        writerFile.discarded = false;
+    }
+
+    bool FileWriter::write(int eventID, const QByteArray& data)
+    {
+        QMutexLocker locker(&fMutex);
+        QMap<int, WriterFile>::iterator it = find(eventID);
+        if ( it == fFiles.end() ) {
+            Utils::warn("Write to a file that is not open");
+            return true;
+        }
+
+        it->buffer.append(data);
+        if ( it->buffer.size() >= WRITE_BLOCK_SIZE ) {
+            fWorkAdded.wakeOne();
+        }
+
+        if ( it->buffer.size() >= WRITE_HIGH_WATER ) {
+            it->throttled = true;
+        }
+
+        return !it->throttled;
+    }
+
+    void FileWriter::close(int eventID)
+    {
+        QMutexLocker locker(&fMutex);
+        QMap<int, WriterFile>::iterator it = find(eventID);
+        if ( it != fFiles.end() ) {
+            it->closing = true;
+            fWorkAdded.wakeOne();
+        }
+    }
+
+    void FileWriter::discard(int eventID)
+    {
+        QMutexLocker locker(&fMutex);
+        QMap<int, WriterFile>::iterator it = find(eventID);
+        if ( it != fFiles.end() ) {
+            it->discarded = true;
+            it->buffer.clear();
+            fWorkAdded.wakeOne();
+        }
+    }
+
+    quint64 FileWriter::written(int eventID, quint64 fallback)
+    {
+        QMutexLocker locker(&fMutex);
+        QMap<int, WriterFile>::iterator it = find(eventID);
+        return it == fFiles.end() ? fallback : it->offset;
+    }
+
+    quint64 FileWriter::synced(int eventID, quint64 fallback)
+    {
+        QMutexLocker locker(&fMutex);
+        QMap<int, WriterFile>::iterator it = find(eventID);
+        return it == fFiles.end() ? fallback : it->synced;
+    }
+
+    QMap<int, WriterFile>::iterator FileWriter::find(int eventID)
+    {
+        for ( QMap<int, WriterFile>::iterator it = fFiles.begin(); it != fFiles.end(); it++ ) {
+            if ( it->eventID == eventID && !it->closing && !it->discarded ) {
+                return it;
+            }
+        }
+
+        return fFiles.end();
+    }
+
+    bool FileWriter::hasWork(bool all) const
+    {
+        const int minimum = all ? 1 : WRITE_BLOCK_SIZE;
+        foreach ( const WriterFile& writerFile, fFiles ) {
+            if ( writerFile.closing || writerFile.discarded || writerFile.buffer.size() >= minimum ) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void FileWriter::process(int handle, bool all)
+    {
+        fMutex.lock();
+        QMap<int, WriterFile>::iterator it = fFiles.find(handle);
+        if ( it == fFiles.end() ) {
+            fMutex.unlock();
+            return;
+        }
+
+        // entries are only removed on this thread so the reference outlives the unlock,
+        // the GUI side never touches file and only reads offset under the mutex
+        WriterFile& writerFile = it.value();
+        const int eventID = writerFile.eventID;
+        if ( writerFile.discarded ) {
+            finish(writerFile);
+            fFiles.remove(handle);
+            fMutex.unlock();
+            return;
+        }
+
+        const bool closing = writerFile.closing;
+        int length = writerFile.buffer.size();
+        if ( !closing && !all ) {
+            length -= length % WRITE_BLOCK_SIZE;
+        }
+        const QByteArray data = writerFile.buffer.left(length);
+        writerFile.buffer.remove(0, length);
+        fMutex.unlock();
+
+        QString error = flush(writerFile, data);
+        if ( closing || !error.isEmpty() ) {
+            QByteArray hash;
+            if ( error.isEmpty() ) {
+                hash = writerFile.hash->result();
+                error = finish(writerFile);
+            } else {
+                finish(writerFile);
+            }
+
+            const quint64 size = writerFile.offset;
+            fMutex.lock();
+            fFiles.remove(handle);
+            fMutex.unlock();
+            emit closed(eventID, size, error.isEmpty() ? hash : QByteArray(), error);
+            return;
+        }
+
+        bool drained = false;
+        fMutex.lock();
+        if ( writerFile.throttled && writerFile.buffer.size() < WRITE_LOW_WATER ) {
+            writerFile.throttled = false;
+            drained = true;
+        }
+        fMutex.unlock();
+
+        if ( drained ) {
+            emit drained(eventID);
+        }
+    }
+
+    const QString FileWriter::flush(WriterFile& writerFile, const QByteArray& data)
+    {
+        if ( writerFile.file == NULL ) {
+            QFile* file = new QFile(writerFile.path);
+            if ( !file->open(QIODevice::ReadWrite | QIODevice::Unbuffered) ) {
+                const QString error = "Error opening file: " + file->errorString();
+                delete file;
+                return Utils::warn(error);
+            }
+
+            if ( !file->resize(writerFile.offset) || !file->seek(writerFile.offset) ) {
+                const QString error = "Error positioning file: " + file->errorString();
+                delete file;
+                return Utils::warn(error);
+            }
+
+            // a resumed file has its start on disk already, that part is read back once here
+            QCryptographicHash* hash = new QCryptographicHash(QCryptographicHash::Sha256);
+            if ( writerFile.offset > 0 ) {
+                if ( !file->seek(0) || !hash->addData(file) || !file->seek(writerFile.offset) ) {
+                    const QString error = "Error reading file: " + file->errorString();
+                    delete hash;
+                    delete file;
+                    return Utils::warn(error);
+                }
+            }
+
+            // reserve the rest up front, keeps the file contiguous and a full disk fails here instead of mid way
+            if ( writerFile.size > writerFile.offset ) {
+                int result = posix_fallocate(file->handle(), writerFile.offset, writerFile.size - writerFile.offset);
+                if ( result == ENOSPC ) {
+                    delete hash;
+                    delete file;
+                    return Utils::warn("Not enough free space for file");
+                } else if ( result != 0 ) {
+                    Utils::warn("Unable to preallocate file"); // filesystem without support, carry on
+                }
+            }
+
+            writerFile.file = file;
+            writerFile.hash = hash;
+        }
+
+        if ( !data.isEmpty() ) {
+            if ( writerFile.file->write(data) != data.size() ) {
+                return Utils::warn("Error writing file: " + writerFile.file->errorString());
+            }
+            writerFile.hash->addData(data);
+            QMutexLocker locker(&fMutex); // written() reads it from the GUI thread
+            writerFile.offset += data.size();
+        }
+
+        // the file is preallocated so its size says nothing, resume points come from here
+        if ( writerFile.offset - writerFile.synced >= WRITE_SYNC_SIZE ) {
+            if ( fdatasync(writerFile.file->handle()) != 0 ) {
+                return Utils::warn("Error syncing file");
+            }
+            QMutexLocker locker(&fMutex);
+            writerFile.synced = writerFile.offset;
+        }
+
+        return QString();
+    }
+
+    const QString FileWriter::finish(WriterFile& writerFile)
+    {
+        if ( writerFile.file == NULL ) {
+            return QString();
+        }
+
+        QString error;
+        if ( !writerFile.file->resize(writerFile.offset) ) { // drop the preallocated tail of short files
+            error = Utils::warn("Error truncating file: " + writerFile.file->errorString());
+        }
+
+        writerFile.file->close();
+        delete writerFile.file;
+        writerFile.file = NULL;
+        delete writerFile.hash;
+        writerFile.hash = NULL;
+
+        return error;
+    }
+
+}
@@ -0,0 +1,67 @@
+#ifndef FILEWRITER_H
+#define FILEWRITER_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QFile>
+#include <QMap>
+#include <QCryptographicHash>
+
+namespace JTOX {
+
+    // write side of one incoming file, buffer is shared with the GUI thread, file is writer thread only
+    struct WriterFile
+    {
+        int eventID;
+        QString path;
+        quint64 size; // preallocated up front
+        quint64 offset; // next disk write position, changed under the mutex
+        quint64 synced; // bytes known to survive a power cut, changed under the mutex
+        QByteArray buffer; // chunks not yet on disk
+        QFile* file;
+        QCryptographicHash* hash; // over everything on disk so far, writer thread only
+        bool throttled; // buffer went over the high water mark, drained() is due
+        bool closing;
+        bool discarded;
+    };
+
+    // owns incoming transfer files, coalesces chunks into block sized writes on its own thread
+    class FileWriter : public QThread
+    {
+        Q_OBJECT
+    public:
+        FileWriter();
+        virtual ~FileWriter();
+        void run();
+        void stop(); // flushes and closes everything, blocks
+        void open(int eventID, const QString& path, quint64 size, quint64 position);
+        bool write(int eventID, const QByteArray& data); // false when the disk lags behind, pause until drained()
+        void close(int eventID); // closed() follows once all data is on disk
+        void discard(int eventID); // drops unwritten data, no signal
+        quint64 written(int eventID, quint64 fallback); // bytes on disk, fallback if not open
+        quint64 synced(int eventID, quint64 fallback); // bytes on disk and synced, fallback if not open
+    signals:
+        void drained(int eventID) const;
+        void closed(int eventID, quint64 size, const QByteArray& hash, const QString& error) const; // sha256 of the whole file
+    private:
+        QMutex fMutex;
+        QWaitCondition fWorkAdded;
+        QMap<int, WriterFile> fFiles; // by handle, a discarded file may still be closing when its event reopens
+        int fNextHandle;
+        bool fStopping;
+
+        QMap<int, WriterFile>::iterator find(int eventID); // the open one, not closing or discarded
+
+        bool hasWork(bool all) const;
+        void process(int handle, bool all);
+        const QString flush(WriterFile& writerFile, const QByteArray& data);
+        const QString finish(WriterFile& writerFile);
+    };
+
+}
+
+#endif // FILEWRITER_H
@@ -3,53 +3,44 @@
 
 namespace JTOX {
 
-    Friend::Friend(ToxCore& toxCore, uint32_t friend_id) : fToxCore(toxCore), fFriendID(friend_id),
+    Friend::Friend(const Tox* tox, uint32_t friend_id) : fFriendID(friend_id),
         fName(), fConnectionStatus(TOX_CONNECTION_NONE), fUserStatus(TOX_USER_STATUS_NONE),
-        fStatusMessage(), fTyping(false), fPublicKey(), fUnviewed(false), fAvatarHash()
+        fStatusMessage(), fTyping(false), fPublicKey(), fUnviewedCount(0), fAvatarHash()
     {
-        refresh();
-    }
-
-    void Friend::refresh() {
-        if ( !fToxCore.getInitialized() ) {
-            qDebug() << "Friend refresh called when toxcore not initialized!";
-            return;
-        }
-
         TOX_ERR_FRIEND_QUERY error;
-        size_t friend_name_size = tox_friend_get_name_size(fToxCore.tox(), fFriendID, &error);
+        size_t friend_name_size = tox_friend_get_name_size(tox, fFriendID, &error);
         if ( error != TOX_ERR_FRIEND_QUERY_OK ) {
             Utils::fatal("Error retrieving friend name size");
         }
 
         uint8_t name[friend_name_size];
-        if ( !tox_friend_get_name(fToxCore.tox(), fFriendID, name, &error) || error != TOX_ERR_FRIEND_QUERY_OK ) {
+        if ( !tox_friend_get_name(tox, fFriendID, name, &error) || error != TOX_ERR_FRIEND_QUERY_OK ) {
             Utils::fatal("Error retrieving friend name");
         }
         fName = QString::fromUtf8((char*) name, friend_name_size);
 
-        fTyping = tox_friend_get_typing(fToxCore.tox(), fFriendID, &error);
+        fTyping = tox_friend_get_typing(tox, fFriendID, &error);
         if ( error != TOX_ERR_FRIEND_QUERY_OK ) {
             Utils::fatal("Error retrieving friend typing status");
         }
 
-        fConnectionStatus = tox_friend_get_connection_status(fToxCore.tox(), fFriendID, &error);
+        fConnectionStatus = tox_friend_get_connection_status(tox, fFriendID, &error);
         if ( error != TOX_ERR_FRIEND_QUERY_OK ) {
             Utils::fatal("Error retrieving friend connection status");
         }
 
-        fUserStatus = tox_friend_get_status(fToxCore.tox(), fFriendID, &error);
+        fUserStatus = tox_friend_get_status(tox, fFriendID, &error);
         if ( error != TOX_ERR_FRIEND_QUERY_OK ) {
             Utils::fatal("Error retrieving friend user status");
         }
 
-        size_t friend_status_size = tox_friend_get_status_message_size(fToxCore.tox(), fFriendID, &error);
+        size_t friend_status_size = tox_friend_get_status_message_size(tox, fFriendID, &error);
         if ( error != TOX_ERR_FRIEND_QUERY_OK ) {
             Utils::fatal("Error retrieving friend status message size");
         }
 
         uint8_t status[friend_status_size];
-        tox_friend_get_status_message(fToxCore.tox(), fFriendID, status, &error);
+        tox_friend_get_status_message(tox, fFriendID, status, &error);
         if ( error != TOX_ERR_FRIEND_QUERY_OK ) {
             Utils::fatal("Error retrieving friend status message");
         }
@@ -57,13 +48,19 @@ namespace JTOX {
 
         TOX_ERR_FRIEND_GET_PUBLIC_KEY pubError;
         uint8_t pubRaw[TOX_PUBLIC_KEY_SIZE];
-        tox_friend_get_public_key(fToxCore.tox(), fFriendID, pubRaw, &pubError);
+        tox_friend_get_public_key(tox, fFriendID, pubRaw, &pubError);
         if ( pubError != TOX_ERR_FRIEND_GET_PUBLIC_KEY_OK ) {
             Utils::fatal("Error retrieving friend public key");
         }
         fPublicKey = Utils::key_to_hex(pubRaw, TOX_PUBLIC_KEY_SIZE);
     }
 
+    Friend::Friend(uint32_t friend_id, const QString& publicKey) : fFriendID(friend_id),
+        fName(), fConnectionStatus(TOX_CONNECTION_NONE), fUserStatus(TOX_USER_STATUS_NONE),
+        fStatusMessage(), fTyping(false), fPublicKey(publicKey), fUnviewedCount(0), fAvatarHash()
+    {
+    }
+
     QVariant Friend::value(int role) const {
         switch ( role ) {
             case frName: return name();
@@ -72,7 +69,7 @@ namespace JTOX {
             case frTyping: return fTyping;
             case frFriendID: return fFriendID;
             case frPublicKey: return fPublicKey;
-            case frUnviewed: return fUnviewed;
+            case frUnviewed: return unviewed();
         }
 
         Utils::fatal("Invalid role requested for friend value");
@@ -155,17 +152,17 @@ namespace JTOX {
 
     bool Friend::unviewed() const
     {
-        return fUnviewed;
+        return fUnviewedCount > 0;
     }
 
-    void Friend::setViewed()
+    int Friend::unviewedCount() const
     {
-        fUnviewed = false;
+        return fUnviewedCount;
     }
 
-    void Friend::setUnviewed()
+    void Friend::setUnviewedCount(int count)
     {
-        fUnviewed = true;
+        fUnviewedCount = count;
     }
 
 }
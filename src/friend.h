@@ -3,8 +3,9 @@
 
 #include <QList>
 #include <QVariant>
+#include <QString>
+#include <QByteArray>
 #include <tox/tox.h>
-#include "toxcore.h"
 
 namespace JTOX {
 
@@ -22,8 +23,8 @@ namespace JTOX {
     class Friend
     {
     public:
-        Friend(ToxCore& toxCore, uint32_t friend_id);
-        void refresh();
+        Friend(const Tox* tox, uint32_t friend_id); // only while no thread iterates the instance
+        Friend(uint32_t friend_id, const QString& publicKey); // just added, the rest comes with callbacks
         QVariant value(int role) const;
         quint32 friendID() const;
         const QString name() const;
@@ -40,11 +41,10 @@ namespace JTOX {
         const QByteArray& avatarHash() const;
         void setAvatarHash(const QByteArray& hash);
 
-        void setViewed();
-        void setUnviewed();
         bool unviewed() const;
+        int unviewedCount() const;
+        void setUnviewedCount(int count);
     private:
-        ToxCore& fToxCore;
         quint32 fFriendID;
         QString fName;
         TOX_CONNECTION fConnectionStatus;
@@ -52,7 +52,7 @@ namespace JTOX {
         QString fStatusMessage;
         bool fTyping;
         QString fPublicKey;
-        bool fUnviewed;
+        int fUnviewedCount;
         QString fOfflineName;
         QByteArray fAvatarHash; // hash of our profile avatar sent out to this friend
     };
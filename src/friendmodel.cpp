@@ -30,6 +30,7 @@ namespace JTOX {
         connect(&toxcore, &ToxCore::friendStatusMsgChanged, this, &FriendModel::onFriendStatusMsgChanged);
         connect(&toxcore, &ToxCore::friendNameChanged, this, &FriendModel::onFriendNameChanged);
         connect(&toxcore, &ToxCore::friendTypingChanged, this, &FriendModel::onFriendTypingChanged);
+        connect(&toxcore, &ToxCore::friendAdded, this, &FriendModel::onFriendAdded);
     }
 
     int FriendModel::rowCount(const QModelIndex &parent) const {
@@ -73,22 +74,13 @@ namespace JTOX {
             Utils::fatal("Friend add called when toxcore not initialized!");
         }
 
-        TOX_ERR_FRIEND_ADD error;
-        const QByteArray rawMsg = message.toUtf8();
         const QByteArray rawAddress = QByteArray::fromHex(address.toUtf8());
-
-        quint32 friendID = tox_friend_add(fToxCore.tox(), (uint8_t*) rawAddress.data(), (uint8_t*) rawMsg.data(), rawMsg.size(), &error);
-        QString errorStr;
-        if ( handleFriendRequestError(error, errorStr) ) {
-            beginInsertRows(QModelIndex(), fList.size(), fList.size());
-            fList.append(Friend(fToxCore, friendID));
-            endInsertRows();
-
-            fToxCore.save();
-            emit friendAdded();
-        } else {
-            emit friendAddError(errorStr);
+        if ( rawAddress.size() != TOX_ADDRESS_SIZE ) { // tox reads a whole address from it
+            emit friendAddError("Invalid friend address");
+            return;
         }
+
+        fToxCore.addFriend(rawAddress, message.toUtf8()); // onFriendAdded takes it from here
     }
 
     void FriendModel::addFriendNoRequest(const QString& publicKey, const QString& name) {
@@ -96,21 +88,7 @@ namespace JTOX {
             Utils::fatal("Friend add (nor) called when toxcore not initialized!");
         }
 
-        TOX_ERR_FRIEND_ADD error;
-        const QByteArray rawKey = QByteArray::fromHex(publicKey.toUtf8());
-
-        quint32 friendID = tox_friend_add_norequest(fToxCore.tox(), (uint8_t*) rawKey.data(), &error);
-        QString errorStr;
-        if ( handleFriendRequestError(error, errorStr) ) {
-            beginInsertRows(QModelIndex(), fList.size(), fList.size());
-            fList.append(Friend(fToxCore, friendID));
-            fList.last().setOfflineName(name);
-            fDBData.setFriendOfflineName(fList.last().address(), fList.last().friendID(), name);
-            endInsertRows();
-            fToxCore.save();
-        } else {
-            emit friendAddError(errorStr);
-        }
+        fToxCore.addFriendNoRequest(QByteArray::fromHex(publicKey.toUtf8()), name);
     }
 
     void FriendModel::removeFriend(quint32 friendID)
@@ -124,17 +102,18 @@ namespace JTOX {
             Utils::fatal("FriendID not found in model list");
         }
 
-        TOX_ERR_FRIEND_DELETE error;
-        tox_friend_delete(fToxCore.tox(), friendID, &error);
-
-        if ( !handleFriendDeleteError(error) ) {
-            return;
-        }
+        fToxCore.deleteFriend(friendID); // saved right behind it
 
+        int unviewedCount = fList.at(index).unviewedCount();
         beginRemoveRows(QModelIndex(), index, index);
         fList.removeAt(index);
-        fDBData.wipe(friendID);
+        fDBData.wipeAsync(friendID);
         endRemoveRows();
+
+        if ( unviewedCount > 0 ) {
+            fUnviewedMessages -= unviewedCount;
+            emit unviewedMessagesChanged(fUnviewedMessages);
+        }
     }
 
     void FriendModel::setActiveFriendID(quint32 friendID)
@@ -149,29 +128,58 @@ namespace JTOX {
         }
         beginResetModel();
 
-        size_t i;
-        fList.clear();
-        size_t size = tox_self_get_friend_list_size(fToxCore.tox());
-        uint32_t raw_list[size];
-        tox_self_get_friend_list(fToxCore.tox(), raw_list);
-
-        for ( i = 0; i < size; i++ ) {
-            fList.append(Friend(fToxCore, raw_list[i]));
-            if ( fDBData.getUnviewedEventCount(raw_list[i]) > 0 ) {
-                fList[i].setUnviewed();
-            }
-
+        fList = fToxCore.friends();
+        for ( int i = 0; i < fList.size(); i++ ) {
             fList[i].setOfflineName(fDBData.getFriendOfflineName(fList.at(i).address()));
         }
 
-        fUnviewedMessages = fDBData.getUnviewedEventCount(-1);
+        fUnviewedMessages = 0;
         endResetModel();
 
+        fDBData.getUnviewedEventCountsAsync([this](const QMap<quint32, int>& counts) {
+            onUnviewedCountsLoaded(counts);
+        });
+    }
+
+    void FriendModel::onUnviewedCountsLoaded(const QMap<quint32, int>& counts)
+    {
+        fUnviewedMessages = 0;
+        for ( int i = 0; i < fList.size(); i++ ) {
+            int count = counts.value(fList.at(i).friendID(), 0);
+            fUnviewedMessages += count;
+
+            if ( count > 0 ) {
+                fList[i].setUnviewedCount(count);
+                emit dataChanged(createIndex(i, 0), createIndex(i, 0), QVector<int>());
+            }
+        }
+
         if ( fUnviewedMessages > 0 ) {
             emit unviewedMessagesChanged(fUnviewedMessages);
         }
     }
 
+    void FriendModel::onFriendAdded(quint32 friend_id, const QByteArray& publicKey, const QString& offlineName, bool request, int error)
+    {
+        QString errorStr;
+        if ( !handleFriendRequestError((TOX_ERR_FRIEND_ADD) error, errorStr) ) {
+            emit friendAddError(errorStr);
+            return;
+        }
+
+        beginInsertRows(QModelIndex(), fList.size(), fList.size());
+        fList.append(Friend(friend_id, Utils::key_to_hex((const uint8_t*) publicKey.constData(), TOX_PUBLIC_KEY_SIZE)));
+        if ( !request ) {
+            fList.last().setOfflineName(offlineName);
+            fDBData.setFriendOfflineName(fList.last().address(), fList.last().friendID(), offlineName);
+        }
+        endInsertRows();
+
+        if ( request ) {
+            emit friendAdded();
+        }
+    }
+
     void FriendModel::onFriendStatusChanged(quint32 friend_id, int status)
     {
         int index = getListIndexForFriendID(friend_id);
@@ -254,23 +262,13 @@ namespace JTOX {
     void FriendModel::unviewedMessageReceived(quint32 friend_id)
     {
         int index = getListIndexForFriendID(friend_id);
-        if ( !fList.at(index).unviewed() ) {
-            fList[index].setUnviewed();
-            emit dataChanged(createIndex(index, 0), createIndex(index, 0), QVector<int>());
-        }
-
-        checkUnviewedTotals();
+        updateUnviewedCount(index, fDBData.getUnviewedEventCount(friend_id));
     }
 
     void FriendModel::messagesViewed(quint32 friend_id)
     {
         int index = getListIndexForFriendID(friend_id);
-        if ( fList.at(index).unviewed() ) {
-            fList[index].setViewed();
-            emit dataChanged(createIndex(index, 0), createIndex(index, 0), QVector<int>());
-        }
-
-        checkUnviewedTotals();
+        updateUnviewedCount(index, fDBData.getUnviewedEventCount(friend_id));
     }
 
     const QString FriendModel::getAddress() const
@@ -336,20 +334,21 @@ namespace JTOX {
         return false;
     }
 
-    bool FriendModel::handleFriendDeleteError(TOX_ERR_FRIEND_DELETE error) const
+    void FriendModel::updateUnviewedCount(int index, int count)
     {
-        switch ( error ) {
-            case TOX_ERR_FRIEND_DELETE_FRIEND_NOT_FOUND: Utils::fatal("Friend not found");
-            case TOX_ERR_FRIEND_DELETE_OK: return true;
+        // friend counts come from friend_stats, the total is only kept in memory
+        int oldCount = fList.at(index).unviewedCount();
+        if ( count == oldCount ) {
+            return;
         }
 
-        qDebug() << "Not supposed to be here\n";
-        return false;
-    }
+        bool wasUnviewed = fList.at(index).unviewed();
+        fList[index].setUnviewedCount(count);
+        if ( wasUnviewed != fList.at(index).unviewed() ) {
+            emit dataChanged(createIndex(index, 0), createIndex(index, 0), QVector<int>());
+        }
 
-    void FriendModel::checkUnviewedTotals()
-    {
-        fUnviewedMessages = fDBData.getUnviewedEventCount(-1);
+        fUnviewedMessages += count - oldCount;
         emit unviewedMessagesChanged(fUnviewedMessages);
     }
 
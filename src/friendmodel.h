@@ -73,6 +73,7 @@ namespace JTOX {
         void onFriendStatusMsgChanged(quint32 friend_id, const QString& statusMessage);
         void onFriendNameChanged(quint32 friend_id, const QString& name);
         void onFriendTypingChanged(quint32 friend_id, bool typing);
+        void onFriendAdded(quint32 friend_id, const QByteArray& publicKey, const QString& offlineName, bool request, int error);
     private:
         ToxCore& fToxCore;
         DBData& fDBData;
@@ -83,8 +84,8 @@ namespace JTOX {
         int fActiveFriendIndex;
 
         bool handleFriendRequestError(TOX_ERR_FRIEND_ADD error, QString& errorOut) const;
-        bool handleFriendDeleteError(TOX_ERR_FRIEND_DELETE error) const;
-        void checkUnviewedTotals();
+        void updateUnviewedCount(int index, int count);
+        void onUnviewedCountsLoaded(const QMap<quint32, int>& counts);
         int getUnviewedMessages() const;
         void onFriendWentOnline(int index);
     };
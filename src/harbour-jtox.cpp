@@ -31,6 +31,7 @@
 #include "eventmodel.h"
 #include "toxme.h"
 #include "requestmodel.h"
+#include "searchmodel.h"
 #include "avatarprovider.h"
 #include "dbdata.h"
 #include "dirmodel.h"
@@ -60,6 +61,7 @@ int main(int argc, char *argv[])
     FriendModel friendModel(toxCore, dbData, avatarProvider);
     EventModel eventModel(toxCore, friendModel, dbData);
     RequestModel requestModel(toxCore, toxme, friendModel, dbData);
+    SearchModel searchModel(toxCore, dbData);
 
     QObject::connect(avatarProvider, &AvatarProvider::profileAvatarChanged, &friendModel, &FriendModel::onProfileAvatarChanged); // update friends when we set a new avatar
 
@@ -69,6 +71,7 @@ int main(int argc, char *argv[])
     view->rootContext()->setContextProperty("eventmodel", &eventModel);
     view->rootContext()->setContextProperty("toxme", &toxme);
     view->rootContext()->setContextProperty("requestmodel", &requestModel);
+    view->rootContext()->setContextProperty("searchmodel", &searchModel);
     view->rootContext()->setContextProperty("dirmodel", &dirModel);
     view->rootContext()->setContextProperty("avatarProvider", avatarProvider);
     view->engine()->addImageProvider("avatarProvider", avatarProvider); // freed internally by Qt5!
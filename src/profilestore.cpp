@@ -0,0 +1,200 @@
+#include "profilestore.h"
+#include "utils.h"
+#include <QMutexLocker>
+#include <QStandardPaths>
+#include <QSettings>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QtEndian>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace JTOX {
+
+    const char PROFILE_MAGIC[4] = { 'J', 'T', 'X', 'P' };
+    const quint32 PROFILE_VERSION = 1;
+    const int PROFILE_HEADER_SIZE = 12; // magic, version, entry count
+    const char* const PROFILE_LEGACY_KEYS[] = { "tox/savedata", "tox/nodes" }; // QSettings keys before the store
+    const int PROFILE_LEGACY_KEY_COUNT = 2;
+
+    ProfileStore::ProfileStore() : fMutex(), fWriteMutex(), fPath(), fValues()
+    {
+        const QDir dir(QStandardPaths::writableLocation(QStandardPaths::DataLocation));
+        if ( !dir.exists() ) {
+            dir.mkpath(dir.absolutePath());
+        }
+        fPath = dir.absoluteFilePath("profile.bin");
+
+        if ( !QFile::exists(fPath) ) {
+            migrate();
+        } else if ( !load() ) {
+            Utils::fatal("Profile store corrupted"); // never start over a profile we couldn't read
+        }
+    }
+
+    bool ProfileStore::contains(const QString& key) const
+    {
+        QMutexLocker locker(&fMutex);
+        return fValues.contains(key);
+    }
+
+    const QByteArray ProfileStore::value(const QString& key) const
+    {
+        QMutexLocker locker(&fMutex);
+        return fValues.value(key);
+    }
+
+    bool ProfileStore::setValue(const QString& key, const QByteArray& value)
+    {
+        QMutexLocker writeLocker(&fWriteMutex); // concurrent saves land in order
+        QMap<QString, QByteArray> values = snapshot();
+        values[key] = value;
+        return commit(values);
+    }
+
+    bool ProfileStore::remove(const QString& key)
+    {
+        QMutexLocker writeLocker(&fWriteMutex);
+        QMap<QString, QByteArray> values = snapshot();
+        if ( values.remove(key) == 0 ) {
+            return true;
+        }
+
+        return commit(values);
+    }
+
+    const QMap<QString, QByteArray> ProfileStore::snapshot() const
+    {
+        QMutexLocker locker(&fMutex);
+        return fValues;
+    }
+
+    bool ProfileStore::commit(const QMap<QString, QByteArray>& values)
+    {
+        // readers only wait for the swap, never for the disk, and never see what failed to write
+        if ( !write(values) ) {
+            return false;
+        }
+
+        QMutexLocker locker(&fMutex);
+        fValues = values;
+        return true;
+    }
+
+    bool ProfileStore::load()
+    {
+        QFile file(fPath);
+        if ( !file.open(QIODevice::ReadOnly) ) {
+            Utils::warn("Error opening profile store: " + file.errorString());
+            return false;
+        }
+
+        const qint64 size = file.size();
+        const uchar* data = size > 0 ? file.map(0, size) : NULL;
+        if ( data == NULL || size < PROFILE_HEADER_SIZE || memcmp(data, PROFILE_MAGIC, 4) != 0 ) {
+            return false;
+        }
+
+        if ( qFromLittleEndian<quint32>(data + 4) != PROFILE_VERSION ) {
+            Utils::warn("Unknown profile store version");
+            return false;
+        }
+
+        // entries are key length, key, value length, value, lengths are checked against what's left
+        const quint32 count = qFromLittleEndian<quint32>(data + 8);
+        qint64 offset = PROFILE_HEADER_SIZE;
+        for ( quint32 i = 0; i < count; i++ ) {
+            QByteArray parts[2];
+            for ( int p = 0; p < 2; p++ ) {
+                if ( size - offset < 4 ) {
+                    return false;
+                }
+                const quint32 length = qFromLittleEndian<quint32>(data + offset);
+                offset += 4;
+                if ( (quint64) (size - offset) < length ) {
+                    return false;
+                }
+                parts[p] = QByteArray((const char*) data + offset, length); // copied, the map goes with the file
+                offset += length;
+            }
+
+            fValues[QString::fromUtf8(parts[0])] = parts[1];
+        }
+
+        return true;
+    }
+
+    void ProfileStore::migrate()
+    {
+        QSettings settings;
+        for ( int i = 0; i < PROFILE_LEGACY_KEY_COUNT; i++ ) {
+            const QString key = PROFILE_LEGACY_KEYS[i];
+            if ( settings.contains(key) ) {
+                fValues[key] = settings.value(key).toByteArray();
+            }
+        }
+
+        if ( fValues.isEmpty() || !write(fValues) ) {
+            return; // new install, or the old keys stay until a write works
+        }
+
+        for ( int i = 0; i < PROFILE_LEGACY_KEY_COUNT; i++ ) {
+            settings.remove(PROFILE_LEGACY_KEYS[i]);
+        }
+        settings.sync();
+    }
+
+    bool ProfileStore::write(const QMap<QString, QByteArray>& values) const
+    {
+        QByteArray data(PROFILE_HEADER_SIZE, 0);
+        memcpy(data.data(), PROFILE_MAGIC, 4);
+        qToLittleEndian<quint32>(PROFILE_VERSION, (uchar*) data.data() + 4);
+        qToLittleEndian<quint32>(values.size(), (uchar*) data.data() + 8);
+
+        uchar length[4];
+        for ( QMap<QString, QByteArray>::const_iterator it = values.constBegin(); it != values.constEnd(); it++ ) {
+            const QByteArray key = it.key().toUtf8();
+            qToLittleEndian<quint32>(key.size(), length);
+            data.append((const char*) length, 4);
+            data.append(key);
+            qToLittleEndian<quint32>(it.value().size(), length);
+            data.append((const char*) length, 4);
+            data.append(it.value());
+        }
+
+        // readers see either the old or the new file, never a partial one
+        const QString tempPath = fPath + ".tmp";
+        QFile file(tempPath);
+        if ( !file.open(QIODevice::WriteOnly | QIODevice::Truncate) ) {
+            Utils::warn("Error opening profile store: " + file.errorString());
+            return false;
+        }
+
+        if ( file.write(data) != data.size() || !file.flush() || fsync(file.handle()) != 0 ) {
+            Utils::warn("Error writing profile store: " + file.errorString());
+            file.close();
+            file.remove();
+            return false;
+        }
+        file.close();
+
+        if ( ::rename(QFile::encodeName(tempPath).constData(), QFile::encodeName(fPath).constData()) != 0 ) {
+            Utils::warn("Error replacing profile store");
+            QFile::remove(tempPath);
+            return false;
+        }
+
+        // the rename itself is only durable once the directory is synced
+        const int dirHandle = ::open(QFile::encodeName(QFileInfo(fPath).absolutePath()).constData(), O_RDONLY);
+        if ( dirHandle >= 0 ) {
+            fsync(dirHandle);
+            ::close(dirHandle);
+        }
+
+        return true;
+    }
+
+}
@@ -0,0 +1,37 @@
+#ifndef PROFILESTORE_H
+#define PROFILESTORE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+#include <QMap>
+
+namespace JTOX {
+
+    // profile blobs (savedata, bootstrap nodes) in one binary file, read with a single mmap
+    // at startup and replaced atomically on every change, takes over the old QSettings keys
+    class ProfileStore
+    {
+    public:
+        ProfileStore();
+        bool contains(const QString& key) const;
+        const QByteArray value(const QString& key) const;
+        bool setValue(const QString& key, const QByteArray& value); // on disk when it returns, false and unchanged on error
+        bool remove(const QString& key);
+    private:
+        Q_DISABLE_COPY(ProfileStore)
+        mutable QMutex fMutex; // guards fValues only, ProfileSaver, PasswordValidator and ToxInitializer use it from their threads
+        QMutex fWriteMutex; // serializes writers, held over the disk write
+        QString fPath;
+        QMap<QString, QByteArray> fValues; // what is on disk
+
+        bool load();
+        void migrate();
+        const QMap<QString, QByteArray> snapshot() const;
+        bool commit(const QMap<QString, QByteArray>& values); // writes, then swaps in on success
+        bool write(const QMap<QString, QByteArray>& values) const; // temp file, fsync, rename over
+    };
+
+}
+
+#endif // PROFILESTORE_H
@@ -0,0 +1,70 @@
+#include "ratelimiter.h"
+#include <algorithm>
+#include <chrono>
+
+namespace JTOX {
+
+    const int64_t NSECS_PER_SEC = 1000000000;
+
+    RateLimiter::RateLimiter(const NanoClock& clock) : fClock(clock), fRate(0), fTokens(0), fRefilledAt(0)
+    {
+        if ( !fClock ) {
+            fClock = []() -> int64_t {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            };
+        }
+        fRefilledAt = fClock();
+    }
+
+    int RateLimiter::rate() const
+    {
+        return fRate;
+    }
+
+    void RateLimiter::setRate(int rate)
+    {
+        fRate = std::max(0, rate);
+        fTokens = fRate; // start with a full bucket
+        fRefilledAt = fClock();
+    }
+
+    bool RateLimiter::take(uint64_t bytes)
+    {
+        if ( fRate == 0 ) {
+            return true;
+        }
+
+        refill();
+        fTokens -= bytes;
+        return fTokens >= 0;
+    }
+
+    int RateLimiter::wait()
+    {
+        if ( fRate == 0 ) {
+            return 0;
+        }
+
+        refill();
+        return fTokens >= 0 ? 0 : (-fTokens * 1000) / fRate + 1;
+    }
+
+    void RateLimiter::refill()
+    {
+        const int64_t now = fClock();
+        const int64_t elapsed = std::min(now - fRefilledAt, NSECS_PER_SEC); // bucket holds a second at most anyway
+        const int64_t added = elapsed * fRate / NSECS_PER_SEC;
+        if ( added <= 0 ) {
+            return;
+        }
+
+        if ( fTokens + added >= fRate ) {
+            fTokens = fRate;
+            fRefilledAt = now;
+        } else { // sub byte leftovers stay on the clock
+            fTokens += added;
+            fRefilledAt += added * NSECS_PER_SEC / fRate;
+        }
+    }
+
+}
@@ -0,0 +1,31 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <stdint.h>
+#include <functional>
+
+namespace JTOX {
+
+    typedef std::function<int64_t()> NanoClock; // monotonic nanoseconds
+
+    // token bucket with up to a second of burst, taking may overdraw so callers hold the transfer afterwards
+    class RateLimiter
+    {
+    public:
+        RateLimiter(const NanoClock& clock = NanoClock()); // steady clock when empty
+        int rate() const; // bytes per second, 0 for unlimited
+        void setRate(int rate);
+        bool take(uint64_t bytes); // false when in deficit afterwards
+        int wait(); // ms until out of deficit
+    private:
+        NanoClock fClock;
+        int fRate;
+        int64_t fTokens;
+        int64_t fRefilledAt; // clock time the tokens are counted up to
+
+        void refill();
+    };
+
+}
+
+#endif // RATELIMITER_H
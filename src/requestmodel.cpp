@@ -116,6 +116,8 @@ namespace JTOX {
     void RequestModel::refresh()
     {
         beginResetModel();
+        fList.clear();
+        endResetModel();
 
         // check old request storage and migrate to DB
         QSettings settings;
@@ -133,7 +135,28 @@ namespace JTOX {
         settings.remove("app/friends/requests"); // wipe old storage after migration
 
         // get requests from DB
-        fDBData.getRequests(fList);
+        fDBData.getRequestsAsync([this](const RequestList& list) {
+            onRequestsLoaded(list);
+        });
+    }
+
+    void RequestModel::onRequestsLoaded(const RequestList& list)
+    {
+        beginResetModel();
+
+        // keep requests that came in while loading, they're in the DB already
+        RequestList merged = list;
+        foreach ( const FriendRequest& request, fList ) {
+            bool found = false;
+            foreach ( const FriendRequest& loaded, list ) {
+                found = found || loaded.getAddress() == request.getAddress();
+            }
+
+            if ( !found ) {
+                merged.append(request);
+            }
+        }
+        fList = merged;
 
         endResetModel();
         emit sizeChanged(fList.size());
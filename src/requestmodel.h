@@ -39,6 +39,7 @@ namespace JTOX {
         int fLookupID;
 
         int getSize() const;
+        void onRequestsLoaded(const RequestList& list);
     };
 
 }
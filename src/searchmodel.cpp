@@ -0,0 +1,137 @@
+#include "searchmodel.h"
+#include "utils.h"
+
+namespace JTOX {
+
+    const int SEARCH_RESULT_LIMIT = 200; // ranked hits per search
+    const int SEARCH_LOAD_BATCH = 20; // hits decrypted and shown per worker job
+
+    SearchModel::SearchModel(const ToxCore& toxCore, DBData& dbData) : QAbstractListModel(0),
+        fDBData(dbData), fList(), fTokens(), fPendingIDs(), fGeneration(0), fSearching(false)
+    {
+        connect(&toxCore, &ToxCore::clientReset, this, &SearchModel::onClientReset);
+    }
+
+    QHash<int, QByteArray> SearchModel::roleNames() const {
+        QHash<int, QByteArray> result;
+        result[erID] = "event_id";
+        result[erEventType] = "event_type";
+        result[erCreated] = "created_at";
+        result[erMessage] = "message";
+        result[erFriendID] = "friend_id";
+
+        return result;
+    }
+
+    int SearchModel::rowCount(const QModelIndex &parent) const {
+        Q_UNUSED(parent);
+        return fList.size();
+    }
+
+    QVariant SearchModel::data(const QModelIndex &index, int role) const {
+        int row = index.row();
+        if ( row < 0 || row >= fList.size() ) {
+            Utils::fatal("Requesting out of bounds data");
+        }
+
+        return fList.at(row).value(role);
+    }
+
+    void SearchModel::search(const QString& text, int friendID)
+    {
+        clear();
+        fTokens = Utils::searchTokens(text);
+        if ( fTokens.isEmpty() ) {
+            return;
+        }
+
+        const int generation = fGeneration;
+        setSearching(true);
+        fDBData.searchEventsAsync(text, friendID, SEARCH_RESULT_LIMIT, [this, generation](const QList<int>& ids) {
+            onHitsFound(generation, ids);
+        });
+    }
+
+    void SearchModel::clear()
+    {
+        fGeneration++;
+        fPendingIDs.clear();
+        fTokens.clear();
+        setSearching(false);
+
+        beginResetModel();
+        fList.clear();
+        endResetModel();
+    }
+
+    void SearchModel::onClientReset()
+    {
+        clear(); // different account, old hits are gone
+    }
+
+    bool SearchModel::getSearching() const
+    {
+        return fSearching;
+    }
+
+    void SearchModel::setSearching(bool searching)
+    {
+        if ( fSearching == searching ) {
+            return;
+        }
+
+        fSearching = searching;
+        emit searchingChanged(fSearching);
+    }
+
+    void SearchModel::loadHits(int generation)
+    {
+        if ( fPendingIDs.isEmpty() ) {
+            setSearching(false);
+            return;
+        }
+
+        const QList<int> ids = fPendingIDs.mid(0, SEARCH_LOAD_BATCH);
+        fPendingIDs = fPendingIDs.mid(ids.size());
+        fDBData.getEventsAsync(ids, [this, generation](const EventList& list) {
+            onHitsLoaded(generation, list);
+        });
+    }
+
+    void SearchModel::onHitsFound(int generation, const QList<int>& ids)
+    {
+        if ( generation != fGeneration ) {
+            return; // search changed meanwhile
+        }
+
+        fPendingIDs = ids;
+        loadHits(generation);
+    }
+
+    void SearchModel::onHitsLoaded(int generation, const EventList& list)
+    {
+        if ( generation != fGeneration ) {
+            return;
+        }
+
+        // blind tokens are truncated hashes, drop the rare collision
+        EventList rows;
+        foreach ( const Event& event, list ) {
+            foreach ( const QString& token, Utils::searchTokens(event.message()) ) {
+                if ( fTokens.contains(token) ) {
+                    rows.append(event);
+                    break;
+                }
+            }
+        }
+
+        if ( !rows.isEmpty() ) {
+            beginInsertRows(QModelIndex(), fList.size(), fList.size() + rows.size() - 1);
+            fList.append(rows);
+            endInsertRows();
+        }
+
+        loadHits(generation); // stream the rest in ranked order
+    }
+
+}
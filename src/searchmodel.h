@@ -0,0 +1,47 @@
+#ifndef SEARCHMODEL_H
+#define SEARCHMODEL_H
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QAbstractListModel>
+#include "toxcore.h"
+#include "event.h"
+#include "dbdata.h"
+
+namespace JTOX {
+
+    class SearchModel : public QAbstractListModel
+    {
+        Q_OBJECT
+        Q_PROPERTY(bool searching READ getSearching NOTIFY searchingChanged)
+    public:
+        SearchModel(const ToxCore& toxCore, DBData& dbData);
+        QHash<int, QByteArray> roleNames() const;
+        int rowCount(const QModelIndex &parent = QModelIndex()) const;
+        QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+
+        Q_INVOKABLE void search(const QString& text, int friendID = -1); // -1 for all friends
+        Q_INVOKABLE void clear();
+    signals:
+        void searchingChanged(bool searching) const;
+    private slots:
+        void onClientReset();
+    private:
+        DBData& fDBData;
+        EventList fList;
+        QStringList fTokens;
+        QList<int> fPendingIDs; // ranked hits not loaded yet
+        int fGeneration; // bumped on each search so stale results are dropped
+        bool fSearching;
+
+        bool getSearching() const;
+        void setSearching(bool searching);
+        void loadHits(int generation);
+        void onHitsFound(int generation, const QList<int>& ids);
+        void onHitsLoaded(int generation, const EventList& list);
+    };
+
+}
+
+#endif // SEARCHMODEL_H
@@ -31,35 +31,29 @@
 #include <QFile>
 #include <QDir>
 #include <QStandardPaths>
+#include <QVector>
 
 namespace JTOX {
 
     //****************************Bootstrapper****************************//
 
-    Bootstrapper::Bootstrapper() : QThread(0)
+    Bootstrapper::Bootstrapper() : QObject(0)
     {
         fWorking = false;
     }
 
-    void Bootstrapper::run() {
+    void Bootstrapper::start(ToxThread& thread, const QJsonArray &nodes) {
         fWorking = true;
-        int count = bootstrapNodes(4);
-
-        fWorking = false;
-        emit resultReady(count);
+        thread.post([this, nodes](Tox* tox) {
+            emit resultReady(bootstrapNodes(tox, nodes, 4)); // queued back to the GUI thread
+        });
     }
 
-    void Bootstrapper::start(Tox* tox, const QJsonArray &nodes) {
-        fTox = tox;
-        fNodes = nodes;
-        QThread::start();
-    }
-
-    int Bootstrapper::bootstrapNodes(int maxNodes)
+    int Bootstrapper::bootstrapNodes(Tox* tox, const QJsonArray& allNodes, int maxNodes) const
     {
         QJsonArray nodes;
         // we only consider those nodes that have both TCP and UDP enabled
-        foreach ( const QJsonValue& nodeVal, fNodes ) {
+        foreach ( const QJsonValue& nodeVal, allNodes ) {
             const QJsonObject node = nodeVal.toObject(); // pick a random node from the list
             bool status_udp = node.value("status_udp").toBool();
             bool status_tcp = node.value("status_tcp").toBool();
@@ -85,13 +79,13 @@ namespace JTOX {
             uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
             Utils::hex_to_key(hexKey, public_key);
 
-            ok = tox_bootstrap(fTox, address.toUtf8().data(), port, public_key, &error);
+            ok = tox_bootstrap(tox, address.toUtf8().data(), port, public_key, &error);
             if ( !ok || error != TOX_ERR_BOOTSTRAP_OK ) {
                 continue;
             }
 
             // this shouldn't be needed as tox_bootstrap should do the relay as well
-            /*ok = tox_add_tcp_relay(fTox, address.toUtf8().data(), port, public_key, &error);
+            /*ok = tox_add_tcp_relay(tox, address.toUtf8().data(), port, public_key, &error);
             if ( !ok || error != TOX_ERR_BOOTSTRAP_OK ) {
                 continue;
             }*/
@@ -107,7 +101,8 @@ namespace JTOX {
 
     //******************************PasswordValidator*********************//
 
-    PasswordValidator::PasswordValidator(EncryptSave& encryptSave) : QThread(0), fEncryptSave(encryptSave)
+    PasswordValidator::PasswordValidator(EncryptSave& encryptSave, ProfileStore& profile) : QThread(0),
+        fEncryptSave(encryptSave), fProfile(profile)
     {
         fWorking = false;
     }
@@ -115,8 +110,7 @@ namespace JTOX {
     void PasswordValidator::run()
     {
         fWorking = true;
-        const QSettings settings;
-        const QByteArray encryptedData = settings.value("tox/savedata", QByteArray()).toByteArray();
+        const QByteArray encryptedData = fProfile.value("tox/savedata");
 
         fEncryptSave.setPassword(fPassword, encryptedData);
         fPassword = QString(); // wipe password from this instance
@@ -132,9 +126,36 @@ namespace JTOX {
         QThread::start();
     }
 
+    //******************************ProfileSaver**************************//
+
+    ProfileSaver::ProfileSaver(EncryptSave& encryptSave, ProfileStore& profile) : QThread(0),
+        fEncryptSave(encryptSave), fProfile(profile), fSaveData()
+    {
+    }
+
+    void ProfileSaver::run()
+    {
+        write(fSaveData);
+        fSaveData = QByteArray();
+        emit resultReady();
+    }
+
+    void ProfileSaver::start(const QByteArray& saveData)
+    {
+        fSaveData = saveData;
+        QThread::start();
+    }
+
+    void ProfileSaver::write(const QByteArray& saveData) const
+    {
+        const QByteArray encryptedData = fEncryptSave.encryptRaw(saveData);
+        fProfile.setValue("tox/savedata", encryptedData);
+    }
+
     //****************************ToxInitializer***************************//
 
-    ToxInitializer::ToxInitializer(EncryptSave& encryptSave) : QThread(0), fEncryptSave(encryptSave)
+    ToxInitializer::ToxInitializer(EncryptSave& encryptSave, ProfileStore& profile) : QThread(0),
+        fEncryptSave(encryptSave), fProfile(profile)
     {
         fWorking = false;
     }
@@ -142,14 +163,13 @@ namespace JTOX {
     void ToxInitializer::run()
     {
         fWorking = true;
-        QSettings settings;
         TOX_ERR_NEW error;
         QByteArray saveData; // must outlive options
         struct Tox_Options options;
         tox_options_default(&options);
 
         if ( !fInitialUse ) {
-            const QByteArray encryptedData = settings.value("tox/savedata", QByteArray()).toByteArray();
+            const QByteArray encryptedData = fProfile.value("tox/savedata");
 
             // if out profile is not encrypted we just set the password and it gets saved with it right after init
             if ( !fEncryptSave.isEncrypted(encryptedData) ) {
@@ -208,52 +228,73 @@ namespace JTOX {
 
     //*******************************ToxCore******************************//
 
-    const int ACTIVE_ITERATION_DELAY = 250;
-    const int PASSIVE_ITERATION_DELAY = 2000;
+    // idle backoff ceilings, any activity goes back to tox_iteration_interval. Incoming packets
+    // don't end the wait, so in the foreground the ceiling is the old fixed delay
+    const int ACTIVE_MAX_ITERATION_DELAY = 250;
+    const int PASSIVE_MAX_ITERATION_DELAY = 2000;
+    const int WAKEUPS_INTERVAL = 60000; // wake-ups are counted per minute
+    const int SAVE_DELAY = 2000; // most ms a savedata change waits, changes within it are written once
     const int AWAY_DELAY = 300000; // 5m for away
+    const int TOX_EVENT_BATCH = 256; // callback events handled before yielding to the event loop
 
     ToxCore::ToxCore(EncryptSave& encryptSave, DBData& dbData) : QObject(0),
-        fEncryptSave(encryptSave), fDBData(dbData),
-        fTox(NULL), fBootstrapper(), fInitializer(encryptSave), fPasswordValidator(encryptSave),
-        fNodesRequest(NULL), fIterationTimer(), fPasswordValid(false), fInitialized(false),
-        fActiveTransfers()
+        fEncryptSave(encryptSave), fDBData(dbData), fProfile(),
+        fTox(NULL), fBootstrapper(), fInitializer(encryptSave, fProfile), fPasswordValidator(encryptSave, fProfile),
+        fSaver(encryptSave, fProfile),
+        fNodesRequest(NULL), fToxThread(), fRateTimer(), fWakeupsTimer(), fSaveTimer(), fPasswordValid(false), fInitialized(false),
+        fApplicationActive(true), fWakeupsPerMinute(0), fSaveDirty(false), fSaveUrgent(false), fSaveQueued(false),
+        fTransfers(), fUploadLimiter(), fDownloadLimiter(), fProfileAvatarData(), fProfileAvatarHash(), fAvatarOffers(),
+        fAddress(), fNoSpam(0), fSecretKey(), fUserName(), fStatusMessage(), fUserStatus(TOX_USER_STATUS_NONE),
+        fConnectionStatus(TOX_CONNECTION_NONE), fFriends()
     {
         connect(&fNetManager, SIGNAL(finished(QNetworkReply*)), this, SLOT(httpRequestDone(QNetworkReply*)));
         connect(&fBootstrapper, &Bootstrapper::resultReady, this, &ToxCore::bootstrappingDone);
         connect(&fInitializer, &ToxInitializer::resultReady, this, &ToxCore::toxInitDone);
         connect(&fPasswordValidator, &PasswordValidator::resultReady, this, &ToxCore::passwordValidationDone);
-        connect(&fIterationTimer, &QTimer::timeout, this, &ToxCore::iterate);
+        connect(&fSaver, &ProfileSaver::resultReady, this, &ToxCore::savingDone);
+        connect(&fToxThread, &ToxThread::eventsReady, this, &ToxCore::onToxEvents);
         connect(&fAwayTimer, &QTimer::timeout, this, &ToxCore::awayTimeout);
+        connect(&fRateTimer, &QTimer::timeout, this, &ToxCore::rateTimeout);
+        connect(&fWakeupsTimer, &QTimer::timeout, this, &ToxCore::wakeupsTimeout);
+        connect(&fSaveTimer, &QTimer::timeout, this, &ToxCore::saveTimeout);
+        connect(&fTransfers, &TransferRegistry::runningCountChanged, this, &ToxCore::onRunningTransfersChanged);
 
-        fIterationTimer.setInterval(ACTIVE_ITERATION_DELAY);
         fAwayTimer.setInterval(AWAY_DELAY);
         fAwayStatus = 0; // offline
+        fRateTimer.setSingleShot(true);
+        fWakeupsTimer.setInterval(WAKEUPS_INTERVAL);
+        fSaveTimer.setInterval(SAVE_DELAY);
+        fSaveTimer.setSingleShot(true); // not restarted by further changes, keeps the delay bounded
 
         // If we're running first time (or updated from 1.0.1-) we need to "store"
         // the nodes from our defaults
-        QSettings settings;
-        if ( !settings.contains("tox/nodes") ) {
-            settings.setValue("tox/nodes", getDefaultNodes());
+        if ( !fProfile.contains("tox/nodes") ) {
+            fProfile.setValue("tox/nodes", getDefaultNodes());
         }
+
+        const QSettings settings;
+        fUploadLimiter.setRate(settings.value("tox/upload_limit", 0).toInt() * 1024);
+        fDownloadLimiter.setRate(settings.value("tox/download_limit", 0).toInt() * 1024);
     }
 
     ToxCore::~ToxCore() {
+        fSaver.wait(); // a background save outlives killTox, not the saver
         if ( !fInitialized ) {
             return;
         }
 
         awayRestore(); // restore away status so we don't override if killed while in bg mode
-        save();
-        killTox();
+        killTox(true);
     }
 
-    Tox* ToxCore::tox() {
-        if ( fTox == NULL ) {
-            qDebug() << "Tox instance not initialized yet\n";
-            emit errorOccurred("Tox instance not initialized yet");
-        }
+    TransferRegistry& ToxCore::transfers()
+    {
+        return fTransfers;
+    }
 
-        return fTox;
+    const FriendList& ToxCore::friends() const
+    {
+        return fFriends;
     }
 
     void ToxCore::setConnectionStatus() {
@@ -305,9 +346,9 @@ namespace JTOX {
         emit friendTypingChanged(friend_id, typing);
     }
 
-    void ToxCore::onFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QString &file_name) const
+    void ToxCore::onFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QString &file_name, const QByteArray& fileID) const
     {
-        emit fileReceived(friend_id, file_number, file_size, file_name);
+        emit fileReceived(friend_id, file_number, file_size, file_name, fileID);
     }
 
     void ToxCore::onAvatarFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QByteArray &fileID) const
@@ -317,8 +358,9 @@ namespace JTOX {
 
     void ToxCore::onFileCanceled(quint32 friend_id, quint32 file_number)
     {
-        if ( fActiveAvatarTransfers.contains(friend_id) && fActiveAvatarTransfers.value(friend_id) == file_number ) {
-            fActiveAvatarTransfers.remove(friend_id);
+        Transfer* transfer = fTransfers.get(friend_id, file_number);
+        if ( transfer != NULL && transfer->kind() != tkFile ) {
+            fTransfers.remove(transfer);
             return; // friend cancelled avatar transfer
         }
 
@@ -327,7 +369,8 @@ namespace JTOX {
 
     void ToxCore::onFilePaused(quint32 friend_id, quint32 file_number) const
     {
-        if ( fActiveAvatarTransfers.contains(friend_id) && fActiveAvatarTransfers.value(friend_id) == file_number ) {
+        const Transfer* transfer = fTransfers.get(friend_id, file_number);
+        if ( transfer != NULL && transfer->kind() != tkFile ) {
             return; // nada
         }
 
@@ -336,19 +379,20 @@ namespace JTOX {
 
     void ToxCore::onFileResumed(quint32 friend_id, quint32 file_number) const
     {
-        if ( fActiveAvatarTransfers.contains(friend_id) && fActiveAvatarTransfers.value(friend_id) == file_number ) {
+        const Transfer* transfer = fTransfers.get(friend_id, file_number);
+        if ( transfer != NULL && transfer->kind() != tkFile ) {
             return; // nada
         }
 
         emit fileResumed(friend_id, file_number);
     }
 
-    void ToxCore::onFileChunkReceived(quint32 friend_id, quint32 file_number, quint64 position, const quint8 *data, size_t length)
+    void ToxCore::onFileChunkReceived(quint32 friend_id, quint32 file_number, quint64 position, const QByteArray& data)
     {
-        updateTransfers(friend_id, file_number, length);
+        updateTransfers(friend_id, file_number, data.size());
 
-        const QByteArray qbd((char*)data, length);
-        emit fileChunkReceived(friend_id, file_number, position, qbd);
+        emit fileChunkReceived(friend_id, file_number, position, data);
+        limitTransfer(friend_id, file_number, data.size(), fDownloadLimiter);
     }
 
     void ToxCore::onFileChunkRequest(quint32 friend_id, quint32 file_number, quint64 position, size_t length)
@@ -356,11 +400,39 @@ namespace JTOX {
         updateTransfers(friend_id, file_number, length);
 
         // if this is an avatar send, handle it here
-        if ( fActiveAvatarTransfers.contains(friend_id) && fActiveAvatarTransfers.value(friend_id) == file_number ) {
-            return sendAvatarChunk(friend_id, file_number, position, length);
+        const Transfer* transfer = fTransfers.get(friend_id, file_number);
+        if ( transfer != NULL && transfer->kind() == tkAvatarOut ) {
+            sendAvatarChunk(friend_id, file_number, position, length);
+        } else {
+            emit fileChunkRequest(friend_id, file_number, position, length);
+        }
+
+        limitTransfer(friend_id, file_number, length, fUploadLimiter);
+    }
+
+    void ToxCore::holdTransfer(Transfer* transfer, TransferHold reason)
+    {
+        const int holds = transfer->holds();
+        transfer->setHolds(holds | reason);
+        if ( holds != 0 || (transfer->pausers() & 0x1) != 0 ) {
+            return; // already paused in tox
+        }
+
+        fileControl(transfer->friendID(), transfer->fileNumber(), TOX_FILE_CONTROL_PAUSE);
+    }
+
+    void ToxCore::releaseTransfer(Transfer* transfer, TransferHold reason)
+    {
+        if ( (transfer->holds() & reason) == 0 ) {
+            return;
+        }
+
+        transfer->setHolds(transfer->holds() & ~reason);
+        if ( transfer->holds() != 0 || (transfer->pausers() & 0x1) != 0 ) {
+            return; // still paused for another reason
         }
 
-        emit fileChunkRequest(friend_id, file_number, position, length);
+        fileControl(transfer->friendID(), transfer->fileNumber(), TOX_FILE_CONTROL_RESUME); // friend could be gone, cancel comes separately
     }
 
     bool ToxCore::getBusy() const {
@@ -381,8 +453,7 @@ namespace JTOX {
     }
 
     bool ToxCore::getInitialUse() const {
-        const QSettings settings;
-        return !settings.contains("tox/savedata");
+        return !fProfile.contains("tox/savedata");
     }
 
     bool ToxCore::getApplicationActive() const
@@ -394,14 +465,11 @@ namespace JTOX {
         if ( !fInitialized ) {
             Utils::fatal("Attempting to retreive secret key on unintialized tox");
         }
-        uint8_t sk[TOX_SECRET_KEY_SIZE];
-        tox_self_get_secret_key(fTox, sk);
-
         const size_t cypherlen = crypto_box_MACBYTES + payload.size();
         QByteArray payloadEnc(cypherlen, 0);
 
         int cryptResult = crypto_box_easy((uint8_t*) payloadEnc.data(), (uint8_t*) payload.data(), payload.size(),
-                        (uint8_t*) nonce.data(), (uint8_t*) pk.constData(), sk);
+                        (uint8_t*) nonce.data(), (uint8_t*) pk.constData(), (const uint8_t*) fSecretKey.constData());
 
         if ( cryptResult != 0 ) {
             Utils::fatal("Error on payload encryption");
@@ -418,17 +486,57 @@ namespace JTOX {
         }
 
         if ( fInitialized ) {
-            killTox();
+            killTox(true);
         }
         emit busyChanged(true);
         fInitializer.start(getInitialUse(), password);
     }
 
-    void ToxCore::iterate() {
-        if ( !fInitialized ) {
-            return;
+    void ToxCore::onToxEvents() {
+        fToxThread.drained(); // anything pushed from now on notifies again
+
+        ToxEvent event;
+        int handled = 0;
+        while ( fInitialized && handled < TOX_EVENT_BATCH && fToxThread.pop(event) ) {
+            handled++;
+            switch ( event.type ) {
+                case teSelfConnectionStatus: fConnectionStatus = (TOX_CONNECTION) event.value; setConnectionStatus(); break;
+                case teFriendRequest: onFriendRequest(event.data.toHex(), event.text); break;
+                case teFriendMessage: onMessageReceived(event.friendID, (TOX_MESSAGE_TYPE) event.value, event.text); break;
+                case teFriendConnectionStatus: onFriendConStatusChanged(event.friendID, event.value); break;
+                case teFriendName: onFriendNameChanged(event.friendID, event.text); break;
+                case teFriendStatus: onFriendStatusChanged(event.friendID, event.value); break;
+                case teFriendStatusMessage: onFriendStatusMsgChanged(event.friendID, event.text); break;
+                case teFriendTyping: onFriendTypingChanged(event.friendID, event.value != 0); break;
+                case teFriendReadReceipt: onMessageDelivered(event.friendID, event.number); break;
+                case teFileControl: {
+                    switch ( event.value ) {
+                        case TOX_FILE_CONTROL_CANCEL: onFileCanceled(event.friendID, event.number); break;
+                        case TOX_FILE_CONTROL_PAUSE: onFilePaused(event.friendID, event.number); break;
+                        case TOX_FILE_CONTROL_RESUME: onFileResumed(event.friendID, event.number); break;
+                    }
+                    break;
+                }
+                case teFileReceived: onFileReceived(event.friendID, event.number, event.position, event.text, event.data); break;
+                case teAvatarReceived: onAvatarFileReceived(event.friendID, event.number, event.position, event.data); break;
+                case teFileChunk: onFileChunkReceived(event.friendID, event.number, event.position, event.data); break;
+                case teFileChunkRequest: onFileChunkRequest(event.friendID, event.number, event.position, event.length); break;
+                case teMessageSent: emit messageSent(event.friendID, event.tag, event.number, event.value); break;
+                case teFileSent: emit fileSent(event.friendID, event.number, event.tag, event.value); break;
+                case teAvatarSent: onAvatarSent(event.friendID, event.number, event.data, event.value); break;
+                case teFileFailed: onFileFailed(event.friendID, event.number, event.text); break;
+                case teFriendAdded: onFriendAdded(event.friendID, event.data, event.text, true, event.value); break;
+                case teFriendAddedNoRequest: onFriendAdded(event.friendID, event.data, event.text, false, event.value); break;
+                case teSelfAddress: onSelfAddress(event.data, event.number); break;
+                case teSaveData: onSaveData(event.data); break;
+            }
+        }
+
+        fDBData.flush(); // writes from all handlers in this batch go out as one transaction
+
+        if ( handled == TOX_EVENT_BATCH ) { // let the event loop paint before the rest
+            QMetaObject::invokeMethod(this, "onToxEvents", Qt::QueuedConnection);
         }
-        tox_iterate(fTox, this);
     }
 
     void ToxCore::awayTimeout()
@@ -466,9 +574,7 @@ namespace JTOX {
             Utils::fatal("Attempt to get public key with uninitialized tox");
         }
 
-        uint8_t pubRaw[TOX_PUBLIC_KEY_SIZE];
-        tox_self_get_public_key(fTox, pubRaw);
-        return Utils::key_to_hex(pubRaw, TOX_PUBLIC_KEY_SIZE);
+        return Utils::key_to_hex((const uint8_t*) fAddress.constData(), TOX_PUBLIC_KEY_SIZE); // address starts with it
     }
 
     const QString ToxCore::getHexToxID() const
@@ -477,9 +583,7 @@ namespace JTOX {
             Utils::fatal("Attempt to get public toxID with uninitialized tox");
         }
 
-        uint8_t addrRaw[TOX_ADDRESS_SIZE];
-        tox_self_get_address(fTox, addrRaw);
-        return Utils::key_to_hex(addrRaw, TOX_ADDRESS_SIZE);
+        return Utils::key_to_hex((const uint8_t*) fAddress.constData(), TOX_ADDRESS_SIZE);
     }
 
     const QByteArray ToxCore::hash(const QByteArray &data) const
@@ -499,8 +603,7 @@ namespace JTOX {
             Utils::fatal("Attempt to get nospam with uninitialized tox");
         }
 
-        uint32_t noSpamInt = tox_self_get_nospam(fTox);
-        return QString::number(noSpamInt, 16).toUpper();
+        return QString::number(fNoSpam, 16).toUpper();
     }
 
     bool ToxCore::setNoSpam(const QString& hexVal) {
@@ -515,9 +618,17 @@ namespace JTOX {
             return false;
         }
 
-        tox_self_set_nospam(fTox, noSpamInt);
-        save();
-        emit accountChanged();
+        post([this, noSpamInt](Tox* tox) {
+            tox_self_set_nospam(tox, noSpamInt);
+
+            ToxEvent event;
+            event.type = teSelfAddress;
+            event.number = tox_self_get_nospam(tox);
+            event.data = QByteArray(TOX_ADDRESS_SIZE, 0);
+            tox_self_get_address(tox, (uint8_t*) event.data.data());
+            fToxThread.push(event);
+        });
+        saveNow(); // a lost nospam change means requests to the old one go unanswered
         return true;
     }
 
@@ -542,24 +653,25 @@ namespace JTOX {
     void ToxCore::setApplicationActive(bool active)
     {
         fApplicationActive = active;
-        fIterationTimer.setInterval(getIterationInterval());
+        fToxThread.setMaxInterval(getIterationInterval());
 
         if ( active ) {
             awayRestore(); // if we restored, stop away timer and restore old status
         } else {
             awayStart(); // if we minimized, start away timer
         }
+
+        emit applicationActiveChanged(active);
     }
 
     void ToxCore::newAccount()
     {
-        QSettings settings;
-        settings.remove("tox/savedata");
-        settings.sync();
-        fDBData.wipe(-1);
+        discardSave();
+        fProfile.remove("tox/savedata");
+        fDBData.wipeBlocking(-1); // before the new account writes anything
 
         if ( fInitialized ) {
-            killTox();
+            killTox(false);
         }
 
         emit initialUseChanged(true);
@@ -579,14 +691,15 @@ namespace JTOX {
         const QByteArray encryptedData = impFile.readAll();
         impFile.close();
 
-        QSettings settings;
-        settings.setValue("tox/savedata", encryptedData);
-        settings.sync();
+        discardSave(); // the old profile must not overwrite the imported one
+        if ( !fProfile.setValue("tox/savedata", encryptedData) ) {
+            emit errorOccurred("Import error: unable to store profile");
+            return false;
+        }
 
-        fIterationTimer.stop();
-        fDBData.wipe(-1); // wipe logs without emit
+        fDBData.wipeBlocking(-1); // wipe logs without emit, before the imported account writes anything
         if ( fInitialized ) {
-            killTox();
+            killTox(false);
         }
 
         emit accountImported();
@@ -595,8 +708,7 @@ namespace JTOX {
 
     void ToxCore::exportAccount() const
     {
-        const QSettings settings;
-        const QByteArray encryptedData = settings.value("tox/savedata", QByteArray()).toByteArray();
+        const QByteArray encryptedData = fProfile.value("tox/savedata");
         const QDir dir(QStandardPaths::writableLocation(QStandardPaths::DocumentsLocation));
         const QString userName = getUserName();
         const QString fileName = userName.isEmpty() ? "jtox.tox" : (userName + ".tox");
@@ -617,8 +729,9 @@ namespace JTOX {
 
     void ToxCore::wipeLogs()
     {
-        fDBData.wipeLogs();
-        emit logsWiped();
+        fDBData.wipeLogsAsync([this]() {
+            emit logsWiped();
+        });
     }
 
     int ToxCore::getStatus() const {
@@ -626,9 +739,7 @@ namespace JTOX {
             return 0;
         }
 
-        TOX_USER_STATUS userStatus = tox_self_get_status(fTox);
-        TOX_CONNECTION conStatus = tox_self_get_connection_status(fTox);
-        return Utils::get_overall_status(conStatus, userStatus);
+        return Utils::get_overall_status(fConnectionStatus, fUserStatus);
     }
 
     const QString ToxCore::getStatusText() const
@@ -656,7 +767,10 @@ namespace JTOX {
             default: Utils::fatal("Invalid status update"); break;
         }
 
-        tox_self_set_status(fTox, userStatus);
+        fUserStatus = userStatus;
+        post([userStatus](Tox* tox) {
+            tox_self_set_status(tox, userStatus);
+        });
         save();
         emit statusChanged(status);
 
@@ -671,11 +785,7 @@ namespace JTOX {
             Utils::fatal("Attempting to get status msg on unintialized tox");
         }
 
-        size_t size = tox_self_get_status_message_size(fTox);
-        uint8_t rawMessage[size];
-
-        tox_self_get_status_message(fTox, rawMessage);
-        return QString::fromUtf8((char*)rawMessage, size);
+        return fStatusMessage;
     }
 
     void ToxCore::setStatusMessage(const QString& sm) {
@@ -683,15 +793,15 @@ namespace JTOX {
             Utils::fatal("Attempting to set status msg on unintialized tox");
         }
 
-        TOX_ERR_SET_INFO error;
-        QByteArray rawMessage = sm.toUtf8();
-        size_t size = rawMessage.size();
-        tox_self_set_status_message(fTox, (uint8_t*)rawMessage.data(), size, &error);
-
-        if ( error != TOX_ERR_SET_INFO_OK ) {
-            Utils::fatal("Error setting status message: " + QString::number(error, 10));
+        const QByteArray rawMessage = sm.toUtf8();
+        if ( (size_t) rawMessage.size() > tox_max_status_message_length() ) { // the only error tox could give us
+            Utils::fatal("Error setting status message: " + QString::number(TOX_ERR_SET_INFO_TOO_LONG, 10));
         }
 
+        fStatusMessage = sm;
+        post([rawMessage](Tox* tox) {
+            tox_self_set_status_message(tox, (const uint8_t*) rawMessage.constData(), rawMessage.size(), NULL);
+        });
         save();
         emit statusMessageChanged(sm);
     }
@@ -701,11 +811,7 @@ namespace JTOX {
             Utils::fatal("Attempt to get username with uninitialized tox");
         }
 
-        size_t size = tox_self_get_name_size(fTox);
-        uint8_t rawName[size];
-
-        tox_self_get_name(fTox, rawName);
-        return QString::fromUtf8((char*)rawName, size);
+        return fUserName;
     }
 
     void ToxCore::setUserName(const QString& uname) {
@@ -713,15 +819,15 @@ namespace JTOX {
             Utils::fatal("Attempting to set username on unintialized tox");
         }
 
-        TOX_ERR_SET_INFO error;
-        QByteArray rawName = uname.toUtf8();
-        size_t size = rawName.size();
-        tox_self_set_name(fTox, (uint8_t*)rawName.data(), size, &error);
-
-        if ( error != TOX_ERR_SET_INFO_OK ) {
-            Utils::fatal("Error setting user name: " + QString::number(error, 10));
+        const QByteArray rawName = uname.toUtf8();
+        if ( (size_t) rawName.size() > tox_max_name_length() ) { // the only error tox could give us
+            Utils::fatal("Error setting user name: " + QString::number(TOX_ERR_SET_INFO_TOO_LONG, 10));
         }
 
+        fUserName = uname;
+        post([rawName](Tox* tox) {
+            tox_self_set_name(tox, (const uint8_t*) rawName.constData(), rawName.size(), NULL);
+        });
         save();
         emit userNameChanged(uname);
     }
@@ -737,13 +843,96 @@ namespace JTOX {
         return file.readAll();
     }
 
+    int ToxCore::getUploadLimit() const
+    {
+        return fUploadLimiter.rate() / 1024;
+    }
+
+    void ToxCore::setUploadLimit(int limit)
+    {
+        if ( limit == getUploadLimit() ) {
+            return;
+        }
+
+        fUploadLimiter.setRate(limit * 1024);
+        QSettings settings;
+        settings.setValue("tox/upload_limit", fUploadLimiter.rate() / 1024);
+        rateTimeout(); // a raised limit frees held transfers right away
+        emit uploadLimitChanged(getUploadLimit());
+    }
+
+    int ToxCore::getDownloadLimit() const
+    {
+        return fDownloadLimiter.rate() / 1024;
+    }
+
+    void ToxCore::setDownloadLimit(int limit)
+    {
+        if ( limit == getDownloadLimit() ) {
+            return;
+        }
+
+        fDownloadLimiter.setRate(limit * 1024);
+        QSettings settings;
+        settings.setValue("tox/download_limit", fDownloadLimiter.rate() / 1024);
+        rateTimeout();
+        emit downloadLimitChanged(getDownloadLimit());
+    }
+
+    void ToxCore::limitTransfer(quint32 friend_id, quint32 file_number, size_t length, RateLimiter& limiter)
+    {
+        Transfer* transfer = fTransfers.get(friend_id, file_number); // handlers may have finished it
+        if ( transfer == NULL || length == 0 || limiter.take(length) ) {
+            return;
+        }
+
+        // over budget, chunks of this transfer stop until the bucket refills
+        holdTransfer(transfer, thRate);
+        if ( !fRateTimer.isActive() ) {
+            fRateTimer.start(limiter.wait());
+        }
+    }
+
+    void ToxCore::rateTimeout()
+    {
+        int wait = 0;
+        foreach ( Transfer* transfer, fTransfers.list() ) {
+            if ( (transfer->holds() & thRate) == 0 ) {
+                continue;
+            }
+
+            RateLimiter& limiter = transfer->isIncoming() ? fDownloadLimiter : fUploadLimiter;
+            const int limiterWait = limiter.wait();
+            if ( limiterWait == 0 ) {
+                releaseTransfer(transfer, thRate);
+            } else {
+                wait = wait == 0 ? limiterWait : qMin(wait, limiterWait);
+            }
+        }
+
+        if ( wait > 0 ) {
+            fRateTimer.start(wait);
+        }
+    }
+
     int ToxCore::getIterationInterval() const
     {
-        if ( fActiveTransfers.size() == 0 ) {
-            return fApplicationActive ? ACTIVE_ITERATION_DELAY : PASSIVE_ITERATION_DELAY;
+        if ( fTransfers.runningCount() == 0 ) {
+            return fApplicationActive ? ACTIVE_MAX_ITERATION_DELAY : PASSIVE_MAX_ITERATION_DELAY;
         }
 
-        return tox_iteration_interval(fTox); // downloading/uploading a file, go full speed
+        return 0; // downloading/uploading a file, no backoff
+    }
+
+    int ToxCore::getWakeupsPerMinute() const
+    {
+        return fWakeupsPerMinute;
+    }
+
+    void ToxCore::wakeupsTimeout()
+    {
+        fWakeupsPerMinute = fToxThread.takeWakeups();
+        emit wakeupsPerMinuteChanged(fWakeupsPerMinute);
     }
 
     void ToxCore::awayRestore()
@@ -772,113 +961,387 @@ namespace JTOX {
             Utils::fatal("Attempting to save on unintialized tox");
         }
 
-        size_t size = tox_get_savedata_size(fTox);
-        const QByteArray saveData(size, 0);
-        tox_get_savedata(fTox, (uint8_t*)saveData.data());
-        const QByteArray encryptedData = fEncryptSave.encryptRaw(saveData);
+        fSaveDirty = true;
+        if ( !fSaveTimer.isActive() && !fSaveQueued ) { // a save in flight restarts the timer when done
+            fSaveTimer.start();
+        }
+    }
 
-        QSettings settings;
-        settings.setValue("tox/savedata", encryptedData);
-        settings.sync();
+    void ToxCore::saveNow()
+    {
+        if ( !fInitialized ) {
+            Utils::fatal("Attempting to save on unintialized tox");
+        }
+
+        fSaveTimer.stop();
+        fSaveDirty = true;
+        fSaveUrgent = true;
+        saveTimeout(); // the snapshot command queues behind the change that needs saving
+    }
+
+    void ToxCore::saveTimeout()
+    {
+        if ( !fSaveDirty || !fInitialized || fSaveQueued ) { // one at a time so an older snapshot never lands last
+            return;
+        }
+
+        fSaveDirty = false;
+        fSaveUrgent = false;
+        fSaveQueued = true;
+        post([this](Tox* tox) {
+            ToxEvent event;
+            event.type = teSaveData;
+            event.data = getSaveData(tox);
+            fToxThread.push(event);
+        });
+    }
+
+    void ToxCore::onSaveData(const QByteArray& saveData)
+    {
+        fSaver.wait(); // the previous run may still be returning
+        fSaver.start(saveData);
+    }
+
+    void ToxCore::savingDone()
+    {
+        fSaveQueued = false;
         emit initialUseChanged(false);
+        if ( !fSaveDirty ) {
+            return;
+        }
+
+        if ( fSaveUrgent ) { // changed while writing
+            saveTimeout();
+        } else if ( !fSaveTimer.isActive() ) {
+            fSaveTimer.start();
+        }
+    }
+
+    const QByteArray ToxCore::getSaveData(const Tox* tox) const
+    {
+        QByteArray saveData(tox_get_savedata_size(tox), 0);
+        tox_get_savedata(tox, (uint8_t*)saveData.data());
+        return saveData;
+    }
+
+    void ToxCore::discardSave()
+    {
+        fSaveTimer.stop();
+        fSaveDirty = false;
+        fSaveUrgent = false;
+        fSaver.wait(); // a snapshot still queued dies with the instance in killTox
     }
 
-    quint32 ToxCore::sendFile(quint32 friendID, const QString &file_path, QByteArray &file_id)
+    void ToxCore::post(const ToxCommand& command)
     {
-        const QFile file(file_path);
-        if ( file_id.isEmpty() ) {
-            file_id.resize(TOX_FILE_ID_LENGTH);
-            randombytes_buf((quint8*) file_id.data(), TOX_FILE_ID_LENGTH);
+        if ( !fInitialized ) {
+            Utils::fatal("Attempting to use uninitialized tox");
         }
 
-        TOX_ERR_FILE_SEND error;
-        const QString fileName = QFileInfo(file).fileName();
-        quint32 file_number = tox_file_send(fTox, friendID, TOX_FILE_KIND_DATA, (quint64) file.size(), (quint8*) file_id.constData(),
-                                            (quint8*) fileName.toUtf8().constData(), fileName.length(), &error);
+        fToxThread.post(command);
+    }
+
+    void ToxCore::failFile(Tox* tox, quint32 friend_id, quint32 file_number, const QString& error)
+    {
+        TOX_ERR_FILE_CONTROL ctrlError;
+        tox_file_control(tox, friend_id, file_number, TOX_FILE_CONTROL_CANCEL, &ctrlError); // may be gone already
+
+        ToxEvent event;
+        event.type = teFileFailed;
+        event.friendID = friend_id;
+        event.number = file_number;
+        event.text = error;
+        fToxThread.push(event);
+    }
 
-        Utils::handleToxFileSendError(error); // all critical and cause a bail
-        return file_number;
+    void ToxCore::sendMessage(quint32 friend_id, int eventID, const QByteArray& message)
+    {
+        post([this, friend_id, eventID, message](Tox* tox) {
+            TOX_ERR_FRIEND_SEND_MESSAGE error;
+            ToxEvent event;
+            event.type = teMessageSent;
+            event.friendID = friend_id;
+            event.number = tox_friend_send_message(tox, friend_id, TOX_MESSAGE_TYPE_NORMAL, (const uint8_t*) message.constData(),
+                                                   message.size(), &error);
+            event.value = error;
+            event.tag = eventID;
+            fToxThread.push(event); // ahead of any receipt for it
+        });
+    }
+
+    void ToxCore::sendFile(quint32 friend_id, int eventID, const QString& file_path, const QByteArray& file_id)
+    {
+        const QFileInfo info(file_path);
+        const QByteArray fileName = info.fileName().toUtf8();
+        const quint64 fileSize = info.size();
+        post([this, friend_id, eventID, fileName, fileSize, file_id](Tox* tox) {
+            TOX_ERR_FILE_SEND error;
+            ToxEvent event;
+            event.type = teFileSent;
+            event.friendID = friend_id;
+            event.number = tox_file_send(tox, friend_id, TOX_FILE_KIND_DATA, fileSize, (const uint8_t*) file_id.constData(),
+                                         (const uint8_t*) fileName.constData(), fileName.size(), &error);
+            event.value = error;
+            event.tag = eventID;
+            fToxThread.push(event); // ahead of any chunk request for it
+        });
     }
 
     bool ToxCore::sendAvatar(quint32 friend_id, const QByteArray& hash, const QByteArray& data)
     {
         // avatar changed, if we're still sending old one we need to cancel all the avatar transfers
         if ( data != fProfileAvatarData ) {
-            TOX_ERR_FILE_CONTROL ctrl_error;
-            QMapIterator<quint32, quint32> i(fActiveAvatarTransfers);
+            foreach ( Transfer* transfer, fTransfers.list(tkAvatarOut) ) {
+                fileControl(transfer->friendID(), transfer->fileNumber(), TOX_FILE_CONTROL_CANCEL);
+                fTransfers.remove(transfer);
+            }
+        }
+
+        if ( fTransfers.getAvatarOut(friend_id) != NULL || fAvatarOffers.contains(friend_id) ) {
+            // we're already sending this one otherwise it'd clear, an offer of an old one gets redone in onAvatarSent
+            return false;
+        }
+
+        fProfileAvatarData = data; // source for chunks, can't get from avatarProvider due to circularity
+        fProfileAvatarHash = hash;
+        fAvatarOffers.insert(friend_id);
+
+        const quint64 size = data.size();
+        post([this, friend_id, hash, size](Tox* tox) {
+            TOX_ERR_FILE_SEND error;
+            ToxEvent event;
+            event.type = teAvatarSent;
+            event.friendID = friend_id;
+            event.number = tox_file_send(tox, friend_id, TOX_FILE_KIND_AVATAR, size, (const uint8_t*) hash.constData(), NULL, 0, &error);
+            event.value = error;
+            event.data = hash;
+            fToxThread.push(event);
+        });
+        return true;
+    }
+
+    void ToxCore::onAvatarSent(quint32 friend_id, quint32 file_number, const QByteArray& hash, int error)
+    {
+        fAvatarOffers.remove(friend_id);
+        if ( !Utils::handleToxFileSendError((TOX_ERR_FILE_SEND) error, true).isEmpty() ) {
+            return; // friend went offline meanwhile
+        }
+
+        if ( hash != fProfileAvatarHash ) { // avatar changed while offering
+            fileControl(friend_id, file_number, TOX_FILE_CONTROL_CANCEL);
+            sendAvatar(friend_id, fProfileAvatarHash, fProfileAvatarData);
+            return;
+        }
+
+        Transfer* transfer = fTransfers.add(tkAvatarOut, friend_id, file_number, fProfileAvatarData.size());
+        transfer->setFileID(hash);
+    }
+
+    void ToxCore::sendFileChunk(quint32 friend_id, quint32 file_number, quint64 position, const QByteArray& chunk)
+    {
+        post([this, friend_id, file_number, position, chunk](Tox* tox) {
+            TOX_ERR_FILE_SEND_CHUNK error;
+            tox_file_send_chunk(tox, friend_id, file_number, position, (const uint8_t*) chunk.constData(), chunk.size(), &error);
 
-            while ( i.hasNext() ) {
-                i.next();
-                tox_file_control(fTox, i.key(), i.value(), TOX_FILE_CONTROL_CANCEL, &ctrl_error);
+            const QString strError = Utils::handleFileSendChunkError(error, true);
+            if ( !strError.isEmpty() ) {
+                failFile(tox, friend_id, file_number, strError);
+            }
+        });
+    }
 
-                if ( ctrl_error != TOX_ERR_FILE_CONTROL_OK ) {
-                    Utils::fatal("Unable to cancel avatar transfer in progress");
-                    return false;
+    void ToxCore::seekFile(quint32 friend_id, quint32 file_number, quint64 position, bool resume)
+    {
+        post([this, friend_id, file_number, position, resume](Tox* tox) {
+            if ( position > 0 ) {
+                TOX_ERR_FILE_SEEK error;
+                tox_file_seek(tox, friend_id, file_number, position, &error);
+                if ( error != TOX_ERR_FILE_SEEK_OK ) {
+                    return failFile(tox, friend_id, file_number, "Unable to seek resumed transfer");
                 }
             }
-            fActiveAvatarTransfers.clear();
+
+            if ( resume ) {
+                TOX_ERR_FILE_CONTROL error;
+                tox_file_control(tox, friend_id, file_number, TOX_FILE_CONTROL_RESUME, &error);
+                const QString strError = Utils::handleFileControlError(error, true);
+                if ( !strError.isEmpty() ) {
+                    failFile(tox, friend_id, file_number, strError);
+                }
+            }
+        });
+    }
+
+    void ToxCore::fileControl(quint32 friend_id, quint32 file_number, TOX_FILE_CONTROL control)
+    {
+        post([friend_id, file_number, control](Tox* tox) {
+            TOX_ERR_FILE_CONTROL error;
+            tox_file_control(tox, friend_id, file_number, control, &error);
+            Utils::handleFileControlError(error, true);
+        });
+    }
+
+    void ToxCore::onFileFailed(quint32 friend_id, quint32 file_number, const QString& error)
+    {
+        Transfer* transfer = fTransfers.get(friend_id, file_number);
+        if ( transfer == NULL ) {
+            return; // later commands of a transfer that failed already
         }
 
-        if ( fActiveAvatarTransfers.contains(friend_id) ) {
-            // we're already sending this one otherwise it'd clear
-            return false;
+        if ( transfer->kind() != tkFile ) {
+            fTransfers.remove(transfer);
+            emit errorOccurred("Avatar transfer error");
+            return;
         }
 
-        fProfileAvatarData = data; // source for chunks, can't get from avatarProvider due to circularity
+        emit fileFailed(friend_id, file_number, error);
+    }
 
-        TOX_ERR_FILE_SEND error;
-        quint32 file_number = tox_file_send(fTox, friend_id, TOX_FILE_KIND_AVATAR, (quint64) data.size(), (quint8*) hash.constData(),
-                                            NULL, 0, &error);
+    void ToxCore::setTyping(quint32 friend_id, bool typing)
+    {
+        post([friend_id, typing](Tox* tox) {
+            TOX_ERR_SET_TYPING error;
+            tox_self_set_typing(tox, friend_id, typing, &error);
+            if ( error != TOX_ERR_SET_TYPING_OK ) {
+                Utils::warn("Unable to set typing, friend not found"); // deleted meanwhile
+            }
+        });
+    }
 
-        Utils::handleToxFileSendError(error); // all critical and cause a bail
-        fActiveAvatarTransfers[friend_id] = file_number;
-        return true;
+    void ToxCore::addFriend(const QByteArray& address, const QByteArray& message)
+    {
+        post([this, address, message](Tox* tox) {
+            TOX_ERR_FRIEND_ADD error;
+            ToxEvent event;
+            event.type = teFriendAdded;
+            event.friendID = tox_friend_add(tox, (const uint8_t*) address.constData(), (const uint8_t*) message.constData(),
+                                            message.size(), &error);
+            event.value = error;
+            event.data = address.left(TOX_PUBLIC_KEY_SIZE);
+            fToxThread.push(event);
+        });
+    }
+
+    void ToxCore::addFriendNoRequest(const QByteArray& publicKey, const QString& name)
+    {
+        post([this, publicKey, name](Tox* tox) {
+            TOX_ERR_FRIEND_ADD error;
+            ToxEvent event;
+            event.type = teFriendAddedNoRequest;
+            event.friendID = tox_friend_add_norequest(tox, (const uint8_t*) publicKey.constData(), &error);
+            event.value = error;
+            event.text = name;
+            event.data = publicKey;
+            fToxThread.push(event);
+        });
+    }
+
+    void ToxCore::onFriendAdded(quint32 friend_id, const QByteArray& publicKey, const QString& offlineName, bool request, int error)
+    {
+        if ( error == TOX_ERR_FRIEND_ADD_OK ) {
+            saveNow();
+        }
+
+        emit friendAdded(friend_id, publicKey, offlineName, request, error);
+    }
+
+    void ToxCore::deleteFriend(quint32 friend_id)
+    {
+        post([friend_id](Tox* tox) {
+            TOX_ERR_FRIEND_DELETE error;
+            if ( !tox_friend_delete(tox, friend_id, &error) ) {
+                Utils::warn("Unable to delete friend: " + QString::number(error, 10));
+            }
+        });
+        saveNow(); // a deleted friend must not come back after a crash
+    }
+
+    void ToxCore::onSelfAddress(const QByteArray& address, quint32 noSpam)
+    {
+        fAddress = address;
+        fNoSpam = noSpam;
+        emit accountChanged();
+    }
+
+    void ToxCore::readSelf()
+    {
+        fAddress = QByteArray(TOX_ADDRESS_SIZE, 0);
+        tox_self_get_address(fTox, (uint8_t*) fAddress.data());
+        fNoSpam = tox_self_get_nospam(fTox);
+        fSecretKey = QByteArray(TOX_SECRET_KEY_SIZE, 0);
+        tox_self_get_secret_key(fTox, (uint8_t*) fSecretKey.data());
+
+        QByteArray rawName(tox_self_get_name_size(fTox), 0);
+        tox_self_get_name(fTox, (uint8_t*) rawName.data());
+        fUserName = QString::fromUtf8(rawName);
+
+        QByteArray rawMessage(tox_self_get_status_message_size(fTox), 0);
+        tox_self_get_status_message(fTox, (uint8_t*) rawMessage.data());
+        fStatusMessage = QString::fromUtf8(rawMessage);
+
+        fUserStatus = tox_self_get_status(fTox);
+        fConnectionStatus = tox_self_get_connection_status(fTox);
+
+        fFriends.clear();
+        QVector<uint32_t> friendIDs(tox_self_get_friend_list_size(fTox));
+        tox_self_get_friend_list(fTox, friendIDs.data());
+        foreach ( uint32_t friendID, friendIDs ) {
+            fFriends.append(Friend(fTox, friendID));
+        }
     }
 
-    void ToxCore::killTox()
+    void ToxCore::killTox(bool save)
     {
         if ( !fInitialized ) {
             Utils::fatal("Killtox called when not initialized");
         }
 
         fInitialized = false;
+        fSaveTimer.stop(); // changes since the last save die with the instance unless saved below
+        fSaveUrgent = false;
+        fSaveQueued = false;
+        fTransfers.clear(); // file numbers die with the instance
+        fAvatarOffers.clear();
+        fBootstrapper.fWorking = false;
+        fToxThread.stop(); // runs what was posted, no iteration may outlive the instance
+        fWakeupsTimer.stop();
+
+        fSaver.wait(); // an older snapshot must not land after this one
+        if ( save ) {
+            fSaver.write(getSaveData(fTox));
+        }
+        fSaveDirty = false;
+
+        sodium_memzero(fSecretKey.data(), fSecretKey.size());
+        fSecretKey.clear();
+        fFriends.clear();
         tox_kill(fTox);
         fTox = NULL;
     }
 
     void ToxCore::updateTransfers(quint32 friend_id, quint32 file_number, size_t length)
     {
-        quint64 transferID = Utils::transferID(friend_id, file_number);
-        if ( length > 0 && !fActiveTransfers.contains(transferID) ) { // started a new one
-            fActiveTransfers[transferID] = true;
-            if ( fActiveTransfers.size() == 1 ) { // we started first one
-                fIterationTimer.setInterval(getIterationInterval());
-            }
-        } else if ( length == 0 && fActiveTransfers.contains(transferID) ) { // finished
-            fActiveTransfers.remove(transferID);
-            if ( fActiveTransfers.size() == 0 ) { // we finished last one
-                fIterationTimer.setInterval(getIterationInterval());
-            }
+        Transfer* transfer = fTransfers.get(friend_id, file_number);
+        if ( transfer != NULL ) {
+            fTransfers.setRunning(transfer, length > 0); // zero length chunk means done
         }
     }
 
-    void ToxCore::sendAvatarChunk(quint32 friend_id, quint32 file_number, quint64 position, size_t length)
+    void ToxCore::onRunningTransfersChanged(int count)
     {
-        TOX_ERR_FILE_SEND_CHUNK error;
+        if ( count <= 1 ) { // first started or last finished
+            fToxThread.setMaxInterval(getIterationInterval());
+        }
+    }
 
+    void ToxCore::sendAvatarChunk(quint32 friend_id, quint32 file_number, quint64 position, size_t length)
+    {
         if ( length == 0 ) {
-            fActiveAvatarTransfers.remove(friend_id);
+            fTransfers.remove(fTransfers.get(friend_id, file_number));
             return; // done
         }
 
-        quint8* data = (quint8*) fProfileAvatarData.mid(position).constData();
-        tox_file_send_chunk(fTox, friend_id, file_number, position, data, length, &error);
-
-        const QString strError = Utils::handleFileSendChunkError(error);
-        if ( !strError.isEmpty() ) {
-            emit errorOccurred("Avatar transfer error");
-            return;
-        }
+        sendFileChunk(friend_id, file_number, position, fProfileAvatarData.mid(position, length)); // failures come back in onFileFailed
     }
 
     void ToxCore::httpRequestDone(QNetworkReply *reply) {       
@@ -897,13 +1360,14 @@ namespace JTOX {
         }
 
         qint64 currentSeconds = QDateTime::currentMSecsSinceEpoch() / 1000;
+        fProfile.setValue("tox/nodes", data);
         QSettings settings;
-        settings.setValue("tox/nodes", data);
         settings.setValue("app/lastnodesrequest", currentSeconds);
         fNodesRequest = NULL;
     }
 
     void ToxCore::bootstrappingDone(int count) {
+        fBootstrapper.fWorking = false;
         if ( count == 0 ) {
             emit errorOccurred("Bootstrap failed");
         }
@@ -927,16 +1391,23 @@ namespace JTOX {
 
         fTox = (Tox*) tox;
         fInitialized = true;
+        readSelf();
+        fSaver.wait();
+        fSaver.write(getSaveData(fTox)); // makes a new account stick right away, before the network thread owns the instance
 
         const QSettings settings;
         QJsonParseError parseError;
-        const QJsonDocument nodesDoc = QJsonDocument::fromJson(settings.value("tox/nodes", "invalid").toByteArray(), &parseError);
+        const QJsonDocument nodesDoc = QJsonDocument::fromJson(fProfile.value("tox/nodes"), &parseError);
         if ( parseError.error != QJsonParseError::NoError ) {
             Utils::fatal("Nodes parse error: " + parseError.errorString());
         }
         const QJsonObject nodesObject = nodesDoc.object();
         const QJsonArray nodes = nodesObject.value("nodes").toArray();
-        fBootstrapper.start(fTox, nodes);
+        fToxThread.setMaxInterval(getIterationInterval());
+        fToxThread.start(fTox);
+        fToxThread.takeWakeups();
+        fWakeupsTimer.start();
+        fBootstrapper.start(fToxThread, nodes);
 
         // we check for new json once a week
         bool ok = false;
@@ -951,8 +1422,10 @@ namespace JTOX {
             fNodesRequest = fNetManager.get(request);
         }
 
-        save();
-        fIterationTimer.start();
+        // background DB work needs the pass key, now it's known
+        fDBData.migrateRowBacklogAsync();
+        fDBData.indexSearchBacklogAsync();
+        emit initialUseChanged(false);
         emit busyChanged(false);
         emit clientReset();
         emit accountChanged();
@@ -29,34 +29,37 @@
 #include <QThread>
 #include <QTimer>
 #include <QMap>
+#include <QSet>
 #include <QFile>
 #include <tox/tox.h>
 #include "encryptsave.h"
 #include "dbdata.h"
+#include "transferregistry.h"
+#include "toxthread.h"
+#include "profilestore.h"
+#include "friend.h"
 
 namespace JTOX {
 
-    class Bootstrapper : public QThread
+    // tox_bootstrap needs the instance, so it runs as a command on the network thread
+    class Bootstrapper : public QObject
     {
         Q_OBJECT
     public:
         Bootstrapper();
-        void run();
-        void start(Tox* tox, const QJsonArray& nodes);
+        void start(ToxThread& thread, const QJsonArray& nodes);
         bool fWorking;
     signals:
-        void resultReady(int count);
+        void resultReady(int count) const;
     private:
-        Tox* fTox;
-        QJsonArray fNodes;
-        int bootstrapNodes(int maxNodes);
+        int bootstrapNodes(Tox* tox, const QJsonArray& allNodes, int maxNodes) const;
     };
 
     class PasswordValidator : public QThread
     {
         Q_OBJECT
     public:
-        PasswordValidator(EncryptSave& encryptSave);
+        PasswordValidator(EncryptSave& encryptSave, ProfileStore& profile);
         void run();
         void start(const QString& password);
         bool fWorking;
@@ -64,14 +67,32 @@ namespace JTOX {
         void resultReady(bool valid);
     private:
         EncryptSave& fEncryptSave;
+        ProfileStore& fProfile;
         QString fPassword;
     };
 
+    // encrypts and stores savedata snapshots off the GUI thread, one at a time
+    class ProfileSaver : public QThread
+    {
+        Q_OBJECT
+    public:
+        ProfileSaver(EncryptSave& encryptSave, ProfileStore& profile);
+        void run();
+        void start(const QByteArray& saveData);
+        void write(const QByteArray& saveData) const; // on the calling thread
+    signals:
+        void resultReady() const;
+    private:
+        EncryptSave& fEncryptSave;
+        ProfileStore& fProfile;
+        QByteArray fSaveData;
+    };
+
     class ToxInitializer : public QThread
     {
         Q_OBJECT
     public:
-        ToxInitializer(EncryptSave& encryptSave);
+        ToxInitializer(EncryptSave& encryptSave, ProfileStore& profile);
         void run();
         void start(bool initialUse, const QString& password);
         bool fWorking;
@@ -79,6 +100,7 @@ namespace JTOX {
         void resultReady(void* tox, const QString& error);
     private:
         EncryptSave& fEncryptSave;
+        ProfileStore& fProfile;
         bool fInitialUse;
         QString fPassword;
         bool handleToxNewError(TOX_ERR_NEW error) const;
@@ -101,11 +123,30 @@ namespace JTOX {
         Q_PROPERTY(bool initialUse READ getInitialUse NOTIFY initialUseChanged)
         Q_PROPERTY(bool passwordValid READ getPasswordValid NOTIFY passwordValidChanged)
         Q_PROPERTY(bool initialized READ getInitialized NOTIFY clientReset)
+        Q_PROPERTY(int uploadLimit READ getUploadLimit WRITE setUploadLimit NOTIFY uploadLimitChanged) // KiB/s, 0 for none
+        Q_PROPERTY(int downloadLimit READ getDownloadLimit WRITE setDownloadLimit NOTIFY downloadLimitChanged)
+        Q_PROPERTY(int wakeupsPerMinute READ getWakeupsPerMinute NOTIFY wakeupsPerMinuteChanged)
     public:
         ToxCore(EncryptSave& encryptSave, DBData& dbData);
         virtual ~ToxCore();
 
-        Tox* tox();
+        TransferRegistry& transfers();
+        const FriendList& friends() const; // as loaded with the profile, FriendModel keeps its copy current
+        void holdTransfer(Transfer* transfer, TransferHold reason); // pauses in tox on the first hold
+        void releaseTransfer(Transfer* transfer, TransferHold reason); // resumes once no holds or user pause remain
+
+        // tox calls from the GUI thread run as commands on the network thread,
+        // results come back as signals in order with the callbacks
+        void sendMessage(quint32 friend_id, int eventID, const QByteArray& message); // result in messageSent
+        void sendFile(quint32 friend_id, int eventID, const QString& file_path, const QByteArray& file_id); // result in fileSent
+        bool sendAvatar(quint32 friend_id, const QByteArray& hash, const QByteArray& data);
+        void sendFileChunk(quint32 friend_id, quint32 file_number, quint64 position, const QByteArray& chunk); // fileFailed if refused
+        void seekFile(quint32 friend_id, quint32 file_number, quint64 position, bool resume); // fileFailed if refused
+        void fileControl(quint32 friend_id, quint32 file_number, TOX_FILE_CONTROL control); // errors only warn, tox reports gone ones itself
+        void setTyping(quint32 friend_id, bool typing);
+        void addFriend(const QByteArray& address, const QByteArray& message); // result in friendAdded
+        void addFriendNoRequest(const QByteArray& publicKey, const QString& name); // result in friendAdded
+        void deleteFriend(quint32 friend_id);
         void setConnectionStatus();
         void onFriendRequest(const QString& hexKey, const QString& message);
         void onMessageReceived(quint32 friend_id, TOX_MESSAGE_TYPE type, const QString& message);
@@ -116,12 +157,12 @@ namespace JTOX {
         void onFriendStatusMsgChanged(quint32 friend_id, const QString& statusMessage);
         void onFriendNameChanged(quint32 friend_id, const QString& name);
         void onFriendTypingChanged(quint32 friend_id, bool typing) const;
-        void onFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QString& file_name) const;
+        void onFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QString& file_name, const QByteArray& fileID) const;
         void onAvatarFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QByteArray& fileID) const;
         void onFileCanceled(quint32 friend_id, quint32 file_number);
         void onFilePaused(quint32 friend_id, quint32 file_number) const;
         void onFileResumed(quint32 friend_id, quint32 file_number) const;
-        void onFileChunkReceived(quint32 friend_id, quint32 file_number, quint64 position, const quint8* data, size_t length);
+        void onFileChunkReceived(quint32 friend_id, quint32 file_number, quint64 position, const QByteArray& data);
         void onFileChunkRequest(quint32 friend_id, quint32 file_number, quint64 position, size_t length);
 
         bool getBusy() const;
@@ -132,9 +173,8 @@ namespace JTOX {
         const QString getHexPublicKey() const;
         const QString getHexToxID() const;
         const QByteArray hash(const QByteArray& data) const;
-        void save();
-        quint32 sendFile(quint32 friend_id, const QString& file_path, QByteArray& file_id);
-        bool sendAvatar(quint32 friend_id, const QByteArray& hash, const QByteArray& data);
+        void save(); // marks savedata dirty, written in the background within SAVE_DELAY
+        void saveNow(); // for account critical changes, snapshot right behind the change, written in the background
 
         Q_INVOKABLE void init(const QString& password);
         Q_INVOKABLE bool setNoSpam(const QString& hexVal); // we need to knox if the value is ok
@@ -166,8 +206,12 @@ namespace JTOX {
         void busyChanged(bool busy) const;
         void messageDelivered(quint32 friendID, quint32 messageID) const;
         void messageReceived(quint32 friendID, TOX_MESSAGE_TYPE type, const QString& message) const;
+        void messageSent(quint32 friendID, int eventID, quint32 sendID, int error) const; // TOX_ERR_FRIEND_SEND_MESSAGE
+        void fileSent(quint32 friend_id, quint32 file_number, int eventID, int error) const; // TOX_ERR_FILE_SEND
+        void fileFailed(quint32 friend_id, quint32 file_number, const QString& error) const; // canceled in tox already
+        void friendAdded(quint32 friend_id, const QByteArray& publicKey, const QString& offlineName, bool request, int error) const; // TOX_ERR_FRIEND_ADD
         void avatarFileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QByteArray& fileID) const;
-        void fileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QString& file_name) const;
+        void fileReceived(quint32 friend_id, quint32 file_number, quint64 file_size, const QString& file_name, const QByteArray& fileID) const;
         void fileCanceled(quint32 friend_id, quint32 file_number) const;
         void filePaused(quint32 friend_id, quint32 file_number) const;
         void fileResumed(quint32 friend_id, quint32 file_number) const;
@@ -179,31 +223,60 @@ namespace JTOX {
         void accountCreated() const;
         void errorOccurred(const QString& error) const;
         void logsWiped() const;
+        void applicationActiveChanged(bool active) const;
+        void uploadLimitChanged(int limit) const;
+        void downloadLimitChanged(int limit) const;
+        void wakeupsPerMinuteChanged(int wakeups) const;
     private slots:
         void httpRequestDone(QNetworkReply *reply);
         void bootstrappingDone(int count);
         void passwordValidationDone(bool valid);
         void toxInitDone(void* tox, const QString& error);
-        void iterate();
+        void savingDone();
+        void saveTimeout();
+        void onToxEvents();
         void awayTimeout();
+        void rateTimeout();
+        void wakeupsTimeout();
     private:
         EncryptSave& fEncryptSave;
         DBData& fDBData;
+        ProfileStore fProfile;
         Tox* fTox;
         Bootstrapper fBootstrapper;
         ToxInitializer fInitializer;
         PasswordValidator fPasswordValidator;
+        ProfileSaver fSaver;
         QNetworkAccessManager fNetManager;
         QNetworkReply* fNodesRequest;
-        QTimer fIterationTimer;
+        ToxThread fToxThread; // the only user of fTox while running
         QTimer fAwayTimer;
+        QTimer fRateTimer;
+        QTimer fWakeupsTimer;
+        QTimer fSaveTimer;
         int fAwayStatus;
         bool fPasswordValid;
         bool fInitialized;
         bool fApplicationActive;
-        QMap<quint64, bool> fActiveTransfers;
+        int fWakeupsPerMinute;
+        bool fSaveDirty;
+        bool fSaveUrgent; // dirty from saveNow, written right after the save in flight
+        bool fSaveQueued; // snapshot requested and until written
+        TransferRegistry fTransfers;
+        RateLimiter fUploadLimiter;
+        RateLimiter fDownloadLimiter;
         QByteArray fProfileAvatarData;
-        QMap<quint32, quint32> fActiveAvatarTransfers; // friend_id -> file_number
+        QByteArray fProfileAvatarHash;
+        QSet<quint32> fAvatarOffers; // friends with an avatar tox_file_send in flight
+        // own state cached for the GUI thread, read at init and kept current by our setters and callbacks
+        QByteArray fAddress;
+        quint32 fNoSpam;
+        QByteArray fSecretKey;
+        QString fUserName;
+        QString fStatusMessage;
+        TOX_USER_STATUS fUserStatus;
+        TOX_CONNECTION fConnectionStatus;
+        FriendList fFriends;
 
         quint32 getMajorVersion() const;
         quint32 getMinorVersion() const;
@@ -217,14 +290,31 @@ namespace JTOX {
         void setStatusMessage(const QString& sm);
         const QString getUserName() const;
         void setUserName(const QString& uname);
+        int getUploadLimit() const;
+        void setUploadLimit(int limit);
+        int getDownloadLimit() const;
+        void setDownloadLimit(int limit);
+        int getWakeupsPerMinute() const;
         bool getKeepLogs() const;
         void setKeepLogs(bool keep);
         const QByteArray getDefaultNodes() const;
         int getIterationInterval() const;
         void awayRestore();
         void awayStart();
-        void killTox();
+        void killTox(bool save); // saves synchronously once the network thread is done
+        void readSelf(); // fills the cached state, only while the network thread is stopped
+        void post(const ToxCommand& command);
+        void failFile(Tox* tox, quint32 friend_id, quint32 file_number, const QString& error); // network thread, cancels and reports
+        const QByteArray getSaveData(const Tox* tox) const; // network thread, or while it's stopped
+        void onSaveData(const QByteArray& saveData);
+        void onSelfAddress(const QByteArray& address, quint32 noSpam);
+        void onAvatarSent(quint32 friend_id, quint32 file_number, const QByteArray& hash, int error);
+        void onFileFailed(quint32 friend_id, quint32 file_number, const QString& error);
+        void onFriendAdded(quint32 friend_id, const QByteArray& publicKey, const QString& offlineName, bool request, int error);
+        void discardSave(); // before the stored profile gets replaced or removed
         void updateTransfers(quint32 friend_id, quint32 file_number, size_t length);
+        void onRunningTransfersChanged(int count);
+        void limitTransfer(quint32 friend_id, quint32 file_number, size_t length, RateLimiter& limiter);
         void sendAvatarChunk(quint32 friend_id, quint32 file_number, quint64 position, size_t length);
     };
 
@@ -0,0 +1,164 @@
+#include "toxthread.h"
+#include <QMutexLocker>
+
+namespace JTOX {
+
+    //******************************ToxThread******************************//
+
+    ToxThread::ToxThread() : QThread(0), fTox(NULL), fCommandMutex(), fWake(), fCommands(),
+        fStopping(false), fMaxInterval(0), fBackoff(0), fWakeups(0), fEvents(), fOverflowMutex(), fOverflow(), fOverflowing(false), fTaken(), fPushed(false), fNotified(0)
+    {
+    }
+
+    ToxThread::~ToxThread()
+    {
+        stop();
+    }
+
+    void ToxThread::run()
+    {
+        forever {
+            fCommandMutex.lock();
+            QQueue<ToxCommand> commands;
+            commands.swap(fCommands);
+            const bool stopping = fStopping;
+            bool busy = !commands.isEmpty();
+            fCommandMutex.unlock();
+
+            foreach ( const ToxCommand& command, commands ) {
+                command(fTox);
+            }
+
+            if ( stopping ) {
+                break; // what was posted is applied, e.g. the status before the last save
+            }
+
+            tox_iterate(fTox, this);
+            const int interval = tox_iteration_interval(fTox);
+            fWakeups.ref();
+
+            busy = busy || fPushed; // packets, typing and transfer chunks all come as events
+            notify();
+
+            fCommandMutex.lock();
+            if ( busy || fMaxInterval == 0 ) {
+                fBackoff = interval;
+            } else { // quiet, wait twice as long each time up to the ceiling
+                fBackoff = qMax(interval, qMin(fBackoff * 2, fMaxInterval));
+            }
+
+            if ( !fStopping && fCommands.isEmpty() ) {
+                fWake.wait(&fCommandMutex, fBackoff);
+            }
+            fCommandMutex.unlock();
+        }
+    }
+
+    void ToxThread::start(Tox* tox)
+    {
+        fTox = tox;
+        fStopping = false;
+        fBackoff = 0;
+        QThread::start();
+    }
+
+    void ToxThread::stop()
+    {
+        fCommandMutex.lock();
+        fStopping = true;
+        fWake.wakeAll();
+        fCommandMutex.unlock();
+
+        wait();
+        fCommands.clear(); // posted while not running, there's no instance to run them on
+
+        // callbacks of a dead instance mean nothing
+        ToxEvent event;
+        drained();
+        while ( pop(event) ) {}
+        fOverflowing = false;
+        fPushed = false;
+    }
+
+    void ToxThread::post(const ToxCommand& command)
+    {
+        QMutexLocker locker(&fCommandMutex);
+        fCommands.enqueue(command);
+        fWake.wakeOne();
+    }
+
+    void ToxThread::setMaxInterval(int msecs)
+    {
+        QMutexLocker locker(&fCommandMutex);
+        fMaxInterval = msecs;
+        if ( fBackoff > msecs ) {
+            fWake.wakeOne(); // a lower ceiling applies right away
+        }
+    }
+
+    int ToxThread::takeWakeups()
+    {
+        return fWakeups.fetchAndStoreRelaxed(0);
+    }
+
+    void ToxThread::push(const ToxEvent& event)
+    {
+        fPushed = true;
+
+        // once spilled, stay on the overflow list until the GUI side took it, keeps callback order
+        if ( fOverflowing ) {
+            QMutexLocker locker(&fOverflowMutex);
+            if ( !fOverflow.isEmpty() ) {
+                fOverflow.append(event);
+                return;
+            }
+            fOverflowing = false;
+        }
+
+        if ( !fEvents.push(event) ) { // GUI is behind, never wait on it with the instance locked
+            QMutexLocker locker(&fOverflowMutex);
+            fOverflow.append(event);
+            fOverflowing = true;
+        }
+    }
+
+    bool ToxThread::pop(ToxEvent& event)
+    {
+        if ( !fTaken.isEmpty() ) {
+            event = fTaken.takeFirst();
+            return true;
+        }
+
+        if ( fEvents.pop(event) ) {
+            return true;
+        }
+
+        // the ring is empty, anything spilled is newer than what it held
+        QMutexLocker locker(&fOverflowMutex);
+        if ( fOverflow.isEmpty() ) {
+            return false;
+        }
+
+        fTaken.swap(fOverflow);
+        event = fTaken.takeFirst();
+        return true;
+    }
+
+    void ToxThread::drained()
+    {
+        fNotified.storeRelease(0);
+    }
+
+    void ToxThread::notify()
+    {
+        if ( !fPushed ) {
+            return;
+        }
+
+        fPushed = false;
+        if ( fNotified.testAndSetOrdered(0, 1) ) {
+            emit eventsReady();
+        }
+    }
+
+}
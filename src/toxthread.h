@@ -0,0 +1,144 @@
+#ifndef TOXTHREAD_H
+#define TOXTHREAD_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QList>
+#include <QAtomicInt>
+#include <tox/tox.h>
+#include <functional>
+
+namespace JTOX {
+
+    typedef std::function<void(Tox* tox)> ToxCommand; // runs on the network thread
+
+    enum ToxEventType {
+        teSelfConnectionStatus = 0,
+        teFriendRequest,
+        teFriendMessage,
+        teFriendConnectionStatus,
+        teFriendName,
+        teFriendStatus,
+        teFriendStatusMessage,
+        teFriendTyping,
+        teFriendReadReceipt,
+        teFileControl,
+        teFileReceived,
+        teAvatarReceived,
+        teFileChunk,
+        teFileChunkRequest,
+        // results of posted commands, queued behind the callbacks before them
+        teMessageSent,
+        teFileSent,
+        teAvatarSent,
+        teFileFailed,
+        teFriendAdded,
+        teFriendAddedNoRequest,
+        teSelfAddress,
+        teSaveData
+    };
+
+    // a tox callback or command result as data, filled on the network thread and handled on the GUI thread
+    struct ToxEvent
+    {
+        ToxEvent() : type(teSelfConnectionStatus), friendID(0), number(0), position(0), length(0), value(0), tag(0), text(), data() {} // copied whole through the queue, callbacks set only what they use
+
+        ToxEventType type;
+        quint32 friendID;
+        quint32 number; // file number or message id
+        quint64 position; // chunk position or file size
+        quint64 length; // requested chunk length
+        int value; // status, control, message type, typing or command error
+        int tag; // DB event a command result belongs to
+        QString text; // name, message, file name or error
+        QByteArray data; // chunk, public key, file id, address or savedata
+    };
+
+    // lock-free ring for exactly one producer and one consumer thread
+    template <typename T, int Size>
+    class SpscQueue
+    {
+    public:
+        SpscQueue() : fHead(0), fTail(0) {}
+
+        bool push(const T& item) // producer only, false when full
+        {
+            const int tail = fTail.loadAcquire();
+            const int next = (tail + 1) & (Size - 1);
+            if ( next == fHead.loadAcquire() ) {
+                return false;
+            }
+
+            fItems[tail] = item;
+            fTail.storeRelease(next);
+            return true;
+        }
+
+        bool pop(T& item) // consumer only, false when empty
+        {
+            const int head = fHead.loadAcquire();
+            if ( head == fTail.loadAcquire() ) {
+                return false;
+            }
+
+            item = fItems[head];
+            fItems[head] = T(); // don't keep payloads alive in the ring
+            fHead.storeRelease((head + 1) & (Size - 1));
+            return true;
+        }
+    private:
+        Q_STATIC_ASSERT((Size & (Size - 1)) == 0);
+        T fItems[Size];
+        QAtomicInt fHead; // next to pop, moved by the consumer
+        QAtomicInt fTail; // next to push, moved by the producer
+    };
+
+    // owns the Tox instance while running, callbacks only queue events so handlers never run inside
+    // an iteration and other threads only reach the instance through commands run between iterations.
+    // Iterations follow tox_iteration_interval while anything happens and back off
+    // exponentially up to the max interval while quiet.
+    class ToxThread : public QThread
+    {
+        Q_OBJECT
+    public:
+        ToxThread();
+        virtual ~ToxThread();
+        void run();
+        void start(Tox* tox);
+        void stop(); // blocks, posted commands still run, unhandled events are dropped
+        void post(const ToxCommand& command); // iterates right after as the command may have queued packets
+        void setMaxInterval(int msecs); // backoff ceiling, 0 to never back off
+        int takeWakeups(); // iterations since the last call
+        void push(const ToxEvent& event); // network thread only, from the callbacks and commands
+        bool pop(ToxEvent& event); // GUI thread only, in callback order
+        void drained(); // GUI thread, call before popping so new events post eventsReady again
+    signals:
+        void eventsReady() const; // once per batch, queued to the GUI thread
+    private:
+        Tox* fTox;
+        QMutex fCommandMutex;
+        QWaitCondition fWake;
+        QQueue<ToxCommand> fCommands;
+        bool fStopping;
+        int fMaxInterval;
+        int fBackoff; // current wait between quiet iterations
+        QAtomicInt fWakeups;
+        SpscQueue<ToxEvent, 1024> fEvents;
+        QMutex fOverflowMutex;
+        QList<ToxEvent> fOverflow; // used only while the ring is full, keeps order
+        bool fOverflowing; // network thread side
+        QList<ToxEvent> fTaken; // GUI side copy of the overflow
+        bool fPushed; // network thread side, events since the last notification
+        QAtomicInt fNotified;
+
+        void notify();
+    };
+
+}
+
+#endif // TOXTHREAD_H
@@ -0,0 +1,518 @@
+#include "transferregistry.h"
+#include "utils.h"
+#include <fcntl.h>
+
+namespace JTOX {
+
+    const quint64 SMALL_TRANSFER_SIZE = 1024 * 1024; // files up to this size are never queued
+    const int MAX_BULK_PER_FRIEND = 1; // concurrent large transfers with one friend
+    const int MAX_BULK_TOTAL = 3; // concurrent large transfers overall
+    const quint64 MAP_WINDOW_SIZE = 4 * 1024 * 1024; // mapped at once for outgoing files, small enough for 32bit address space
+    const quint64 MAP_WHOLE_SIZE = 64 * 1024 * 1024; // outgoing files up to this size are mapped whole and shared
+    const qint64 THROUGHPUT_WINDOW = 5000; // ms of samples the throughput is averaged over
+
+    //******************************TransferSource******************************//
+
+    TransferSource::TransferSource(const QString& path) : fFile(path), fMap(NULL), fMapSize(0), fRefs(0)
+    {
+    }
+
+    TransferSource::~TransferSource()
+    {
+        fFile.close(); // unmaps too
+    }
+
+    QFile* TransferSource::file()
+    {
+        if ( !fFile.isOpen() ) {
+            if ( !fFile.open(QIODevice::ReadOnly) ) {
+                Utils::warn("Error opening file: " + fFile.errorString());
+                return NULL;
+            }
+
+            // outgoing files are read front to back, let the kernel read ahead
+            posix_fadvise(fFile.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+            const quint64 size = fFile.size();
+            if ( size > 0 && size <= MAP_WHOLE_SIZE ) {
+                fMap = fFile.map(0, size);
+                fMapSize = fMap != NULL ? size : 0;
+            }
+        }
+
+        return &fFile;
+    }
+
+    const quint8* TransferSource::map() const
+    {
+        return fMap;
+    }
+
+    quint64 TransferSource::mapSize() const
+    {
+        return fMapSize;
+    }
+
+    //******************************Transfer******************************//
+
+    Transfer::Transfer(TransferKind kind, quint32 friendID, quint32 fileNumber, quint64 size) :
+        fKind(kind), fFriendID(friendID), fFileNumber(fileNumber), fEventID(-1), fEventType(etFileTransferIn),
+        fFilePath(), fFileID(), fSize(size), fPosition(0), fPausers(0), fRunning(false), fHolds(0), fQueued(false), fScheduled(false), fCheckpointAt(0),
+        fData(), fRegistry(NULL), fSource(NULL), fMap(NULL), fMapOffset(0), fMapSize(0),
+        fHash(QCryptographicHash::Sha256), fHashed(0), fHashBroken(false), fSamples(), fProgressAt(0), fStalled(false)
+    {
+    }
+
+    Transfer::~Transfer()
+    {
+        if ( fSource != NULL ) {
+            if ( fMap != NULL ) {
+                fSource->file()->unmap(fMap);
+            }
+            fRegistry->releaseSource(fSource);
+        }
+    }
+
+    quint64 Transfer::id() const
+    {
+        return Utils::transferID(fFriendID, fFileNumber);
+    }
+
+    TransferKind Transfer::kind() const
+    {
+        return fKind;
+    }
+
+    quint32 Transfer::friendID() const
+    {
+        return fFriendID;
+    }
+
+    quint32 Transfer::fileNumber() const
+    {
+        return fFileNumber;
+    }
+
+    int Transfer::eventID() const
+    {
+        return fEventID;
+    }
+
+    EventType Transfer::eventType() const
+    {
+        return fEventType;
+    }
+
+    const QString Transfer::filePath() const
+    {
+        return fFilePath;
+    }
+
+    const QByteArray Transfer::fileID() const
+    {
+        return fFileID;
+    }
+
+    quint64 Transfer::size() const
+    {
+        return fSize;
+    }
+
+    quint64 Transfer::position() const
+    {
+        return fPosition;
+    }
+
+    int Transfer::pausers() const
+    {
+        return fPausers;
+    }
+
+    bool Transfer::isIncoming() const
+    {
+        if ( fKind != tkFile ) {
+            return fKind == tkAvatarIn;
+        }
+
+        switch ( fEventType ) {
+            case etFileTransferIn:
+            case etFileTransferInCanceled:
+            case etFileTransferInPaused:
+            case etFileTransferInRunning:
+            case etFileTransferInDone: return true;
+            default: return false;
+        }
+    }
+
+    bool Transfer::running() const
+    {
+        return fRunning;
+    }
+
+    int Transfer::holds() const
+    {
+        return fHolds;
+    }
+
+    bool Transfer::queued() const
+    {
+        return fQueued;
+    }
+
+    bool Transfer::isBulk() const
+    {
+        return fKind == tkFile && fSize > SMALL_TRANSFER_SIZE; // includes unknown size streams
+    }
+
+    qint64 Transfer::checkpointAt() const
+    {
+        return fCheckpointAt;
+    }
+
+    QByteArray& Transfer::data()
+    {
+        return fData;
+    }
+
+    QFile* Transfer::file()
+    {
+        if ( fSource == NULL ) {
+            fSource = fRegistry->acquireSource(fFilePath);
+        }
+
+        return fSource->file();
+    }
+
+    const quint8* Transfer::mapChunk(quint64 position, size_t length)
+    {
+        QFile* file = this->file();
+        if ( file == NULL || position + length > fSize ) {
+            return NULL;
+        }
+
+        if ( fSource->map() != NULL ) { // all uploads of this file read the same pages
+            return position + length <= fSource->mapSize() ? fSource->map() + position : NULL;
+        }
+
+        if ( fMap == NULL || position < fMapOffset || position + length > fMapOffset + fMapSize ) {
+            if ( fMap != NULL ) {
+                file->unmap(fMap);
+                fMap = NULL;
+            }
+
+            const quint64 size = qMin(MAP_WINDOW_SIZE, fSize - position);
+            if ( size < length ) {
+                return NULL;
+            }
+
+            fMap = file->map(position, size);
+            if ( fMap == NULL ) {
+                return NULL; // e.g. filesystems without mmap, caller reads instead
+            }
+            fMapOffset = position;
+            fMapSize = size;
+        }
+
+        return fMap + (position - fMapOffset);
+    }
+
+    void Transfer::hashChunk(quint64 position, const quint8* chunk, size_t length)
+    {
+        if ( fHashBroken || position < fHashed ) {
+            return; // re-requested chunk, already in
+        }
+
+        if ( position > fHashed ) {
+            fHashBroken = true;
+            return;
+        }
+
+        fHash.addData((const char*) chunk, length);
+        fHashed += length;
+    }
+
+    const QByteArray Transfer::digest() const
+    {
+        if ( fHashBroken || fHashed != fSize ) {
+            return QByteArray();
+        }
+
+        return fHash.result();
+    }
+
+    quint64 Transfer::throughput() const
+    {
+        if ( fSamples.size() < 2 ) {
+            return 0;
+        }
+
+        const QPair<qint64, quint64>& first = fSamples.first();
+        const QPair<qint64, quint64>& last = fSamples.last();
+        if ( last.first <= first.first || last.second < first.second ) {
+            return 0;
+        }
+
+        return (last.second - first.second) * 1000 / (last.first - first.first);
+    }
+
+    qint64 Transfer::eta() const
+    {
+        const quint64 speed = throughput();
+        if ( speed == 0 || fPosition > fSize ) {
+            return -1;
+        }
+
+        return (fSize - fPosition) / speed;
+    }
+
+    qint64 Transfer::progressAt() const
+    {
+        return fProgressAt;
+    }
+
+    bool Transfer::stalled() const
+    {
+        return fStalled;
+    }
+
+    void Transfer::setEvent(int eventID, EventType eventType, const QString& filePath)
+    {
+        fEventID = eventID;
+        fEventType = eventType;
+        fFilePath = filePath;
+    }
+
+    void Transfer::setEventType(EventType eventType)
+    {
+        fEventType = eventType;
+    }
+
+    void Transfer::setFileID(const QByteArray& fileID)
+    {
+        fFileID = fileID;
+    }
+
+    void Transfer::setPosition(quint64 position)
+    {
+        fPosition = position;
+    }
+
+    void Transfer::setPausers(int pausers)
+    {
+        fPausers = pausers;
+    }
+
+    void Transfer::setHolds(int holds)
+    {
+        fHolds = holds;
+    }
+
+    void Transfer::setCheckpointAt(qint64 msecs)
+    {
+        fCheckpointAt = msecs;
+    }
+
+    void Transfer::sample(qint64 msecs)
+    {
+        if ( fSamples.isEmpty() || fSamples.last().second != fPosition ) {
+            fProgressAt = msecs;
+            fStalled = false;
+        }
+
+        fSamples.append(qMakePair(msecs, fPosition));
+        while ( fSamples.size() > 2 && msecs - fSamples.first().first > THROUGHPUT_WINDOW ) {
+            fSamples.removeFirst();
+        }
+    }
+
+    void Transfer::resetSamples(qint64 msecs)
+    {
+        fSamples.clear();
+        fProgressAt = msecs;
+    }
+
+    void Transfer::setStalled(bool stalled)
+    {
+        fStalled = stalled;
+    }
+
+    //**************************TransferRegistry**************************//
+
+    TransferRegistry::TransferRegistry() : QObject(0), fTransfers(), fQueue(), fRunningCount(0)
+    {
+    }
+
+    TransferRegistry::~TransferRegistry()
+    {
+        qDeleteAll(fTransfers);
+    }
+
+    Transfer* TransferRegistry::add(TransferKind kind, quint32 friendID, quint32 fileNumber, quint64 size)
+    {
+        Transfer* stale = get(friendID, fileNumber);
+        if ( stale != NULL ) { // file numbers get reused by toxcore
+            remove(stale);
+        }
+
+        Transfer* transfer = new Transfer(kind, friendID, fileNumber, size);
+        transfer->fRegistry = this;
+        fTransfers[transfer->id()] = transfer;
+        return transfer;
+    }
+
+    Transfer* TransferRegistry::get(quint32 friendID, quint32 fileNumber) const
+    {
+        return fTransfers.value(Utils::transferID(friendID, fileNumber), NULL);
+    }
+
+    Transfer* TransferRegistry::getByEvent(int eventID) const
+    {
+        foreach ( Transfer* transfer, fTransfers ) {
+            if ( transfer->eventID() == eventID ) {
+                return transfer;
+            }
+        }
+
+        return NULL;
+    }
+
+    Transfer* TransferRegistry::getAvatarOut(quint32 friendID) const
+    {
+        foreach ( Transfer* transfer, fTransfers ) {
+            if ( transfer->kind() == tkAvatarOut && transfer->friendID() == friendID ) {
+                return transfer;
+            }
+        }
+
+        return NULL;
+    }
+
+    const TransferList TransferRegistry::list() const
+    {
+        return fTransfers.values();
+    }
+
+    const TransferList TransferRegistry::list(TransferKind kind) const
+    {
+        TransferList result;
+        foreach ( Transfer* transfer, fTransfers ) {
+            if ( transfer->kind() == kind ) {
+                result << transfer;
+            }
+        }
+
+        return result;
+    }
+
+    void TransferRegistry::setRunning(Transfer* transfer, bool running)
+    {
+        if ( transfer->fRunning == running ) {
+            return;
+        }
+
+        transfer->fRunning = running;
+        fRunningCount += running ? 1 : -1;
+        emit runningCountChanged(fRunningCount);
+    }
+
+    int TransferRegistry::runningCount() const
+    {
+        return fRunningCount;
+    }
+
+    bool TransferRegistry::admit(Transfer* transfer)
+    {
+        if ( transfer->fScheduled || !transfer->isBulk() ) {
+            return true; // small files and avatars go ahead of bulk data
+        }
+
+        if ( bulkCount(transfer->friendID()) < MAX_BULK_PER_FRIEND && bulkCount(-1) < MAX_BULK_TOTAL ) {
+            transfer->fScheduled = true;
+            return true;
+        }
+
+        if ( !transfer->fQueued ) {
+            transfer->fQueued = true;
+            fQueue.append(transfer);
+        }
+        return false;
+    }
+
+    void TransferRegistry::remove(Transfer* transfer)
+    {
+        setRunning(transfer, false);
+        fTransfers.remove(transfer->id());
+        fQueue.removeOne(transfer);
+        bool freedSlot = transfer->fScheduled;
+        delete transfer;
+
+        if ( freedSlot ) {
+            schedule();
+        }
+    }
+
+    void TransferRegistry::clear()
+    {
+        fQueue.clear(); // nothing gets admitted while tearing down
+        foreach ( Transfer* transfer, fTransfers.values() ) {
+            remove(transfer);
+        }
+    }
+
+    TransferSource* TransferRegistry::acquireSource(const QString& path)
+    {
+        TransferSource* source = fSources.value(path, NULL);
+        if ( source == NULL ) {
+            source = new TransferSource(path);
+            fSources[path] = source;
+        }
+
+        source->fRefs++;
+        return source;
+    }
+
+    void TransferRegistry::releaseSource(TransferSource* source)
+    {
+        if ( --source->fRefs > 0 ) {
+            return;
+        }
+
+        fSources.remove(fSources.key(source));
+        delete source;
+    }
+
+    int TransferRegistry::bulkCount(qint64 friendID) const
+    {
+        int count = 0;
+        foreach ( Transfer* transfer, fTransfers ) {
+            if ( transfer->fScheduled && (friendID < 0 || transfer->friendID() == friendID) ) {
+                count++;
+            }
+        }
+
+        return count;
+    }
+
+    void TransferRegistry::schedule()
+    {
+        // one at a time, handlers of admitted() may remove transfers
+        forever {
+            Transfer* next = NULL;
+            foreach ( Transfer* transfer, fQueue ) { // smallest first, oldest among equals
+                if ( bulkCount(transfer->friendID()) < MAX_BULK_PER_FRIEND && (next == NULL || transfer->size() < next->size()) ) {
+                    next = transfer;
+                }
+            }
+
+            if ( next == NULL || bulkCount(-1) >= MAX_BULK_TOTAL ) {
+                return;
+            }
+
+            fQueue.removeOne(next);
+            next->fQueued = false;
+            next->fScheduled = true;
+            emit admitted(next);
+        }
+    }
+
+}
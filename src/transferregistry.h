@@ -0,0 +1,167 @@
+#ifndef TRANSFERREGISTRY_H
+#define TRANSFERREGISTRY_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QFile>
+#include <QMap>
+#include <QList>
+#include <QPair>
+#include <QElapsedTimer>
+#include <QCryptographicHash>
+#include "event.h"
+#include "ratelimiter.h"
+
+namespace JTOX {
+
+    enum TransferKind {
+        tkFile = 0,
+        tkAvatarIn,
+        tkAvatarOut
+    };
+
+    // reasons we keep a transfer paused in tox on our own, apart from the user's pause bit
+    enum TransferHold {
+        thBackpressure = 0x1,
+        thQueued = 0x2,
+        thRate = 0x4,
+        thStall = 0x8 // paused for a moment to get a stalled transfer going again
+    };
+
+    class TransferRegistry;
+
+    // outgoing file opened once for all uploads of it, mapped whole when it fits
+    class TransferSource
+    {
+    public:
+        TransferSource(const QString& path);
+        ~TransferSource();
+        QFile* file(); // opened on first use, NULL on error
+        const quint8* map() const; // whole file, NULL if too big or not mappable
+        quint64 mapSize() const;
+    private:
+        Q_DISABLE_COPY(TransferSource)
+        friend class TransferRegistry;
+
+        QFile fFile;
+        uchar* fMap;
+        quint64 fMapSize;
+        int fRefs;
+    };
+
+    // in memory state of an active transfer, the DB event is only written on state changes and checkpoints
+    class Transfer
+    {
+    public:
+        Transfer(TransferKind kind, quint32 friendID, quint32 fileNumber, quint64 size);
+        ~Transfer();
+        quint64 id() const;
+        TransferKind kind() const;
+        quint32 friendID() const;
+        quint32 fileNumber() const;
+        int eventID() const;
+        EventType eventType() const;
+        const QString filePath() const;
+        const QByteArray fileID() const;
+        quint64 size() const;
+        quint64 position() const;
+        int pausers() const;
+        bool isIncoming() const;
+        bool running() const;
+        int holds() const; // TransferHold flags
+        bool queued() const; // waiting for the scheduler
+        bool isBulk() const; // large file, limited by the scheduler
+        qint64 checkpointAt() const;
+        QByteArray& data(); // avatar buffer
+        QFile* file(); // outgoing file, shared with other uploads of it, NULL on error
+        const quint8* mapChunk(quint64 position, size_t length); // outgoing chunk from a mapped window, NULL if not mappable
+        void hashChunk(quint64 position, const quint8* chunk, size_t length); // outgoing chunks as they are sent
+        quint64 throughput() const; // bytes per second over the sampling window
+        qint64 eta() const; // seconds left, -1 if unknown
+        qint64 progressAt() const; // msecs the position was last seen moving
+        bool stalled() const;
+        const QByteArray digest() const; // empty unless every byte went through hashChunk in order
+
+        void setEvent(int eventID, EventType eventType, const QString& filePath);
+        void setEventType(EventType eventType);
+        void setFileID(const QByteArray& fileID);
+        void setPosition(quint64 position);
+        void setPausers(int pausers);
+        void setHolds(int holds);
+        void setCheckpointAt(qint64 msecs);
+        void sample(qint64 msecs); // current position for throughput and progressAt
+        void resetSamples(qint64 msecs); // held on purpose, starts measuring over
+        void setStalled(bool stalled);
+    private:
+        Q_DISABLE_COPY(Transfer)
+        friend class TransferRegistry;
+
+        TransferKind fKind;
+        quint32 fFriendID;
+        quint32 fFileNumber;
+        int fEventID;
+        EventType fEventType;
+        QString fFilePath;
+        QByteArray fFileID;
+        quint64 fSize;
+        quint64 fPosition;
+        int fPausers;
+        bool fRunning;
+        int fHolds;
+        bool fQueued;
+        bool fScheduled; // holds a bulk slot
+        qint64 fCheckpointAt;
+        QByteArray fData;
+        TransferRegistry* fRegistry;
+        TransferSource* fSource;
+        uchar* fMap; // own window when the source isn't mapped whole
+        quint64 fMapOffset;
+        quint64 fMapSize;
+        QCryptographicHash fHash;
+        quint64 fHashed;
+        bool fHashBroken; // started past 0 or skipped ahead
+        QList<QPair<qint64, quint64>> fSamples; // msecs and position, oldest first
+        qint64 fProgressAt;
+        bool fStalled;
+    };
+
+    typedef QList<Transfer*> TransferList;
+
+    // all active file and avatar transfers keyed by Utils::transferID, owned here,
+    // large files are admitted a few at a time, small ones and avatars always
+    class TransferRegistry : public QObject
+    {
+        Q_OBJECT
+    public:
+        TransferRegistry();
+        virtual ~TransferRegistry();
+        Transfer* add(TransferKind kind, quint32 friendID, quint32 fileNumber, quint64 size); // replaces stale entry
+        Transfer* get(quint32 friendID, quint32 fileNumber) const; // NULL if not active
+        Transfer* getByEvent(int eventID) const;
+        Transfer* getAvatarOut(quint32 friendID) const;
+        const TransferList list() const;
+        const TransferList list(TransferKind kind) const;
+        bool admit(Transfer* transfer); // true if it may run now, otherwise queued until admitted()
+        void setRunning(Transfer* transfer, bool running);
+        int runningCount() const;
+        void remove(Transfer* transfer); // closes the file, pointer is invalid afterwards
+        void clear();
+        TransferSource* acquireSource(const QString& path);
+        void releaseSource(TransferSource* source);
+    signals:
+        void runningCountChanged(int count) const;
+        void admitted(Transfer* transfer) const;
+    private:
+        QMap<quint64, Transfer*> fTransfers;
+        TransferList fQueue; // in arrival order
+        QMap<QString, TransferSource*> fSources; // by path, refcounted by their transfers
+        int fRunningCount;
+
+        int bulkCount(qint64 friendID) const; // -1 for all
+        void schedule();
+    };
+
+}
+
+#endif // TRANSFERREGISTRY_H
@@ -18,6 +18,7 @@
 #include "utils.h"
 #include <QtGlobal>
 #include <QDebug>
+#include <QRegularExpression>
 #include <sodium/utils.h>
 
 #include <execinfo.h>
@@ -201,6 +202,25 @@ namespace JTOX {
         return result;
     }
 
+    const QStringList Utils::searchTokens(const QString& text)
+    {
+        static const QRegularExpression separators("[^\\p{L}\\p{N}]+", QRegularExpression::UseUnicodePropertiesOption);
+        QStringList result;
+
+        foreach ( const QString& word, text.toCaseFolded().split(separators, QString::SkipEmptyParts) ) {
+            if ( word.size() < 2 ) {
+                continue; // single letters only bloat the index
+            }
+
+            const QString token = word.left(32);
+            if ( !result.contains(token) ) {
+                result << token;
+            }
+        }
+
+        return result;
+    }
+
     const QString Utils::handleFileControlError(TOX_ERR_FILE_CONTROL error, bool soft)
     {
         switch ( error ) {
@@ -250,14 +270,14 @@ namespace JTOX {
         return fatal("Unknown error");
     }
 
-    const QString Utils::handleToxFileSendError(TOX_ERR_FILE_SEND error)
+    const QString Utils::handleToxFileSendError(TOX_ERR_FILE_SEND error, bool soft)
     {
         switch ( error ) {
-            case TOX_ERR_FILE_SEND_FRIEND_NOT_CONNECTED: return Utils::fatal("Cannot send file, friend not connected");
-            case TOX_ERR_FILE_SEND_FRIEND_NOT_FOUND: return Utils::fatal("Cannot send file, friend not found");
-            case TOX_ERR_FILE_SEND_NAME_TOO_LONG: return Utils::fatal("Cannot send file, name too long");
-            case TOX_ERR_FILE_SEND_NULL: return Utils::fatal("Cannot send file, unexpected null argument");
-            case TOX_ERR_FILE_SEND_TOO_MANY: return Utils::fatal("Cannot send file, too many concurrent transfers in progress");
+            case TOX_ERR_FILE_SEND_FRIEND_NOT_CONNECTED: return bail("Cannot send file, friend not connected", soft);
+            case TOX_ERR_FILE_SEND_FRIEND_NOT_FOUND: return bail("Cannot send file, friend not found", soft);
+            case TOX_ERR_FILE_SEND_NAME_TOO_LONG: return bail("Cannot send file, name too long", soft);
+            case TOX_ERR_FILE_SEND_NULL: return bail("Cannot send file, unexpected null argument", soft);
+            case TOX_ERR_FILE_SEND_TOO_MANY: return bail("Cannot send file, too many concurrent transfers in progress", soft);
             case TOX_ERR_FILE_SEND_OK: return QString();
         }
 
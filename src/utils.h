@@ -20,6 +20,7 @@
 
 #include <QList>
 #include <QString>
+#include <QStringList>
 #include <QByteArray>
 #include <stdint.h>
 #include <tox/tox.h>
@@ -49,10 +50,11 @@ namespace JTOX {
         static quint32 friendID(quint64 transferID);
         static quint32 fileNumber(quint64 transferID);
         static const StringListUTF8 splitStringUTF8(const QByteArray& source, int maxByteSize);
+        static const QStringList searchTokens(const QString& text); // case folded unique words
         static const QString handleFileControlError(TOX_ERR_FILE_CONTROL error, bool soft = false);
         static const QString handleFileSendChunkError(TOX_ERR_FILE_SEND_CHUNK error, bool soft = false);
         static const QString handleSendMessageError(TOX_ERR_FRIEND_SEND_MESSAGE error, bool soft);
-        static const QString handleToxFileSendError(TOX_ERR_FILE_SEND error);
+        static const QString handleToxFileSendError(TOX_ERR_FILE_SEND error, bool soft = false);
         static const QString handleToxNewError(TOX_ERR_NEW error);
     };
 
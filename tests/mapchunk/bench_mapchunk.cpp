@@ -0,0 +1,134 @@
+#include "transferregistry.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTemporaryFile>
+#include <string.h>
+#include <stdio.h>
+
+using namespace JTOX;
+
+namespace {
+
+    const size_t CHUNK_SIZE = 1371; // what toxcore 0.2 requests per file chunk
+    const qint64 SIZES[] = { 16 * 1024 * 1024, 96 * 1024 * 1024 }; // mapped whole, mapped in windows
+    const int SIZE_COUNT = 2;
+    const int PASSES = 3; // page cache is warm after the file is written, best pass counts
+
+    volatile int sink = 0; // keeps results alive so nothing gets optimized out
+    quint8 sent[CHUNK_SIZE]; // tox copies every chunk into its packet, both paths pay that
+
+    bool writeFile(QTemporaryFile& file, qint64 size)
+    {
+        if ( !file.open() ) {
+            return false;
+        }
+
+        QByteArray block(1024 * 1024, 0);
+        for ( int i = 0; i < block.size(); i++ ) {
+            block[i] = (char) i;
+        }
+
+        for ( qint64 written = 0; written < size; written += block.size() ) {
+            if ( file.write(block) != block.size() ) {
+                return false;
+            }
+        }
+
+        return file.flush();
+    }
+
+    // what onFileChunkRequest does when mapChunk gives up
+    double readPass(QFile& file, qint64 size)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        for ( quint64 position = 0; position < (quint64) size; position += CHUNK_SIZE ) {
+            const size_t length = qMin((quint64) CHUNK_SIZE, size - position);
+            if ( !file.seek(position) ) {
+                return -1;
+            }
+
+            const QByteArray buffer = file.read(length);
+            if ( (size_t) buffer.size() != length ) {
+                return -1;
+            }
+            memcpy(sent, buffer.constData(), length);
+            sink += sent[0];
+        }
+
+        return (double) timer.nsecsElapsed() / (size / CHUNK_SIZE);
+    }
+
+    double mapPass(TransferRegistry& registry, const QString& path, qint64 size)
+    {
+        // a fresh transfer each pass so window remaps are counted like in a real upload
+        Transfer* transfer = registry.add(tkFile, 0, 0, size);
+        transfer->setEvent(-1, etFileTransferOutRunning, path);
+
+        QElapsedTimer timer;
+        timer.start();
+        for ( quint64 position = 0; position < (quint64) size; position += CHUNK_SIZE ) {
+            const size_t length = qMin((quint64) CHUNK_SIZE, size - position);
+            const quint8* chunk = transfer->mapChunk(position, length);
+            if ( chunk == NULL ) {
+                registry.remove(transfer);
+                return -1;
+            }
+            memcpy(sent, chunk, length);
+            sink += sent[0];
+        }
+        const double result = (double) timer.nsecsElapsed() / (size / CHUNK_SIZE);
+
+        registry.remove(transfer);
+        return result;
+    }
+
+    bool bench(qint64 size)
+    {
+        QTemporaryFile temp;
+        if ( !writeFile(temp, size) ) {
+            fprintf(stderr, "Unable to write %lld byte file\n", size);
+            return false;
+        }
+
+        QFile file(temp.fileName());
+        if ( !file.open(QIODevice::ReadOnly) ) {
+            fprintf(stderr, "Unable to open %s\n", qPrintable(temp.fileName()));
+            return false;
+        }
+
+        TransferRegistry registry;
+        double read = -1;
+        double map = -1;
+        for ( int i = 0; i < PASSES; i++ ) {
+            const double readNs = readPass(file, size);
+            const double mapNs = mapPass(registry, temp.fileName(), size);
+            if ( readNs < 0 || mapNs < 0 ) {
+                fprintf(stderr, "Chunk serving failed\n");
+                return false;
+            }
+
+            read = read < 0 ? readNs : qMin(read, readNs);
+            map = map < 0 ? mapNs : qMin(map, mapNs);
+        }
+
+        printf("%4lld MiB  seek+read %6.0f ns/chunk  mapChunk %6.0f ns/chunk  (%.1fx)\n",
+               size / (1024 * 1024), read, map, read / map);
+        return true;
+    }
+
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    printf("%u byte chunks, best of %d passes, warm page cache\n", (unsigned) CHUNK_SIZE, PASSES);
+    for ( int i = 0; i < SIZE_COUNT; i++ ) {
+        if ( !bench(SIZES[i]) ) {
+            return 1;
+        }
+    }
+
+    return sink == -1 ? 1 : 0;
+}
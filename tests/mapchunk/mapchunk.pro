@@ -0,0 +1,24 @@
+# standalone benchmark of outgoing chunk serving, seek and read against Transfer::mapChunk,
+# not a testcase, run by hand: ./bench_mapchunk
+TEMPLATE = app
+TARGET = bench_mapchunk
+QT -= gui
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+TOX_PATH = ../../extra/i486
+INCLUDEPATH += ../../src $$TOX_PATH/include
+
+SOURCES += \
+    bench_mapchunk.cpp \
+    ../../src/transferregistry.cpp \
+    ../../src/utils.cpp
+
+HEADERS += \
+    ../../src/transferregistry.h \
+    ../../src/utils.h
+
+LIBS += \
+-L$$PWD/$$TOX_PATH/lib \
+-ltoxcore \
+-lsodium
@@ -0,0 +1,32 @@
+# standalone check that the hot path DB queries never scan the whole events table,
+# runs DBData against a scratch database in the Qt test data location
+TEMPLATE = app
+TARGET = tst_queryplans
+QT += sql
+QT -= gui
+CONFIG += console c++11 testcase
+CONFIG -= app_bundle
+
+TOX_PATH = ../../extra/i486
+INCLUDEPATH += ../../src $$TOX_PATH/include
+
+SOURCES += \
+    tst_queryplans.cpp \
+    ../../src/dbdata.cpp \
+    ../../src/encryptsave.cpp \
+    ../../src/event.cpp \
+    ../../src/friendrequest.cpp \
+    ../../src/utils.cpp
+
+HEADERS += \
+    ../../src/dbdata.h \
+    ../../src/encryptsave.h \
+    ../../src/event.h \
+    ../../src/friendrequest.h \
+    ../../src/utils.h
+
+LIBS += \
+-L$$PWD/$$TOX_PATH/lib \
+-ltoxencryptsave \
+-ltoxcore \
+-lsodium
@@ -0,0 +1,91 @@
+#include "dbdata.h"
+#include "encryptsave.h"
+#include <QCoreApplication>
+#include <QStandardPaths>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QDir>
+#include <QFile>
+#include <stdio.h>
+
+using namespace JTOX;
+
+namespace {
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if ( !condition ) {
+            fprintf(stderr, "FAIL: %s\n", what);
+            failures++;
+        }
+    }
+
+    const QString dbPath()
+    {
+        return QDir(QStandardPaths::writableLocation(QStandardPaths::DataLocation)).absoluteFilePath("jtox.sqlite");
+    }
+
+    void removeDatabase()
+    {
+        QFile::remove(dbPath());
+        QFile::remove(dbPath() + "-wal");
+        QFile::remove(dbPath() + "-shm");
+    }
+
+    void printScans(const QStringList& scans)
+    {
+        foreach ( const QString& scan, scans ) {
+            fprintf(stderr, "  %s\n", qPrintable(scan));
+        }
+    }
+
+    void testFreshSchema(EncryptSave& encryptSave)
+    {
+        DBData db(encryptSave, "tst_fresh"); // named, so no worker thread
+        const QStringList scans = db.tableScans();
+        printScans(scans);
+        check(scans.isEmpty(), "hot path queries use indexes on a fresh schema");
+    }
+
+    // the check itself must catch a scan, not just pass
+    void testMissingIndex(EncryptSave& encryptSave)
+    {
+        {
+            QSqlDatabase raw = QSqlDatabase::addDatabase("QSQLITE", "tst_raw");
+            raw.setDatabaseName(dbPath());
+            check(raw.open(), "open the database directly");
+            QSqlQuery query(raw);
+            check(query.exec("DROP INDEX events_friend_id_id"), "drop the per friend index");
+            query.finish();
+            raw.close();
+        }
+        QSqlDatabase::removeDatabase("tst_raw");
+
+        DBData db(encryptSave, "tst_missing"); // schema version is current, the index stays dropped
+        check(!db.tableScans().isEmpty(), "scans reported without the per friend index");
+    }
+
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("tst_queryplans");
+    QStandardPaths::setTestModeEnabled(true); // keeps the real jtox.sqlite out of it
+    removeDatabase();
+
+    EncryptSave encryptSave;
+    testFreshSchema(encryptSave);
+    testMissingIndex(encryptSave);
+    removeDatabase();
+
+    if ( failures > 0 ) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("All query plan checks passed\n");
+    return 0;
+}
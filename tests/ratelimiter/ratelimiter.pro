@@ -0,0 +1,14 @@
+# standalone check of the transfer rate limiter, plain C++ so it runs on the build host
+TEMPLATE = app
+TARGET = tst_ratelimiter
+CONFIG += console c++11 testcase
+CONFIG -= app_bundle qt
+
+INCLUDEPATH += ../../src
+
+SOURCES += \
+    tst_ratelimiter.cpp \
+    ../../src/ratelimiter.cpp
+
+HEADERS += \
+    ../../src/ratelimiter.h
@@ -0,0 +1,121 @@
+#include "ratelimiter.h"
+#include <stdio.h>
+
+using namespace JTOX;
+
+namespace {
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if ( !condition ) {
+            fprintf(stderr, "FAIL: %s\n", what);
+            failures++;
+        }
+    }
+
+    // fake clock in nanoseconds, moved by hand
+    int64_t now = 0;
+
+    void advance(int64_t msecs)
+    {
+        now += msecs * 1000000;
+    }
+
+    RateLimiter makeLimiter(int rate)
+    {
+        now = 0;
+        RateLimiter limiter([]() { return now; });
+        limiter.setRate(rate);
+        return limiter;
+    }
+
+    void testUnlimited()
+    {
+        RateLimiter limiter = makeLimiter(0);
+        check(limiter.take(1 << 30), "unlimited take always succeeds");
+        check(limiter.wait() == 0, "unlimited never waits");
+    }
+
+    void testBurstAndDeficit()
+    {
+        RateLimiter limiter = makeLimiter(1000);
+        check(limiter.take(1000), "full bucket covers a second of data");
+        check(!limiter.take(500), "overdraw reports deficit");
+        check(limiter.wait() == 501, "wait covers the deficit");
+
+        advance(250);
+        check(limiter.wait() == 251, "refill shortens the wait");
+        advance(251);
+        check(limiter.wait() == 0, "deficit paid off after waiting");
+    }
+
+    void testBucketCap()
+    {
+        RateLimiter limiter = makeLimiter(1000);
+        check(limiter.take(1000), "drain the bucket");
+        advance(10000); // idle for long
+        check(limiter.take(1000), "refilled up to a second");
+        check(!limiter.take(1), "never more than a second of burst");
+    }
+
+    void testSubByteRefill()
+    {
+        RateLimiter limiter = makeLimiter(3);
+        check(limiter.take(3), "drain the bucket");
+        limiter.take(30);
+        for ( int i = 0; i < 100; i++ ) { // 10s in steps shorter than a byte's worth
+            advance(100);
+            limiter.wait();
+        }
+        check(limiter.wait() == 0, "fractions of a byte add up over time");
+    }
+
+    // sender pushing chunks whenever allowed, like tox chunk requests held by the limiter
+    void testThroughput(int rate, int chunk)
+    {
+        RateLimiter limiter = makeLimiter(rate);
+        const int64_t duration = 20000; // ms
+        int64_t sent = 0;
+        while ( now < duration * 1000000 ) {
+            const int wait = limiter.wait();
+            if ( wait > 0 ) {
+                advance(wait);
+                continue;
+            }
+
+            limiter.take(chunk);
+            sent += chunk;
+            advance(1);
+        }
+
+        // the initial full bucket plus one overdrawn chunk is all the slack there is
+        const int64_t limit = rate * duration / 1000 + rate + chunk;
+        char what[128];
+        snprintf(what, sizeof(what), "throughput at %d B/s within limit (%lld of %lld)", rate, (long long) sent, (long long) limit);
+        check(sent <= limit, what);
+        snprintf(what, sizeof(what), "throughput at %d B/s close to limit (%lld of %lld)", rate, (long long) sent, (long long) limit);
+        check(sent >= limit * 9 / 10, what);
+    }
+
+}
+
+int main()
+{
+    testUnlimited();
+    testBurstAndDeficit();
+    testBucketCap();
+    testSubByteRefill();
+    testThroughput(50 * 1024, 1371); // tox sized chunks
+    testThroughput(1024, 1371); // limit below one chunk per second
+    testThroughput(10 * 1024 * 1024, 65536);
+
+    if ( failures > 0 ) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    printf("All rate limiter checks passed\n");
+    return 0;
+}
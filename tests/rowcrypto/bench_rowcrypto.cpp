@@ -0,0 +1,96 @@
+#include "encryptsave.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <sodium.h>
+#include <stdio.h>
+
+using namespace JTOX;
+
+namespace {
+
+    const int ROWS = 20000; // about a long chat history
+    const int SIZES[] = { 32, 256, 4096 }; // short message, long message, pasted text
+    const int SIZE_COUNT = 3;
+
+    volatile int sink = 0; // keeps results alive so nothing gets optimized out
+
+    double nsPerRow(const QElapsedTimer& timer)
+    {
+        return (double) timer.nsecsElapsed() / ROWS;
+    }
+
+    void bench(EncryptSave& encryptSave, int size)
+    {
+        const QString message(size, QChar('x'));
+        QList<QByteArray> legacyRows;
+        QList<QByteArray> rows;
+        QElapsedTimer timer;
+
+        timer.start();
+        for ( int i = 0; i < ROWS; i++ ) {
+            legacyRows << encryptSave.encrypt(message);
+        }
+        const double encryptRaw = nsPerRow(timer);
+
+        timer.start();
+        for ( int i = 0; i < ROWS; i++ ) {
+            rows << encryptSave.encryptRow(message);
+        }
+        const double encryptRow = nsPerRow(timer);
+
+        timer.start();
+        foreach ( const QByteArray& row, legacyRows ) {
+            sink += encryptSave.decryptRaw(row).size();
+        }
+        const double decryptRaw = nsPerRow(timer);
+
+        timer.start();
+        foreach ( const QByteArray& row, rows ) {
+            sink += encryptSave.decryptRow(row).size();
+        }
+        const double decryptRow = nsPerRow(timer);
+
+        // what the batch path does, key copied once and one growing buffer
+        QByteArray key(crypto_secretbox_KEYBYTES, 0);
+        key.fill(7);
+        QByteArray buffer;
+        timer.start();
+        foreach ( const QByteArray& row, rows ) {
+            sink += encryptSave.openRow(key, row, buffer).size();
+        }
+        const double openRow = nsPerRow(timer);
+
+        timer.start();
+        sink += encryptSave.decryptRows(rows).size();
+        const double decryptRows = nsPerRow(timer);
+
+        printf("%5d B  seal %7.0f ns (pass key %7.0f)  open %7.0f ns (pass key %7.0f, reused buffer %7.0f, batch %7.0f)  overhead %d B (pass key %d B)\n",
+               size, encryptRow, encryptRaw, decryptRow, decryptRaw, openRow, decryptRows,
+               rows.first().size() - size, legacyRows.first().size() - size);
+    }
+
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    if ( sodium_init() < 0 ) {
+        fprintf(stderr, "Unable to init sodium\n");
+        return 1;
+    }
+
+    EncryptSave encryptSave;
+    encryptSave.setPassword("benchmark password"); // derived once, like a session
+    QByteArray indexKey(crypto_generichash_KEYBYTES, 0);
+    QByteArray rowKey(crypto_secretbox_KEYBYTES, 0);
+    rowKey.fill(7); // same as the key handed to openRow above
+    encryptSave.setDBKeys(indexKey, rowKey);
+
+    printf("%d rows per size, ns per row\n", ROWS);
+    for ( int i = 0; i < SIZE_COUNT; i++ ) {
+        bench(encryptSave, SIZES[i]);
+    }
+
+    return sink == -1 ? 1 : 0;
+}
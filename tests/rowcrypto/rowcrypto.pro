@@ -0,0 +1,25 @@
+# standalone benchmark of the DB row format against pass key encryption of message rows,
+# not a testcase, run by hand: ./bench_rowcrypto
+TEMPLATE = app
+TARGET = bench_rowcrypto
+QT -= gui
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+TOX_PATH = ../../extra/i486
+INCLUDEPATH += ../../src $$TOX_PATH/include
+
+SOURCES += \
+    bench_rowcrypto.cpp \
+    ../../src/encryptsave.cpp \
+    ../../src/utils.cpp
+
+HEADERS += \
+    ../../src/encryptsave.h \
+    ../../src/utils.h
+
+LIBS += \
+-L$$PWD/$$TOX_PATH/lib \
+-ltoxencryptsave \
+-ltoxcore \
+-lsodium